@@ -14,6 +14,7 @@ lv_obj_t* LightComponent::build(lv_obj_t* parent, const CompCtx& ctx) {
     lv_obj_t* txt = lv_label_create(btn);
     lv_label_set_text(txt, initial ? "ON" : "OFF");
     lv_obj_center(txt);
+    state_label = txt;
 
     // caption label
     lv_obj_t* cap = lv_label_create(parent);
@@ -40,13 +41,12 @@ lv_obj_t* LightComponent::build(lv_obj_t* parent, const CompCtx& ctx) {
         bool new_state = !on;
         lv_label_set_text(lbl, new_state ? "ON" : "OFF");
 
-        // Inform server via RPC (non-blocking-ish: zero timeout)
-        JsonDocument params;
-        params["comp_id"] = ((LightCbData*)lv_event_get_user_data(e)) && ((LightCbData*)lv_event_get_user_data(e))->comp_id
-                              ? ((LightCbData*)lv_event_get_user_data(e))->comp_id : "";
-        JsonVariant stateDict = params["state"].to<JsonVariant>();
-        stateDict["power"] = new_state ? "on" : "off";
-        rpcSystem.getRPC().call("update_state", params.as<JsonVariant>(), 0);
+        // Inform server; rapid toggles collapse to the newest state
+        LightCbData* d = (LightCbData*)lv_event_get_user_data(e);
+        if (!d || !d->comp_id) return;
+        JsonDocument state;
+        state["power"] = new_state ? "on" : "off";
+        rpcSystem.getStateUpdates().push(d->comp_id, state.as<JsonVariantConst>());
     }, LV_EVENT_CLICKED, ud);
 
     // Cleanup user data when button is deleted
@@ -61,3 +61,9 @@ lv_obj_t* LightComponent::build(lv_obj_t* parent, const CompCtx& ctx) {
 
     return parent;
 }
+
+void LightComponent::applyState(JsonVariantConst state) {
+    if (!state_label || !state["power"].is<const char*>()) return;
+    bool on = strcmp(state["power"] | "off", "on") == 0;
+    lv_label_set_text(state_label, on ? "ON" : "OFF");
+}
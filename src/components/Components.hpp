@@ -4,4 +4,8 @@
 class LightComponent : public IComponent {
 public:
     lv_obj_t* build(lv_obj_t* parent, const CompCtx& ctx) override;
+    void applyState(JsonVariantConst state) override; // {"power": "on" | "off"}
+
+private:
+    lv_obj_t* state_label = nullptr;
 };
\ No newline at end of file
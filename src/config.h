@@ -29,9 +29,29 @@
 #define ALARM 1
 #define ROBOROCK 1
 
+//WiFi
+#define WIFI_FAST_CONNECT 1  // after deep sleep, reconnect straight to the last AP and address
+// Fixed address instead of DHCP; leave WIFI_STATIC_IP undefined to use DHCP
+// #define WIFI_STATIC_IP      192, 168, 1, 80
+// #define WIFI_STATIC_GATEWAY 192, 168, 1, 1
+// #define WIFI_STATIC_SUBNET  255, 255, 255, 0
+// #define WIFI_STATIC_DNS     192, 168, 1, 1
+
 //MQTT
 #define MQTT_BROKER "192.168.1.67"
+#define MQTT_USE_TLS 0               // 1: TLS on MQTT_TLS_PORT, sessions resumed across deep sleep
+#define MQTT_TLS_PORT 8883
+// PEM of the CA that signed the broker certificate. Required with TLS: without
+// it no connection is made, unless MQTT_TLS_INSECURE is defined (encrypted, but
+// the broker is not verified; for testing only)
+// #define MQTT_CA_CERT "-----BEGIN CERTIFICATE-----\n...\n-----END CERTIFICATE-----\n"
+// #define MQTT_TLS_INSECURE
+#define MQTT_TLS_BENCHMARK 0         // >0: on first connect, time this many full and resumed handshakes
+#if MQTT_USE_TLS
+#define MQTT_PORT MQTT_TLS_PORT
+#else
 #define MQTT_PORT 1883
+#endif
 #define MQTT_CLIENT_ID "RemoteControl"
 #define MQTT_DEVICE_NAME "Display Remote Control"
 #define MQTT_MANUFACTURER "Wasserman Inc."
@@ -39,10 +59,19 @@
 #define MQTT_UPDATE_TOPIC "display/wass1/updates"
 #define MQTT_ALARM_TOPIC "display/wass1/alarm"
 
+//RPC transport
+#define RPC_TRANSPORT_UDP 0          // 1: JSON-RPC over UDP datagrams to a LAN gateway instead of MQTT
+#define RPC_UDP_SERVER MQTT_BROKER
+#define RPC_UDP_PORT 1885
+#define RPC_BENCHMARK_CALLS 0        // >0: time this many ping calls once the session is up
+
 //Sleep
 #define SLEEP_THRESHOLD 30000  // 30 seconds
 #define ENABLE_SLEEP 1
 
+//Diagnostics
+#define MEMORY_LOG_INTERVAL 60000  // heap, JSON arena and update queue stats, 0 to disable
+
 //Battery
 #define ENABLE_BATTERY 0
 #define ALERT_BATTERY_LEVEL 20 // Percentage
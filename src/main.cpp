@@ -2,7 +2,9 @@
 #include <TFT_eSPI.h>
 #include <XPT2046_Touchscreen.h>
 #include "esp_sleep.h"
+#include "esp_heap_caps.h"
 #include "utils/utils.h"
+#include "utils/boot_stages.h"
 #include "config.h"
 #include "spiffs_handler.h"
 #include "fonts/font_styles.h"
@@ -10,6 +12,10 @@
 #include "secrets.h"
 #include "rpc/RPCSystem.hpp"
 #include "renderer/ScreenRenderer.hpp"
+#include "rpc/ConfigCache.hpp"
+#include "renderer/ComponentUpdateQueue.hpp"
+#include "rpc/ConfigTopics.hpp"
+#include "rpc/RPCBenchmark.hpp"
 
 // -------------------- Pins --------------------
 #define XPT2046_IRQ 36   // T_IRQ
@@ -33,7 +39,7 @@ RPCSystem rpcSystem(
     WIFI_SSID,
     WIFI_PASSWORD,
     MQTT_BROKER,
-    1883,
+    MQTT_PORT,
     MQTT_USER,
     MQTT_PASSWORD
 );
@@ -45,6 +51,20 @@ unsigned long init_millis = 0;
 bool init_flag = false;
 unsigned long lastLVGLTick = 0;
 
+// Config path: transfer -> cache -> topic subscriptions -> renderer
+ComponentUpdateQueue componentUpdates;
+ConfigTopics configTopics(rpcSystem.getRPC(), renderer, componentUpdates);
+ConfigCache configCache(configTopics);
+ConfigTransfer configTransfer(rpcSystem.getRPC(), configCache);
+unsigned long first_screen_ms = 0; // boot to first interactive screen
+RPCBenchmark rpcBenchmark(rpcSystem.getRPC());
+bool benchmark_started = false;
+lv_obj_t* link_status_label = NULL;
+lv_obj_t* splash = NULL;
+unsigned long last_memory_log = 0;
+size_t min_largest_block = SIZE_MAX;
+RPCSystem::LinkState shown_link_state = RPCSystem::LinkState::Idle;
+
 // -------------------- Utility --------------------
 void log_print(lv_log_level_t level, const char * buf) {
   LV_UNUSED(level);
@@ -55,6 +75,7 @@ void log_print(lv_log_level_t level, const char * buf) {
 void go_to_sleep() {
   #if ENABLE_SLEEP
   Serial.println("Going to sleep...");
+  rpcSystem.prepareForSleep();
   Serial.flush();
   delay(500);
   esp_sleep_enable_ext0_wakeup(GPIO_NUM_36, 0);
@@ -116,25 +137,103 @@ void init_battery_system() {
   }
   battery_update();
 }
-void init_rpc_system() {
-  if (!rpcSystem.begin()) {
-    Serial.println("RPCSystem begin failed");
-    show_message_box("Could not connect to RPC server", "Please check MQTT config");
-    while (true) { delay(1000); }
-  }
-  ESP32RPC& rpc = rpcSystem.getRPC();
-  JsonDocument params; // empty object
-  JsonDocument res = rpc.call("get_config", params.as<JsonVariant>(), 5000);
-  // If response didn't contain a result or timed out, res stays empty
-  if (res.as<JsonVariantConst>().isNull()) {
-    Serial.println("get_config returned null");
+void show_splash() {
+  splash = lv_obj_create(lv_scr_act());
+  lv_obj_set_size(splash, LV_PCT(100), LV_PCT(100));
+  lv_obj_clear_flag(splash, LV_OBJ_FLAG_SCROLLABLE);
+
+  lv_obj_t* spinner = lv_spinner_create(splash);
+  lv_obj_set_size(spinner, 48, 48);
+  lv_obj_center(spinner);
+
+  lv_obj_t* label = lv_label_create(splash);
+  lv_label_set_text(label, "Connecting...");
+  lv_obj_align(label, LV_ALIGN_CENTER, 0, 44);
+
+  lv_timer_handler(); // draw it now, before anything else runs
+}
+
+void hide_splash() {
+  if (!splash) return;
+  lv_obj_del(splash);
+  splash = NULL;
+}
+
+void init_rpc_system() {
+  // Connecting runs in a background task; the link status icon shows progress
+  if (!rpcSystem.begin(true)) {
+    Serial.println("RPCSystem begin failed");
+    show_message_box("Could not start RPC system", "Please check SPIFFS");
+  }
+  // Server pushed state is queued here and applied once per frame from loop()
+  rpcSystem.getRPC().registerMethod("component_update", &ComponentUpdateQueue::onComponentUpdate, &componentUpdates,
+                                     ESP32RPC::Dispatch::OnArrival);
+
+  link_status_label = lv_label_create(lv_layer_top());
+  lv_label_set_text(link_status_label, LV_SYMBOL_WIFI);
+  lv_obj_align(link_status_label, LV_ALIGN_TOP_RIGHT, -4, 4);
+}
+
+void report_first_screen(const char* source) {
+  first_screen_ms = millis();
+  hide_splash();
+  boot_mark(BOOT_CONFIG);
+  boot_mark(BOOT_FIRST_SCREEN);
+  Serial.printf("First screen after %lu ms (config from %s)\n", first_screen_ms, source);
+  boot_report();
+}
+
+// Fetches the UI config in chunks once the link is ready. After a dropped link
+// the transfer continues from the last chunk received instead of starting over.
+void request_config() {
+  if (configTransfer.isDone() && !first_screen_ms) report_first_screen("server");
+  if (configTransfer.isDone() || configTransfer.isActive() || !rpcSystem.isReady()) return;
+  if (!configTransfer.isStarted()) {
+    configTransfer.setIfNoneMatch(configCache.hash());
+    configTransfer.start();
   } else {
-    // Build screens from config
-    renderer.buildFromConfig(res.as<JsonVariantConst>());
-    renderer.showScreenById("scr1"); // default first screen
+    configTransfer.resume();
   }
-}
+}
+
+void update_link_status() {
+  RPCSystem::LinkState s = rpcSystem.getState();
+  if (!link_status_label || s == shown_link_state) return;
+  shown_link_state = s;
+
+  uint32_t color = COLORS_ORANGE; // connecting
+  if (s == RPCSystem::LinkState::Ready) color = COLORS_GREEN;
+  else if (s == RPCSystem::LinkState::Backoff) color = COLORS_RED;
+  lv_obj_set_style_text_color(link_status_label, lv_color_hex(color), 0);
+  Serial.printf("Link state: %s, outbound queue depth: %u\n",
+                RPCSystem::stateName(s), (unsigned)rpcSystem.outboundDepth());
+}
 
+// Internal heap fragmentation over uptime: how far the largest free block
+// falls behind total free memory, how much RPC traffic the arena absorbed,
+// and how the inbound update queue copes with the server's rate
+void log_diagnostics() {
+  if (MEMORY_LOG_INTERVAL == 0 || millis() - last_memory_log < MEMORY_LOG_INTERVAL) return;
+  last_memory_log = millis();
+
+  const uint32_t caps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+  size_t free_bytes = heap_caps_get_free_size(caps);
+  size_t largest = heap_caps_get_largest_free_block(caps);
+  if (largest < min_largest_block) min_largest_block = largest;
+  unsigned frag = free_bytes ? 100 - (unsigned)(largest * 100 / free_bytes) : 0;
+
+  JsonArena &arena = JsonArena::instance();
+  Serial.printf("Heap: %u free, largest block %u (min %u), min ever %u, fragmentation %u%%\n",
+                (unsigned)free_bytes, (unsigned)largest, (unsigned)min_largest_block,
+                (unsigned)heap_caps_get_minimum_free_size(caps), frag);
+  Serial.printf("JSON arena: high water %u/%u, %u resets, %u heap fallbacks\n",
+                (unsigned)arena.highWater(), (unsigned)JsonArena::SIZE,
+                (unsigned)arena.resetCount(), (unsigned)arena.fallbackCount());
+  Serial.printf("Component updates: %u received, %u applied, %u coalesced, %u dropped\n",
+                (unsigned)componentUpdates.receivedCount(), (unsigned)componentUpdates.appliedCount(),
+                (unsigned)componentUpdates.coalescedCount(), (unsigned)componentUpdates.droppedCount());
+}
+
 // -------------------- Setup & Loop --------------------
 void setup() {
   Serial.begin(115200);
@@ -143,16 +242,32 @@ void setup() {
 
   pinMode(TOUCH_WAKEUP_PIN, INPUT);
 
+  // Display first so the splash is up while the network connects in the background
   init_spiffs();
+  boot_mark(BOOT_SPIFFS);
   init_lvgl_display();
+  show_splash();
+  boot_mark(BOOT_DISPLAY);
   init_rpc_system();
+  boot_mark(BOOT_RPC_START);
+  // Draw the last known config right away; the server is asked whether it changed
+  if (configCache.load()) report_first_screen("cache");
 
   init_millis = millis();
   last_touch_time = millis();
 }
 
 void loop() {
-  rpcSystem.getRPC().loop();
+  rpcSystem.loop();
+  request_config();
+  update_link_status();
+  log_diagnostics();
+  if (RPC_BENCHMARK_CALLS > 0 && !benchmark_started && rpcSystem.isReady()) {
+    rpcBenchmark.start(RPC_BENCHMARK_CALLS, rpcSystem.getTransport().name());
+    benchmark_started = true;
+  }
+  rpcBenchmark.loop();
+  componentUpdates.apply(renderer); // one batch per frame, however fast updates arrive
   lv_timer_handler();  
   delay(5);
 
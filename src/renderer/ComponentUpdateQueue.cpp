@@ -0,0 +1,76 @@
+#include "ComponentUpdateQueue.hpp"
+
+ComponentUpdateQueue::Entry* ComponentUpdateQueue::find(const char* comp_id) {
+    for (size_t i = 0; i < MAX_COMPONENTS; i++) {
+        if (entries[i].used && strcmp(entries[i].comp_id, comp_id) == 0) return &entries[i];
+    }
+    return nullptr;
+}
+
+ComponentUpdateQueue::Entry* ComponentUpdateQueue::claim() {
+    Entry* recycle = nullptr;
+    for (size_t i = 0; i < MAX_COMPONENTS; i++) {
+        if (!entries[i].used) return &entries[i];
+        if (!entries[i].dirty && !recycle) recycle = &entries[i];
+    }
+    return recycle; // forgets that component's last seq, which only costs one stale check
+}
+
+bool ComponentUpdateQueue::push(const char* comp_id, JsonVariantConst state, uint32_t seq) {
+    received++;
+    size_t len = strlen(comp_id);
+    if (len == 0 || len >= MAX_COMP_ID_LEN) {
+        dropped++;
+        return false;
+    }
+
+    Entry* e = find(comp_id);
+    if (e) {
+        if (seq != 0 && seq <= e->seq) {
+            dropped++; // older than what is shown or queued
+            return false;
+        }
+        if (e->dirty) coalesced++;
+    } else {
+        e = claim();
+        if (!e) {
+            dropped++;
+            return false;
+        }
+        memcpy(e->comp_id, comp_id, len + 1);
+        e->used = true;
+        e->dirty = false;
+        e->seq = 0;
+    }
+
+    if (seq != 0) e->seq = seq;
+    e->state.set(state);
+    if (!e->dirty) {
+        e->dirty = true;
+        pending++;
+    }
+    return true;
+}
+
+size_t ComponentUpdateQueue::apply(StateSink &sink) {
+    if (pending == 0) return 0;
+    size_t n = 0;
+    for (size_t i = 0; i < MAX_COMPONENTS; i++) {
+        Entry &e = entries[i];
+        if (!e.dirty) continue;
+        sink.applyState(String(e.comp_id), e.state.as<JsonVariantConst>());
+        e.dirty = false;
+        e.state.clear();
+        n++;
+    }
+    pending = 0;
+    applied += n;
+    return n;
+}
+
+bool ComponentUpdateQueue::onComponentUpdate(JsonVariantConst params, JsonVariant result, void* ctx) {
+    ComponentUpdateQueue* self = (ComponentUpdateQueue*)ctx;
+    // Queued, not applied: the reply only confirms receipt
+    result["queued"] = self->push(params["component"] | "", params["data"], params["seq"] | 0u);
+    return true;
+}
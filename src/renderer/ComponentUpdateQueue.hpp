@@ -0,0 +1,57 @@
+#pragma once
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Where queued updates are applied: the ScreenRenderer on the device
+class StateSink {
+public:
+    virtual ~StateSink() = default;
+    virtual bool applyState(const String& comp_id, JsonVariantConst state) = 0; // false if no such component
+};
+
+// State pushed by the server (component_update), applied to the UI at most
+// once per frame. Updates for the same component collapse to the newest
+// one, and an update carrying a seq no newer than what the component already
+// has is dropped as obsolete. The queue is bounded: when every slot holds
+// another component's pending update, the new one is dropped.
+class ComponentUpdateQueue {
+public:
+    static const size_t MAX_COMPONENTS = 32;
+    static const size_t MAX_COMP_ID_LEN = 48; // including the terminator
+
+    bool push(const char* comp_id, JsonVariantConst state, uint32_t seq = 0);
+    size_t apply(StateSink &sink); // applies every pending update, at most MAX_COMPONENTS, returns how many
+    size_t pendingCount() const { return pending; }
+
+    // component_update handler for ESP32RPC::registerMethod, ctx = the queue.
+    // It only queues, so it is registered to run on arrival: a storm is
+    // coalesced here rather than refused by the RPC layer's request queue.
+    // params: {"component": "<comp_id>", "data": {...}, "seq": n (optional)}
+    static bool onComponentUpdate(JsonVariantConst params, JsonVariant result, void* ctx);
+
+    // counters since boot
+    uint32_t receivedCount() const { return received; }
+    uint32_t coalescedCount() const { return coalesced; } // replaced before being applied
+    uint32_t droppedCount() const { return dropped; }     // obsolete, or no free slot
+    uint32_t appliedCount() const { return applied; }
+
+private:
+    struct Entry {
+        char comp_id[MAX_COMP_ID_LEN] = "";
+        bool used = false;
+        bool dirty = false;    // holds an update not yet applied
+        uint32_t seq = 0;      // newest seq seen, kept after applying to spot stale updates
+        JsonDocument state;
+    };
+
+    Entry entries[MAX_COMPONENTS];
+    size_t pending = 0;
+
+    uint32_t received = 0;
+    uint32_t coalesced = 0;
+    uint32_t dropped = 0;
+    uint32_t applied = 0;
+
+    Entry* find(const char* comp_id);
+    Entry* claim(); // free slot, or an applied entry to recycle
+};
@@ -1,5 +1,7 @@
 #include "ScreenRenderer.hpp"
 #include "components/Components.hpp" // register concrete components
+#include "esp_heap_caps.h"
+#include <algorithm>
 #include <cstring>
 #include <cstdlib>
 
@@ -16,91 +18,161 @@ void ScreenRenderer::ensureRegistrySetup() {
 }
 
 void ScreenRenderer::buildFromConfig(JsonVariantConst cfg) {
+    beginConfig(cfg);
+    if (cfg["screens"].is<JsonArrayConst>()) {
+        for (JsonVariantConst s : cfg["screens"].as<JsonArrayConst>()) addScreen(s);
+    }
+    endConfig();
+}
+
+void ScreenRenderer::removeScreen(std::map<String, ScreenInfo>::iterator it) {
+    for (auto &c : it->second.components) {
+        auto idx = components.find(c.first);
+        if (idx != components.end() && idx->second == c.second.get()) components.erase(idx);
+    }
+    if (it->second.root) lv_obj_del(it->second.root);
+    screens.erase(it);
+}
+
+void ScreenRenderer::clear() {
+    while (!screens.empty()) removeScreen(screens.begin());
+    shown = "";
+    shown_hash = "";
+}
+
+// LVGL allocates from the system heap (LV_STDLIB_CLIB), so its headroom is
+// the internal heap's largest free block
+size_t ScreenRenderer::headroom() {
+    return heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+void ScreenRenderer::beginConfig(JsonVariantConst header) {
     ensureRegistrySetup();
-    screens.clear();
-
-    if (!cfg["screens"].is<JsonArrayConst>()) return;
-    JsonArrayConst arr = cfg["screens"].as<JsonArrayConst>();
-
-    for (JsonVariantConst s : arr) {
-        ScreenInfo info;
-        info.scr_id = String(s["scr_id"] | "");
-        info.name = String(s["name"] | "");
-        info.back_screen = String(s["back_screen"] | "");
-
-        // root container for this screen
-        lv_obj_t* root = lv_obj_create(lv_scr_act());
-        lv_obj_set_size(root, LV_HOR_RES, LV_VER_RES);
-        lv_obj_set_flex_flow(root, LV_FLEX_FLOW_ROW_WRAP);
-        lv_obj_set_style_pad_all(root, 10, 0);
-        lv_obj_add_flag(root, LV_OBJ_FLAG_SCROLLABLE);
-
-        // back button if needed
-        if (!info.back_screen.isEmpty()) {
-            lv_obj_t* back = lv_btn_create(root);
-            lv_obj_t* backlbl = lv_label_create(back);
-            lv_label_set_text(backlbl, "<");
-
-            BackCbData* ud = (BackCbData*)malloc(sizeof(BackCbData));
-            if (ud) {
-                ud->self = this;
-                const char* tgt = info.back_screen.c_str();
-                size_t len = strlen(tgt);
-                ud->target = (char*)malloc(len + 1);
-                if (ud->target) {
-                    memcpy(ud->target, tgt, len + 1);
-
-                    lv_obj_add_event_cb(back, [](lv_event_t* e){
-                        BackCbData* d = (BackCbData*)lv_event_get_user_data(e);
-                        if (!d || !d->self || !d->target) return;
-                        d->self->showScreenById(String(d->target));
-                    }, LV_EVENT_CLICKED, ud);
-
-                    // Cleanup when the button is deleted
-                    lv_obj_add_event_cb(back, [](lv_event_t* e){
-                        BackCbData* d = (BackCbData*)lv_event_get_user_data(e);
-                        if (!d) return;
-                        if (d->target) free(d->target);
-                        free(d);
-                    }, LV_EVENT_DELETE, ud);
-                } else {
-                    free(ud);
-                }
+    config_hash = String(header["hash"] | "");
+    unchanged = !config_hash.isEmpty() && config_hash == shown_hash;
+    if (unchanged) Serial.printf("Config %s is already on display\n", config_hash.c_str());
+    received.clear(); // a transfer that restarted sends every screen again
+}
+
+void ScreenRenderer::endConfig() {
+    if (unchanged) return;
+    // Screens the new config dropped
+    for (auto it = screens.begin(); it != screens.end();) {
+        auto next = std::next(it);
+        if (std::find(received.begin(), received.end(), it->first) == received.end()) removeScreen(it);
+        it = next;
+    }
+    received.clear();
+    shown_hash = config_hash;
+    showScreenById(DEFAULT_SCREEN);
+}
+
+void ScreenRenderer::addScreen(JsonVariantConst s) {
+    if (unchanged) return;
+    ScreenInfo info;
+    info.scr_id = String(s["scr_id"] | "");
+    info.name = String(s["name"] | "");
+    info.back_screen = String(s["back_screen"] | "");
+    received.push_back(info.scr_id);
+
+    // Not enough heap to hold both versions: the old one goes first
+    auto old = screens.find(info.scr_id);
+    if (old != screens.end() && headroom() < MIN_HEADROOM + screen_cost) {
+        Serial.printf("Low on heap, replacing screen %s in place\n", info.scr_id.c_str());
+        removeScreen(old);
+        old = screens.end();
+    }
+    size_t free_before = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+
+    // root container for this screen
+    lv_obj_t* root = lv_obj_create(lv_scr_act());
+    lv_obj_add_flag(root, LV_OBJ_FLAG_HIDDEN); // until it is shown
+    lv_obj_set_size(root, LV_HOR_RES, LV_VER_RES);
+    lv_obj_set_flex_flow(root, LV_FLEX_FLOW_ROW_WRAP);
+    lv_obj_set_style_pad_all(root, 10, 0);
+    lv_obj_add_flag(root, LV_OBJ_FLAG_SCROLLABLE);
+
+    // back button if needed
+    if (!info.back_screen.isEmpty()) {
+        lv_obj_t* back = lv_btn_create(root);
+        lv_obj_t* backlbl = lv_label_create(back);
+        lv_label_set_text(backlbl, "<");
+
+        BackCbData* ud = (BackCbData*)malloc(sizeof(BackCbData));
+        if (ud) {
+            ud->self = this;
+            const char* tgt = info.back_screen.c_str();
+            size_t len = strlen(tgt);
+            ud->target = (char*)malloc(len + 1);
+            if (ud->target) {
+                memcpy(ud->target, tgt, len + 1);
+
+                lv_obj_add_event_cb(back, [](lv_event_t* e){
+                    BackCbData* d = (BackCbData*)lv_event_get_user_data(e);
+                    if (!d || !d->self || !d->target) return;
+                    d->self->showScreenById(String(d->target));
+                }, LV_EVENT_CLICKED, ud);
+
+                // Cleanup when the button is deleted
+                lv_obj_add_event_cb(back, [](lv_event_t* e){
+                    BackCbData* d = (BackCbData*)lv_event_get_user_data(e);
+                    if (!d) return;
+                    if (d->target) free(d->target);
+                    free(d);
+                }, LV_EVENT_DELETE, ud);
+            } else {
+                free(ud);
             }
         }
+    }
 
-        // components container
-        lv_obj_t* grid = lv_obj_create(root);
-        lv_obj_set_width(grid, LV_PCT(100));
-        lv_obj_set_flex_flow(grid, LV_FLEX_FLOW_ROW_WRAP);
-        lv_obj_set_style_pad_all(grid, 8, 0);
-
-        // build components
-        if (s["components"].is<JsonArrayConst>()) {
-            for (JsonVariantConst c : s["components"].as<JsonArrayConst>()) {
-                CompCtx ctx;
-                ctx.comp_id = String(c["comp_id"] | "");
-                ctx.type    = String(c["type"] | "");
-                ctx.params  = c["params"];
-
-                std::unique_ptr<IComponent> comp(
-                    ComponentRegistry::instance().create(ctx.type)
-                );
-
-                if (!comp) {
-                    lv_obj_t* unknown = lv_label_create(grid);
-                    String t = "Unknown component: " + ctx.type;
-                    lv_label_set_text(unknown, t.c_str());
-                } else {
-                    comp->build(grid, ctx);
-                }
+    // components container
+    lv_obj_t* grid = lv_obj_create(root);
+    lv_obj_set_width(grid, LV_PCT(100));
+    lv_obj_set_flex_flow(grid, LV_FLEX_FLOW_ROW_WRAP);
+    lv_obj_set_style_pad_all(grid, 8, 0);
+
+    // build components
+    if (s["components"].is<JsonArrayConst>()) {
+        for (JsonVariantConst c : s["components"].as<JsonArrayConst>()) {
+            CompCtx ctx;
+            ctx.comp_id = String(c["comp_id"] | "");
+            ctx.type    = String(c["type"] | "");
+            ctx.params  = c["params"];
+
+            std::unique_ptr<IComponent> comp(
+                ComponentRegistry::instance().create(ctx.type)
+            );
+
+            if (!comp) {
+                lv_obj_t* unknown = lv_label_create(grid);
+                String t = "Unknown component: " + ctx.type;
+                lv_label_set_text(unknown, t.c_str());
+            } else {
+                comp->build(grid, ctx);
+                // kept alive so server updates can reach its widgets
+                if (!ctx.comp_id.isEmpty()) info.components.emplace_back(ctx.comp_id, std::move(comp));
             }
         }
-
-        info.root = root;
-        screens[info.scr_id] = info;
-        lv_obj_add_flag(root, LV_OBJ_FLAG_HIDDEN);
     }
+
+    size_t free_after = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (free_before > free_after) screen_cost = std::max(screen_cost, free_before - free_after);
+
+    // Swap it in for the old version, keeping it on display if that was
+    info.root = root;
+    if (old != screens.end()) removeScreen(old);
+    for (auto &c : info.components) components[c.first] = c.second.get();
+    ScreenInfo &added = screens[info.scr_id];
+    added = std::move(info);
+    if (added.scr_id == shown) lv_obj_clear_flag(added.root, LV_OBJ_FLAG_HIDDEN);
+}
+
+bool ScreenRenderer::applyState(const String& comp_id, JsonVariantConst state) {
+    auto it = components.find(comp_id);
+    if (it == components.end()) return false;
+    it->second->applyState(state);
+    return true;
 }
 
 void ScreenRenderer::showScreenById(const String& scr_id) {
@@ -110,4 +182,5 @@ void ScreenRenderer::showScreenById(const String& scr_id) {
     auto it = screens.find(scr_id);
     if (it == screens.end()) return;
     lv_obj_clear_flag(it->second.root, LV_OBJ_FLAG_HIDDEN);
+    shown = scr_id;
 }
@@ -5,6 +5,8 @@
 #include <vector>
 #include <functional>
 #include <memory>
+#include "rpc/ConfigTransfer.hpp"
+#include "ComponentUpdateQueue.hpp"
 // Avoid including component implementations here to prevent circular dependencies.
 // Components should include this header to access interfaces and context types.
 
@@ -26,6 +28,8 @@ class IComponent {
 public:
     virtual ~IComponent() = default;
     virtual lv_obj_t* build(lv_obj_t* parent, const CompCtx& ctx) = 0;
+    // State pushed by the server after build(); same shape the component sends in update_state
+    virtual void applyState(JsonVariantConst state) { (void)state; }
 };
 
 class ComponentRegistry {
@@ -49,10 +53,26 @@ private:
     std::map<String, Factory> map_;
 };
 
-class ScreenRenderer {
+class ScreenRenderer : public ConfigSink, public StateSink {
 public:
+    static constexpr const char* DEFAULT_SCREEN = "scr1";
+    // Heap a screen build must leave for the network stack and JSON; below
+    // it, the old version of a screen goes before its replacement is built
+    static const size_t MIN_HEADROOM = 24 * 1024;
+
     void buildFromConfig(JsonVariantConst cfg); // read-only JSON
     void showScreenById(const String& scr_id);
+    void clear(); // deletes all screens
+    bool applyState(const String& comp_id, JsonVariantConst state) override; // false if no such component
+
+    // ConfigSink: build the UI one screen at a time as chunks arrive. Each
+    // new screen replaces the one with the same scr_id as soon as it is
+    // built, so at most one screen is ever held twice; screens the new
+    // config no longer has go at endConfig. A config whose hash matches the
+    // one on display is not rebuilt at all.
+    void beginConfig(JsonVariantConst header) override;
+    void addScreen(JsonVariantConst s) override;
+    void endConfig() override;
 
 private:
     struct ScreenInfo {
@@ -60,9 +80,19 @@ private:
         String name;
         String back_screen;
         lv_obj_t* root = nullptr;
+        std::vector<std::pair<String, std::unique_ptr<IComponent>>> components; // built components by comp_id
     };
 
     std::map<String, ScreenInfo> screens;
+    std::map<String, IComponent*> components; // by comp_id, owned by their screen
+    String shown;       // scr_id on display
+    String shown_hash;  // hash of the config on display, empty if unknown
+    String config_hash; // hash of the config being received
+    bool unchanged = false;       // config_hash == shown_hash, nothing to build
+    std::vector<String> received; // scr_ids of the config being received
+    size_t screen_cost = 8 * 1024; // most heap one screen build has taken
 
     void ensureRegistrySetup();
+    void removeScreen(std::map<String, ScreenInfo>::iterator it);
+    static size_t headroom();
 };
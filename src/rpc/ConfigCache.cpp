@@ -0,0 +1,104 @@
+#include "ConfigCache.hpp"
+#include "RPCHash.hpp"
+#include "spiffs_handler.h"
+#include <FS.h>
+#include <SPIFFS.h>
+
+ConfigCache::ConfigCache(ConfigSink &target) : target(target) {}
+
+uint32_t ConfigCache::fileChecksum(const char* path) {
+  File f = SPIFFS.open(path, FILE_READ);
+  if (!f) return 0;
+  uint32_t h = 2166136261u;
+  uint8_t buf[64];
+  size_t n;
+  while ((n = f.read(buf, sizeof(buf))) > 0) h = fnv1a_n((const char*)buf, n, h);
+  f.close();
+  return h;
+}
+
+bool ConfigCache::load() {
+  JsonDocument meta;
+  if (!spiffs_file_exists(META_FILE) || !spiffs_load_json(META_FILE, meta)) return false;
+  if (fileChecksum(CACHE_FILE) != (meta["fnv"] | 0u)) {
+    Serial.println("Config cache is damaged, ignoring it");
+    return false;
+  }
+
+  File f = SPIFFS.open(CACHE_FILE, FILE_READ);
+  if (!f) return false;
+
+  JsonDocument line;
+  if (deserializeJson(line, f) != DeserializationError::Ok) {
+    f.close();
+    return false;
+  }
+  line["hash"] = meta["hash"]; // lets the renderer skip a resent copy of this config
+  target.beginConfig(line.as<JsonVariantConst>());
+  size_t count = 0;
+  // deserializeJson stops after each value, so the file is read one screen at a time
+  while (f.available() && deserializeJson(line, f) == DeserializationError::Ok) {
+    target.addScreen(line.as<JsonVariantConst>());
+    count++;
+  }
+  f.close();
+  target.endConfig();
+
+  etag = String(meta["hash"] | "");
+  Serial.printf("Config loaded from cache: %u screens, hash %s\n", (unsigned)count, etag.c_str());
+  return true;
+}
+
+void ConfigCache::writeLine(JsonVariantConst v) {
+  File f = SPIFFS.open(TEMP_FILE, FILE_APPEND);
+  if (!f) {
+    writing = false;
+    return;
+  }
+  String line;
+  serializeJson(v, line);
+  line += '\n';
+  f.print(line);
+  f.close();
+  checksum = fnv1a_n(line.c_str(), line.length(), checksum);
+}
+
+void ConfigCache::beginConfig(JsonVariantConst header) {
+  target.beginConfig(header);
+
+  pending_etag = String(header["hash"] | "");
+  checksum = 2166136261u;
+  writing = true;
+  if (spiffs_file_exists(TEMP_FILE)) spiffs_remove_file(TEMP_FILE);
+
+  // Only the top-level fields go on the header line; screens follow one per line
+  JsonDocument top;
+  top.to<JsonObject>();
+  for (JsonPairConst kv : header.as<JsonObjectConst>()) {
+    if (kv.key() == "screens" || kv.key() == "seq" || kv.key() == "total" || kv.key() == "hash") continue;
+    top[kv.key()] = kv.value();
+  }
+  writeLine(top.as<JsonVariantConst>());
+}
+
+void ConfigCache::addScreen(JsonVariantConst screen) {
+  target.addScreen(screen);
+  if (writing) writeLine(screen);
+}
+
+void ConfigCache::endConfig() {
+  target.endConfig();
+  if (!writing) return;
+  writing = false;
+
+  if (spiffs_file_exists(CACHE_FILE)) spiffs_remove_file(CACHE_FILE);
+  if (!SPIFFS.rename(TEMP_FILE, CACHE_FILE)) {
+    Serial.println("Failed to store config cache");
+    return;
+  }
+  JsonDocument meta;
+  meta["hash"] = pending_etag;
+  meta["fnv"] = checksum;
+  spiffs_save_json(META_FILE, meta);
+  etag = pending_etag;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "ConfigTransfer.hpp"
+
+// Keeps the last complete config on flash so the UI can be drawn before the
+// network is up. Sits between ConfigTransfer and the renderer: everything
+// received is passed on and written to a temporary file, which replaces the
+// cache only once the whole config has arrived.
+//
+// /config.ndjson holds the top-level fields on the first line and one screen
+// per following line, so loading never needs the whole config in RAM.
+// /config.meta (spiffs_save_json) holds the server's content hash, sent back
+// as if_none_match, and an FNV-1a checksum of the cache file.
+class ConfigCache : public ConfigSink {
+public:
+    explicit ConfigCache(ConfigSink &target);
+
+    bool load(); // replays a valid cache into the target
+    const String& hash() const { return etag; } // empty when nothing is cached
+
+    void beginConfig(JsonVariantConst header) override;
+    void addScreen(JsonVariantConst screen) override;
+    void endConfig() override;
+
+private:
+    static constexpr const char* CACHE_FILE = "/config.ndjson";
+    static constexpr const char* TEMP_FILE = "/config.tmp";
+    static constexpr const char* META_FILE = "/config.meta";
+
+    ConfigSink &target;
+    String etag;
+    String pending_etag; // hash of the config being received
+    uint32_t checksum = 0;
+    bool writing = false;
+
+    void writeLine(JsonVariantConst v);
+    static uint32_t fileChecksum(const char* path);
+};
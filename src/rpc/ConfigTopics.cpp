@@ -0,0 +1,71 @@
+#include "ConfigTopics.hpp"
+#include "RPCSystem.hpp"
+#include "renderer/ComponentUpdateQueue.hpp"
+#include "RPCHash.hpp"
+#include <algorithm>
+
+ConfigTopics::ConfigTopics(ESP32RPC &rpc, ConfigSink &target, ComponentUpdateQueue &updates)
+  : rpc(rpc), target(target), updates(updates) {}
+
+void ConfigTopics::unsubscribeAll() {
+  for (const String &t : topics) rpc.unsubscribe(t.c_str());
+  topics.clear();
+  if (wildcard) rpc.unsubscribe(WILDCARD);
+  wildcard = false;
+}
+
+void ConfigTopics::useWildcard() {
+  unsubscribeAll();
+  wildcard = rpc.subscribe(WILDCARD, &ConfigTopics::onState, this);
+  Serial.println(wildcard ? "Too many components, subscribed to all state topics"
+                          : "Could not subscribe to state topics");
+}
+
+void ConfigTopics::beginConfig(JsonVariantConst header) {
+  unsubscribeAll(); // the new config may not have the same components
+  comp_hashes.clear();
+  size_t joined = rpc.setGroups(header["groups"].as<JsonArrayConst>());
+  if (joined) Serial.printf("Joined %u groups\n", (unsigned)joined);
+  target.beginConfig(header);
+}
+
+void ConfigTopics::addScreen(JsonVariantConst screen) {
+  target.addScreen(screen);
+
+  for (JsonVariantConst c : screen["components"].as<JsonArrayConst>()) {
+    const char* comp_id = c["comp_id"] | "";
+    if (!*comp_id) continue;
+    uint32_t h = fnv1a(comp_id);
+    auto at = std::lower_bound(comp_hashes.begin(), comp_hashes.end(), h);
+    if (at == comp_hashes.end() || *at != h) comp_hashes.insert(at, h);
+    if (wildcard) continue;
+
+    String topic = String(PREFIX) + comp_id;
+    if (!rpc.subscribe(topic.c_str(), &ConfigTopics::onState, this)) {
+      useWildcard();
+      continue;
+    }
+    topics.push_back(topic);
+  }
+}
+
+void ConfigTopics::endConfig() {
+  target.endConfig();
+  Serial.printf("Subscribed to %u state topics\n", (unsigned)subscribedCount());
+}
+
+bool ConfigTopics::inConfig(const char* comp_id) const {
+  return std::binary_search(comp_hashes.begin(), comp_hashes.end(), fnv1a(comp_id));
+}
+
+void ConfigTopics::onState(const char* topic, const uint8_t* payload, size_t length, void* ctx) {
+  ConfigTopics* self = (ConfigTopics*)ctx;
+  if (length == 0) return; // retained message cleared
+  const char* comp_id = topic + strlen(PREFIX);
+  // The wildcard also brings the state of every other display's components
+  if (self->wildcard && !self->inConfig(comp_id)) return;
+  JsonDocument doc(&JsonArena::instance());
+  if (deserializeJson(doc, payload, length)) return;
+  // Retained state is the latest by definition, so it carries no seq
+  self->updates.push(comp_id, doc.as<JsonVariantConst>());
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <vector>
+#include "ConfigTransfer.hpp"
+
+class ESP32RPC;
+class ComponentUpdateQueue;
+
+// Subscribes to the topics a config asks for, as the config passes through
+// on its way to the renderer:
+//
+// - the retained state topic of every component, espdisplay/state/<comp_id>.
+//   The broker answers a subscribe with the retained message, so a wake or
+//   reconnect brings every component's current state in one burst instead of
+//   one request per component. Messages go to the update queue. When the
+//   router has no room for one route per component, a single
+//   espdisplay/state/+ subscription is used instead, and only messages for
+//   comp_ids in the config are passed on.
+// - the group topics listed in the config's top-level "groups", see
+//   ESP32RPC::setGroups.
+class ConfigTopics : public ConfigSink {
+public:
+    static constexpr const char* PREFIX = "espdisplay/state/";
+
+    ConfigTopics(ESP32RPC &rpc, ConfigSink &target, ComponentUpdateQueue &updates);
+
+    void beginConfig(JsonVariantConst header) override;
+    void addScreen(JsonVariantConst screen) override;
+    void endConfig() override;
+
+    size_t subscribedCount() const { return wildcard ? 1 : topics.size(); }
+
+private:
+    static constexpr const char* WILDCARD = "espdisplay/state/+";
+
+    ESP32RPC &rpc;
+    ConfigSink &target;
+    ComponentUpdateQueue &updates;
+    std::vector<String> topics; // exact subscriptions for the current config
+    std::vector<uint32_t> comp_hashes; // FNV-1a of every comp_id in the config, sorted
+    bool wildcard = false;
+
+    void unsubscribeAll();
+    void useWildcard();
+    bool inConfig(const char* comp_id) const;
+    static void onState(const char* topic, const uint8_t* payload, size_t length, void* ctx);
+};
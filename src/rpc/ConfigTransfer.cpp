@@ -0,0 +1,130 @@
+#include "ConfigTransfer.hpp"
+#include "RPCSystem.hpp"
+#include <algorithm>
+
+ConfigTransfer::ConfigTransfer(ESP32RPC &rpc, ConfigSink &sink)
+  : rpc(rpc), sink(sink) {}
+
+void ConfigTransfer::start() {
+  if (inflight) rpc.cancel(inflight);
+  inflight = 0;
+  next_seq = 0;
+  total = 0;
+  retries = 0;
+  rounds = 0;
+  retry_at = millis();
+  started = true;
+  whole = false;
+  done = false;
+  requestNext();
+}
+
+void ConfigTransfer::resume() {
+  if (done || inflight || (long)(millis() - retry_at) < 0) return;
+  if (whole) fetchWhole();
+  else requestNext();
+}
+
+// A timed-out request has already waited its RTO and goes again at once; an
+// error reply means the server is up but failing, so give it an RTO first.
+void ConfigTransfer::retryLater(bool timed_out, const char* method) {
+  unsigned long wait = timed_out ? 0 : rpc.timeoutFor(method);
+  if (++retries > MAX_RETRIES) {
+    retries = 0;
+    if (rounds < 16) rounds++;
+    wait = rpc.timeoutFor(method) << (rounds < 8 ? rounds : 8);
+    if (wait > MAX_BACKOFF_MS) wait = MAX_BACKOFF_MS;
+    Serial.printf("%s failed %u times, retrying in %lu ms\n", method, (unsigned)MAX_RETRIES + 1, wait);
+  }
+  retry_at = millis() + wait;
+}
+
+void ConfigTransfer::requestNext() {
+  JsonDocument params;
+  params["seq"] = next_seq;
+  params["max_bytes"] = std::min((size_t)CHUNK_BYTES, rpc.maxMessageSize());
+  if (next_seq > 0) params["ack"] = next_seq - 1;
+  else if (!if_none_match.isEmpty()) params["if_none_match"] = if_none_match;
+
+  inflight = rpc.callAsync("get_config_chunk", params.as<JsonVariantConst>(), &ConfigTransfer::onChunkReply, this);
+}
+
+void ConfigTransfer::onChunkReply(bool ok, JsonVariantConst result, void* ctx) {
+  ConfigTransfer* self = (ConfigTransfer*)ctx;
+  self->inflight = 0;
+  self->onChunk(ok, result);
+}
+
+void ConfigTransfer::onChunk(bool ok, JsonVariantConst result) {
+  if (!ok) {
+    if (!result.isNull() && (result["code"] | 0) == -32601) {
+      whole = true;
+      fetchWhole();
+      return;
+    }
+    retryLater(result.isNull(), "get_config_chunk"); // resume() asks for the same chunk again
+    return;
+  }
+
+  if (finishIfUnchanged(result)) return;
+
+  uint32_t seq = result["seq"] | 0u;
+  if (seq != next_seq) {
+    requestNext();
+    return;
+  }
+  retries = 0;
+  rounds = 0;
+
+  if (seq == 0) {
+    total = result["total"] | 1u;
+    sink.beginConfig(result);
+  }
+  for (JsonVariantConst screen : result["screens"].as<JsonArrayConst>()) {
+    sink.addScreen(screen);
+  }
+  next_seq++;
+
+  if (next_seq < total) {
+    requestNext();
+    return;
+  }
+
+  JsonDocument ack;
+  ack["ack"] = seq;
+  rpc.notify("get_config_chunk", ack.as<JsonVariantConst>());
+  done = true;
+  sink.endConfig();
+  Serial.printf("Config received in %u chunks\n", (unsigned)total);
+}
+
+bool ConfigTransfer::finishIfUnchanged(JsonVariantConst result) {
+  if (!(result["unchanged"] | false)) return false;
+  done = true;
+  Serial.printf("Config unchanged (%s)\n", if_none_match.c_str());
+  return true;
+}
+
+void ConfigTransfer::fetchWhole() {
+  JsonDocument params;
+  params.to<JsonObject>();
+  if (!if_none_match.isEmpty()) params["if_none_match"] = if_none_match;
+  inflight = rpc.callAsync("get_config", params.as<JsonVariantConst>(), &ConfigTransfer::onWholeReply, this);
+}
+
+void ConfigTransfer::onWholeReply(bool ok, JsonVariantConst res, void* ctx) {
+  ConfigTransfer* self = (ConfigTransfer*)ctx;
+  self->inflight = 0;
+  if (!ok || res.isNull()) {
+    Serial.println("get_config returned null");
+    self->retryLater(!ok && res.isNull(), "get_config");
+    return;
+  }
+  if (self->finishIfUnchanged(res)) return;
+  self->sink.beginConfig(res);
+  for (JsonVariantConst screen : res["screens"].as<JsonArrayConst>()) {
+    self->sink.addScreen(screen);
+  }
+  self->done = true;
+  self->sink.endConfig();
+}
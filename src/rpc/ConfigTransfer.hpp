@@ -0,0 +1,64 @@
+#pragma once
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+class ESP32RPC;
+
+// Receives a UI config piece by piece. begin gets the first chunk's result
+// (top-level config fields); its "screens" are delivered through addScreen
+// like every other chunk's.
+class ConfigSink {
+public:
+    virtual ~ConfigSink() = default;
+    virtual void beginConfig(JsonVariantConst header) = 0;
+    virtual void addScreen(JsonVariantConst screen) = 0;
+    virtual void endConfig() = 0;
+};
+
+// Fetches the config with get_config_chunk, one chunk per call. Each request
+// acknowledges the previous chunk, a lost or failed chunk is requested again,
+// and only one chunk is held in RAM at a time. Servers without chunk support
+// get a plain get_config instead. A chunk the server answers with an error is
+// asked for again after the method's RPC timeout; after MAX_RETRIES failures
+// in a row the wait doubles with every round, up to MAX_BACKOFF_MS.
+class ConfigTransfer {
+public:
+    static const uint16_t CHUNK_BYTES = 1536; // upper bound; smaller when the transport's limit is
+    static const uint8_t MAX_RETRIES = 5;
+    static const unsigned long MAX_BACKOFF_MS = 60000;
+
+    ConfigTransfer(ESP32RPC &rpc, ConfigSink &sink);
+
+    void start();  // fetch from the first chunk
+    void resume(); // continue after the last chunk received, once any backoff has passed
+
+    // Hash of the config already shown; a server holding the same config
+    // replies {"unchanged": true} instead of sending it again.
+    void setIfNoneMatch(const String &hash) { if_none_match = hash; }
+
+    bool isStarted() const { return started; }
+    bool isActive() const { return inflight != 0; }
+    bool isDone() const { return done; }
+
+private:
+    ESP32RPC &rpc;
+    ConfigSink &sink;
+    uint32_t next_seq = 0;
+    uint32_t total = 0;
+    uint8_t retries = 0;   // failed requests for the current chunk
+    uint8_t rounds = 0;    // times retries ran out since the last chunk received
+    unsigned long retry_at = 0;
+    uint32_t inflight = 0; // ESP32RPC::CallHandle
+    bool started = false;
+    bool whole = false;    // the server has no get_config_chunk
+    bool done = false;
+    String if_none_match;
+
+    void requestNext();
+    bool finishIfUnchanged(JsonVariantConst result);
+    void onChunk(bool ok, JsonVariantConst result);
+    static void onChunkReply(bool ok, JsonVariantConst result, void* ctx);
+    static void onWholeReply(bool ok, JsonVariantConst result, void* ctx);
+    void retryLater(bool timed_out, const char* method);
+    void fetchWhole(); // fallback for servers without get_config_chunk
+};
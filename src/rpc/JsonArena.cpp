@@ -0,0 +1,58 @@
+#include "JsonArena.hpp"
+
+void* JsonArena::allocate(size_t size) {
+  size_t need = blockSize(size);
+  if (top + need > SIZE) {
+    fallbacks++;
+    return malloc(size);
+  }
+  uint8_t* block = buf + top;
+  *(uint32_t*)block = size;
+  last = top;
+  top += need;
+  live++;
+  if (top > high_water) high_water = top;
+  return block + HEADER;
+}
+
+void JsonArena::deallocate(void* ptr) {
+  if (!ptr) return;
+  if (!owns(ptr)) {
+    free(ptr);
+    return;
+  }
+  size_t offset = (uint8_t*)ptr - buf - HEADER;
+  if (offset == last) {
+    top = last; // newest block, give it straight back
+    last = NONE;
+  }
+  if (--live == 0) {
+    top = 0;
+    last = NONE;
+    resets++;
+  }
+}
+
+void* JsonArena::reallocate(void* ptr, size_t new_size) {
+  if (!ptr) return allocate(new_size);
+  if (!owns(ptr)) return realloc(ptr, new_size);
+
+  uint8_t* block = (uint8_t*)ptr - HEADER;
+  size_t offset = block - buf;
+  size_t old_size = *(uint32_t*)block;
+
+  // The newest block grows or shrinks in place, which covers ArduinoJson's
+  // string building and shrinkToFit
+  if (offset == last && offset + blockSize(new_size) <= SIZE) {
+    *(uint32_t*)block = new_size;
+    top = offset + blockSize(new_size);
+    if (top > high_water) high_water = top;
+    return ptr;
+  }
+
+  void* moved = allocate(new_size);
+  if (!moved) return nullptr;
+  memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+  deallocate(ptr);
+  return moved;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Bump allocator for the JsonDocuments that last no longer than one RPC
+// message: the decoded inbound message and the scratch documents of its
+// handlers. Blocks are carved from one static buffer and only the newest one
+// is ever given back individually; once every block is freed the whole arena
+// resets in one step, which happens after every message as long as nothing
+// that outlives one allocates here. When the arena is full, allocations fall
+// back to malloc.
+class JsonArena : public ArduinoJson::Allocator {
+public:
+    static const size_t SIZE = 8192;
+
+    static JsonArena& instance() {
+        static JsonArena a;
+        return a;
+    }
+
+    void* allocate(size_t size) override;
+    void deallocate(void* ptr) override;
+    void* reallocate(void* ptr, size_t new_size) override;
+
+    size_t used() const { return top; }
+    size_t highWater() const { return high_water; }
+    void resetHighWater() { high_water = top; } // start a new measurement from current use
+    size_t liveBlocks() const { return live; }
+    uint32_t resetCount() const { return resets; }       // times the arena emptied
+    uint32_t fallbackCount() const { return fallbacks; } // allocations that went to the heap
+
+private:
+    static const size_t HEADER = 8; // block size, padded to keep payloads 8-byte aligned
+    static const size_t NONE = SIZE;
+
+    alignas(8) uint8_t buf[SIZE];
+    size_t top = 0;
+    size_t last = NONE; // offset of the newest block, if it can still be popped
+    size_t live = 0;
+    size_t high_water = 0;
+    uint32_t resets = 0;
+    uint32_t fallbacks = 0;
+
+    JsonArena() = default;
+    bool owns(const void* ptr) const { return ptr >= buf && ptr < buf + SIZE; }
+    static size_t blockSize(size_t size) { return HEADER + ((size + 7) & ~(size_t)7); }
+};
@@ -0,0 +1,74 @@
+#include "LoopbackTransport.hpp"
+#include "TopicRouter.hpp"
+
+void LoopbackTransport::pair(LoopbackTransport &a, LoopbackTransport &b) {
+  a.peer = &b;
+  b.peer = &a;
+}
+
+bool LoopbackTransport::connect(const char* client_id, bool persistent) {
+  (void)client_id;
+  (void)persistent;
+  is_connected = peer != nullptr;
+  return is_connected;
+}
+
+bool LoopbackTransport::subscribe(const char* filter, uint8_t qos) {
+  (void)qos; // delivery in memory never fails
+  unsubscribe(filter); // no duplicates
+  filters.push_back(String(filter));
+  return true;
+}
+
+bool LoopbackTransport::unsubscribe(const char* filter) {
+  for (size_t i = 0; i < filters.size(); i++) {
+    if (filters[i] == filter) {
+      filters.erase(filters.begin() + i);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool LoopbackTransport::wants(const char* topic) const {
+  for (const String &f : filters) {
+    if (TopicRouter::matches(f.c_str(), topic)) return true;
+  }
+  return false;
+}
+
+bool LoopbackTransport::beginMessage(const char* topic, size_t length) {
+  if (!connected() || building || length > max_message) return false;
+  outgoing.topic = topic;
+  outgoing.payload.clear();
+  outgoing.payload.reserve(length);
+  building = true;
+  return true;
+}
+
+size_t LoopbackTransport::write(const uint8_t* data, size_t length) {
+  if (!building) return 0;
+  outgoing.payload.insert(outgoing.payload.end(), data, data + length);
+  return length;
+}
+
+bool LoopbackTransport::endMessage() {
+  if (!building) return false;
+  building = false;
+  if (!peer->is_connected || !peer->wants(outgoing.topic.c_str())) return true; // like a broker with no subscriber
+  outgoing.due = millis() + latency_ms;
+  peer->inbox.push_back(std::move(outgoing));
+  outgoing = Message();
+  return true;
+}
+
+void LoopbackTransport::loop() {
+  unsigned long now = millis();
+  // Only what is due now; messages queued by the handlers wait for the next loop
+  size_t n = inbox.size();
+  while (n-- > 0 && !inbox.empty() && (long)(now - inbox.front().due) >= 0) {
+    Message m = std::move(inbox.front());
+    inbox.pop_front();
+    deliver(m.topic.c_str(), m.payload.data(), m.payload.size());
+  }
+}
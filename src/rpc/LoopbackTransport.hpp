@@ -0,0 +1,53 @@
+#pragma once
+#include <Arduino.h>
+#include <deque>
+#include <vector>
+#include "RPCTransport.hpp"
+
+// Two transports wired back to back in memory, for exercising ESP32RPC
+// without a network and as the zero-cost baseline when comparing transports.
+// A message published on one side reaches the other if it subscribed to a
+// matching filter, delivered from the receiving side's loop() after the
+// configured one-way latency.
+class LoopbackTransport : public RPCTransport {
+public:
+    static const size_t MAX_MESSAGE = 64 * 1024; // no wire to fit, but bounded like one
+
+    LoopbackTransport() = default;
+    static void pair(LoopbackTransport &a, LoopbackTransport &b);
+
+    void setLatency(unsigned long ms) { latency_ms = ms; }
+    void setMaxMessageSize(size_t bytes) { max_message = bytes; } // to stand in for a real wire's limit
+
+    const char* name() const override { return "loopback"; }
+    bool connect(const char* client_id, bool persistent = false) override;
+    void disconnect() override { is_connected = false; inbox.clear(); }
+    bool connected() override { return is_connected && peer; }
+    void loop() override;
+
+    bool subscribe(const char* filter, uint8_t qos = 0) override;
+    bool unsubscribe(const char* filter) override;
+
+    bool beginMessage(const char* topic, size_t length) override;
+    size_t write(const uint8_t* data, size_t length) override;
+    bool endMessage() override;
+    size_t maxMessageSize() override { return max_message; }
+
+private:
+    struct Message {
+      String topic;
+      std::vector<uint8_t> payload;
+      unsigned long due = 0;
+    };
+
+    LoopbackTransport* peer = nullptr;
+    bool is_connected = false;
+    unsigned long latency_ms = 0;
+    size_t max_message = MAX_MESSAGE;
+    std::vector<String> filters;
+    std::deque<Message> inbox;
+    Message outgoing;
+    bool building = false;
+
+    bool wants(const char* topic) const;
+};
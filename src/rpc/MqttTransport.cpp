@@ -0,0 +1,21 @@
+#include "MqttTransport.hpp"
+
+MqttTransport::MqttTransport(PubSubClient &mqtt, const char* user, const char* pass)
+  : mqtt(mqtt), user(user), pass(pass) {
+  mqtt.setCallback([this](char* topic, uint8_t* payload, unsigned int length) {
+    deliver(topic, payload, length);
+  });
+}
+
+// Without a clean session the broker keeps the subscriptions under client_id
+// and queues QoS 1 messages for it until it reconnects.
+bool MqttTransport::connect(const char* client_id, bool persistent) {
+  const char* u = user && pass ? user : nullptr;
+  return mqtt.connect(client_id, u, u ? pass : nullptr, nullptr, 0, false, nullptr, !persistent);
+}
+
+size_t MqttTransport::maxMessageSize() {
+  static const size_t OVERHEAD = 5 + 2 + (TopicRouter::MAX_TOPIC_LEN - 1) + 2;
+  size_t buffer = mqtt.getBufferSize();
+  return buffer > OVERHEAD ? buffer - OVERHEAD : 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <PubSubClient.h>
+#include "RPCTransport.hpp"
+#include "TopicRouter.hpp"
+
+// RPCTransport over an MQTT broker through PubSubClient. The client's server,
+// buffer size and timeouts are set up by the owner.
+class MqttTransport : public RPCTransport {
+public:
+    MqttTransport(PubSubClient &mqtt, const char* user = nullptr, const char* pass = nullptr);
+
+    const char* name() const override { return "mqtt"; }
+    bool connect(const char* client_id, bool persistent = false) override;
+    void disconnect() override { mqtt.disconnect(); }
+    bool connected() override { return mqtt.connected(); }
+    void loop() override { mqtt.loop(); }
+
+    bool subscribe(const char* filter, uint8_t qos = 0) override { return mqtt.subscribe(filter, qos); }
+    bool unsubscribe(const char* filter) override { return mqtt.unsubscribe(filter); }
+
+    bool beginMessage(const char* topic, size_t length) override { return mqtt.beginPublish(topic, length, false); }
+    size_t write(const uint8_t* data, size_t length) override { return mqtt.write(data, length); }
+    bool endMessage() override { return mqtt.endPublish() != 0; }
+
+    // Publishes are streamed, but PubSubClient must fit a whole inbound packet
+    // (fixed header, topic, packet id) into its buffer; both ways get that limit.
+    size_t maxMessageSize() override;
+
+private:
+    PubSubClient &mqtt;
+    const char* user;
+    const char* pass;
+};
@@ -0,0 +1,252 @@
+#include "OutboundQueue.hpp"
+#include <FS.h>
+#include <SPIFFS.h>
+#include "RPCHash.hpp"
+#include <algorithm>
+
+OutboundQueue::OutboundQueue(const char* log_path) : log_path(log_path) {}
+
+void OutboundQueue::begin() {
+  File f = SPIFFS.open(log_path, FILE_READ);
+  if (!f) return;
+  log_count = 0;
+  while (f.available()) {
+    if (f.readStringUntil('\n').length() > 0) log_count++;
+  }
+  f.close();
+  log_offset = 0;
+  log_line = 0;
+  log_indexed = false;
+  if (log_count > 0) Serial.printf("[Outbox] %u records waiting in %s\n", (unsigned)log_count, log_path);
+}
+
+bool OutboundQueue::push(const char* method, JsonVariantConst params, const char* key) {
+  if (!key) key = "";
+  if (strlen(method) >= MAX_METHOD_LEN || strlen(key) >= MAX_KEY_LEN) return false;
+  uint32_t hash = *key ? fnv1a(key) : 0;
+
+  // Latest wins: a queued record with the same key is updated in place
+  if (*key) {
+    for (size_t i = 0; i < ram_count; i++) {
+      Record &r = at(i);
+      if (r.hash != hash || strcmp(r.key, key) != 0 || strcmp(r.method, method) != 0) continue;
+      r.params = "";
+      serializeJson(params, r.params);
+      return true;
+    }
+  }
+
+  if (ram_count == RAM_CAPACITY && !spill(RAM_CAPACITY / 2)) {
+    // Flash unavailable or full: make room by dropping the oldest record
+    head = (head + 1) % RAM_CAPACITY;
+    ram_count--;
+    dropped++;
+  }
+
+  Record &r = at(ram_count);
+  r.hash = hash;
+  strcpy(r.key, key);
+  strcpy(r.method, method);
+  r.params = "";
+  serializeJson(params, r.params);
+  ram_count++;
+  return true;
+}
+
+bool OutboundQueue::persist() {
+  return ram_count == 0 || spill(ram_count);
+}
+
+// Log lines are {"k":<hash>,"i":"<key>","m":"<method>","p":<params>}, appended
+// in batches.
+bool OutboundQueue::spill(size_t n) {
+  if (n > ram_count) n = ram_count;
+  // Lines already replayed stay in the file until it is removed; drop them
+  // first so the file never holds more than MAX_LOG_RECORDS lines
+  if (log_offset > 0 && !compactLog()) return false;
+  if (log_count + n > MAX_LOG_RECORDS) return false;
+
+  File f = SPIFFS.open(log_path, FILE_APPEND);
+  if (!f) return false;
+  for (size_t i = 0; i < n; i++) {
+    Record &r = at(i);
+    f.printf("{\"k\":%u,\"i\":\"%s\",\"m\":\"%s\",\"p\":", (unsigned)r.hash, r.key, r.method);
+    f.print(r.params);
+    f.print("}\n");
+  }
+  f.close();
+  log_indexed = false; // the new records may supersede logged ones
+
+  for (size_t i = 0; i < n; i++) at(i).params = "";
+  head = (head + n) % RAM_CAPACITY;
+  ram_count -= n;
+  log_count += n;
+  return true;
+}
+
+size_t OutboundQueue::replay(ReplayHandler handler, void* ctx) {
+  size_t delivered = 0;
+  if (log_count > 0 && !replayLog(handler, ctx, delivered)) return delivered;
+
+  while (ram_count > 0) {
+    Record &r = at(0);
+    if (!r.key[0] || !ringHasKey(r.hash, r.key, r.method, 1)) {
+      JsonDocument params;
+      deserializeJson(params, r.params);
+      if (!handler(r.method, params.as<JsonVariantConst>(), ctx)) break;
+      delivered++;
+    }
+    r.params = "";
+    head = (head + 1) % RAM_CAPACITY;
+    ram_count--;
+  }
+  return delivered;
+}
+
+bool OutboundQueue::ringHasKey(uint32_t hash, const char* key, const char* method, size_t from) {
+  for (size_t i = from; i < ram_count; i++) {
+    Record &r = at(i);
+    if (r.hash == hash && strcmp(r.key, key) == 0 && strcmp(r.method, method) == 0) return true;
+  }
+  return false;
+}
+
+void OutboundQueue::resetLog() {
+  log_count = 0;
+  log_offset = 0;
+  log_line = 0;
+  log_indexed = false;
+}
+
+// Rewrites the log without the records replay has already worked through.
+bool OutboundQueue::compactLog() {
+  String tmp_path = String(log_path) + ".tmp";
+  File in = SPIFFS.open(log_path, FILE_READ);
+  File out = SPIFFS.open(tmp_path, FILE_WRITE);
+  bool ok = in && out && in.seek(log_offset);
+  uint8_t buf[256];
+  size_t n;
+  while (ok && (n = in.read(buf, sizeof(buf))) > 0) ok = out.write(buf, n) == n;
+  in.close();
+  out.close();
+  if (!ok || !SPIFFS.remove(log_path) || !SPIFFS.rename(tmp_path, log_path)) {
+    SPIFFS.remove(tmp_path);
+    return false;
+  }
+  log_offset = 0;
+  log_line = 0;
+  log_indexed = false;
+  return true;
+}
+
+// Marks every log record that a later record with the same method and key
+// replaces, once per replay run (or after a spill). The keyed records are
+// sorted by the hash of their method and key; within a run of equal hashes a
+// record is superseded only if a later one compares equal in full.
+void OutboundQueue::indexLog(File &f) {
+  memset(superseded, 0, sizeof(superseded));
+  JsonDocument doc;
+  JsonDocument filter;
+  filter["i"] = true;
+  filter["m"] = true;
+  size_t n = 0;
+  size_t line = 0;
+  size_t offset = 0;
+  f.seek(0);
+  while (f.available() && line < MAX_LOG_RECORDS) {
+    String text = f.readStringUntil('\n');
+    size_t start = offset;
+    offset += text.length() + 1;
+    if (text.length() == 0) continue;
+    uint32_t hash;
+    if (readLogId(text, doc, filter, hash)) log_keys[n++] = { hash, (uint32_t)start, (uint16_t)line };
+    line++;
+  }
+
+  std::sort(log_keys, log_keys + n, [](const LogKey &a, const LogKey &b) {
+    return a.hash != b.hash ? a.hash < b.hash : a.line < b.line;
+  });
+  for (size_t i = 0; i + 1 < n; i++) {
+    if (log_keys[i].hash != log_keys[i + 1].hash) continue;
+    // Hash hit: read both records back and compare method and key
+    String id = logIdAt(f, log_keys[i].offset, doc, filter);
+    for (size_t j = i + 1; j < n && log_keys[j].hash == log_keys[i].hash; j++) {
+      if (logIdAt(f, log_keys[j].offset, doc, filter) != id) continue;
+      superseded[log_keys[i].line / 8] |= 1 << (log_keys[i].line % 8);
+      break;
+    }
+  }
+  log_indexed = true;
+}
+
+// Parses only the method and key of a log line; false for unkeyed records.
+bool OutboundQueue::readLogId(const String &line, JsonDocument &doc, JsonDocument &filter, uint32_t &hash) {
+  if (deserializeJson(doc, line, DeserializationOption::Filter(filter))) return false;
+  const char* key = doc["i"] | "";
+  if (!*key) return false;
+  hash = fnv1a(key, fnv1a(doc["m"] | ""));
+  return true;
+}
+
+// "<method> <key>" of the record at offset
+String OutboundQueue::logIdAt(File &f, uint32_t offset, JsonDocument &doc, JsonDocument &filter) {
+  uint32_t hash;
+  f.seek(offset);
+  if (!readLogId(f.readStringUntil('\n'), doc, filter, hash)) return String();
+  return String(doc["m"] | "") + " " + (doc["i"] | "");
+}
+
+// Returns true once the whole log has been delivered and removed.
+bool OutboundQueue::replayLog(ReplayHandler handler, void* ctx, size_t &delivered) {
+  File f = SPIFFS.open(log_path, FILE_READ);
+  if (!f) {
+    resetLog();
+    return true;
+  }
+  if (!log_indexed) indexLog(f);
+
+  // Deliver from where the previous replay stopped
+  f.seek(log_offset);
+  size_t offset = log_offset;
+  size_t read = 0;
+  bool complete = true;
+  JsonDocument doc;
+  while (f.available()) {
+    if (read == MAX_REPLAY_PER_CALL) {
+      complete = false; // the rest on the next call
+      break;
+    }
+    String line = f.readStringUntil('\n');
+    size_t next_offset = offset + line.length() + 1;
+    if (line.length() == 0) {
+      offset = next_offset;
+      continue;
+    }
+    read++;
+
+    bool skip = log_line < MAX_LOG_RECORDS && (superseded[log_line / 8] & (1 << (log_line % 8)));
+    if (!skip && !deserializeJson(doc, line)) {
+      const char* key = doc["i"] | "";
+      const char* method = doc["m"] | "";
+      if (!*key || !ringHasKey(doc["k"] | 0u, key, method, 0)) {
+        if (!handler(method, doc["p"], ctx)) {
+          complete = false;
+          break;
+        }
+        delivered++;
+      }
+    }
+    log_line++;
+    offset = next_offset;
+    log_count--;
+  }
+  f.close();
+
+  if (!complete) {
+    log_offset = offset;
+    return false;
+  }
+  SPIFFS.remove(log_path);
+  resetLog();
+  return true;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <FS.h>
+
+// Outbound RPCs that could not be sent because the link was down. Records
+// sit in a RAM ring; when it fills up, its older half is appended to a SPIFFS
+// log in a single write, and persist() spills the rest before deep sleep.
+// Replay runs oldest first and skips records superseded by a later record
+// with the same method and key, so only the newest value per key goes out.
+// Keys are matched by their fnv1a hash first and then compared in full. The
+// log is indexed once per replay run, and each replay() call works through at
+// most MAX_REPLAY_PER_CALL of its records, so a long backlog drains over
+// several loop ticks instead of stalling one. A spill into a partly replayed
+// log first rewrites it without the replayed records, so the file never holds
+// more than MAX_LOG_RECORDS lines.
+class OutboundQueue {
+public:
+    // Returns false when the record cannot be taken right now; replay stops
+    // there and resumes from that record on the next call.
+    typedef bool (*ReplayHandler)(const char* method, JsonVariantConst params, void* ctx);
+
+    static const size_t RAM_CAPACITY = 16;
+    static const size_t MAX_LOG_RECORDS = 512;
+    static const size_t MAX_METHOD_LEN = 24; // including the terminator
+    static const size_t MAX_KEY_LEN = 48;    // including the terminator
+    static const size_t MAX_REPLAY_PER_CALL = 16; // log records read by one replay()
+
+    explicit OutboundQueue(const char* log_path = "/outbox.log");
+
+    void begin(); // picks up records logged before a reboot or deep sleep
+    bool push(const char* method, JsonVariantConst params, const char* key = nullptr);
+    size_t replay(ReplayHandler handler, void* ctx); // returns records delivered
+    bool persist();
+
+    size_t depth() const { return ram_count + log_count; }
+    uint32_t droppedCount() const { return dropped; }
+
+private:
+    struct Record {
+      uint32_t hash = 0; // fnv1a(key), 0 for unkeyed records
+      char key[MAX_KEY_LEN] = "";
+      char method[MAX_METHOD_LEN] = "";
+      String params; // serialized JSON
+    };
+
+    const char* log_path;
+    Record ring[RAM_CAPACITY];
+    size_t head = 0;       // oldest record
+    size_t ram_count = 0;
+    size_t log_count = 0;  // records in the log not yet replayed
+    size_t log_offset = 0; // byte offset where the next replay resumes
+    size_t log_line = 0;   // index of the record at log_offset
+    bool log_indexed = false;
+    uint8_t superseded[MAX_LOG_RECORDS / 8]; // bit per log record, valid while log_indexed
+    struct LogKey {
+      uint32_t hash;   // fnv1a of method and key
+      uint32_t offset; // of the line in the log
+      uint16_t line;
+    };
+    LogKey log_keys[MAX_LOG_RECORDS]; // indexLog's scratch, sorted by hash then line
+    uint32_t dropped = 0;
+
+    Record& at(size_t i) { return ring[(head + i) % RAM_CAPACITY]; }
+    bool spill(size_t n); // appends the n oldest RAM records to the log
+    bool replayLog(ReplayHandler handler, void* ctx, size_t &delivered);
+    void indexLog(File &f);
+    static bool readLogId(const String &line, JsonDocument &doc, JsonDocument &filter, uint32_t &hash);
+    static String logIdAt(File &f, uint32_t offset, JsonDocument &doc, JsonDocument &filter);
+    bool compactLog();
+    void resetLog();
+    bool ringHasKey(uint32_t hash, const char* key, const char* method, size_t from);
+};
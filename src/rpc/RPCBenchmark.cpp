@@ -0,0 +1,49 @@
+#include "RPCBenchmark.hpp"
+#include "RPCSystem.hpp"
+#include <algorithm>
+
+RPCBenchmark::RPCBenchmark(ESP32RPC &rpc) : rpc(rpc) {}
+
+void RPCBenchmark::start(size_t calls, const char* label) {
+  this->label = label;
+  remaining = calls;
+  sample_count = 0;
+  lost = 0;
+  Serial.printf("[bench] %u ping calls over %s\n", (unsigned)calls, label);
+}
+
+void RPCBenchmark::loop() {
+  if (inflight || remaining == 0) return;
+
+  JsonDocument params;
+  params["n"] = (unsigned)remaining;
+  sent_us = micros();
+  inflight = rpc.callAsync("ping", params.as<JsonVariantConst>(), &RPCBenchmark::onPong, this,
+                           CALL_TIMEOUT_MS, ESP32RPC::Priority::Interactive);
+  if (inflight) remaining--;
+}
+
+void RPCBenchmark::onPong(bool ok, JsonVariantConst, void* ctx) {
+  RPCBenchmark* self = (RPCBenchmark*)ctx;
+  uint32_t rtt = micros() - self->sent_us;
+  self->inflight = 0;
+  if (!ok) self->lost++;
+  else if (self->sample_count < MAX_SAMPLES) self->samples[self->sample_count++] = rtt;
+  if (self->remaining == 0) self->report();
+}
+
+void RPCBenchmark::report() {
+  if (sample_count == 0) {
+    Serial.printf("[bench] %s: no replies, %u lost\n", label, (unsigned)lost);
+    return;
+  }
+  std::sort(samples, samples + sample_count);
+  uint64_t sum = 0;
+  for (size_t i = 0; i < sample_count; i++) sum += samples[i];
+  // Replies are only seen once per loop() tick, so the figures include up to one tick of delay
+  Serial.printf("[bench] %s: n=%u lost=%u  min %lu us  median %lu us  p95 %lu us  max %lu us  avg %lu us\n",
+                label, (unsigned)sample_count, (unsigned)lost,
+                (unsigned long)samples[0], (unsigned long)samples[sample_count / 2],
+                (unsigned long)samples[(sample_count * 95) / 100], (unsigned long)samples[sample_count - 1],
+                (unsigned long)(sum / sample_count));
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+class ESP32RPC;
+
+// Round-trip timing of back-to-back "ping" calls (the server answers with
+// any result), so transports can be compared on the same network: build
+// once per transport and compare the summaries.
+class RPCBenchmark {
+public:
+    static const size_t MAX_SAMPLES = 128;
+    static const unsigned long CALL_TIMEOUT_MS = 2000; // fixed, so lost calls do not skew the RTO
+
+    explicit RPCBenchmark(ESP32RPC &rpc);
+
+    void start(size_t calls, const char* label);
+    void loop(); // issues the next call once the previous one finished
+    bool isRunning() const { return remaining > 0 || inflight != 0; }
+
+private:
+    ESP32RPC &rpc;
+    const char* label = "";
+    size_t remaining = 0;
+    uint32_t inflight = 0; // ESP32RPC::CallHandle
+    unsigned long sent_us = 0;
+    uint32_t samples[MAX_SAMPLES];
+    size_t sample_count = 0;
+    size_t lost = 0;
+
+    void report();
+    static void onPong(bool ok, JsonVariantConst result, void* ctx);
+};
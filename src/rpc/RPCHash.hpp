@@ -0,0 +1,14 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// 32-bit FNV-1a. The constexpr form lets method names and topics be hashed at
+// compile time; fnv1a_n hashes strings that are not NUL-terminated.
+constexpr uint32_t fnv1a(const char* s, uint32_t h = 2166136261u) {
+    return *s ? fnv1a(s + 1, (h ^ (uint8_t)*s) * 16777619u) : h;
+}
+
+inline uint32_t fnv1a_n(const char* s, size_t len, uint32_t h = 2166136261u) {
+    for (size_t i = 0; i < len; i++) h = (h ^ (uint8_t)s[i]) * 16777619u;
+    return h;
+}
@@ -1,7 +1,21 @@
 #include "RPCSystem.hpp"
+#include "utils/boot_stages.h"
+#include "config.h"
 
 // ---------------- RPCSystem ----------------
 
+#ifdef MQTT_CA_CERT
+#define MQTT_CA_PEM MQTT_CA_CERT
+#else
+#define MQTT_CA_PEM nullptr
+#endif
+
+#ifdef MQTT_TLS_INSECURE
+#define MQTT_TLS_ALLOW_INSECURE true
+#else
+#define MQTT_TLS_ALLOW_INSECURE false
+#endif
+
 RPCSystem::RPCSystem(
     const char* ssid,
     const char* password,
@@ -13,7 +27,13 @@ RPCSystem::RPCSystem(
   : ssid(ssid), password(password),
     mqtt_server(mqtt_server), mqtt_port(mqtt_port),
     mqtt_user(mqtt_user), mqtt_pass(mqtt_pass),
-    mqtt(client), rpc(mqtt) {}
+    mqtt(client), mqtt_transport(mqtt, mqtt_user, mqtt_pass),
+#if RPC_TRANSPORT_UDP
+    udp_transport(RPC_UDP_SERVER, RPC_UDP_PORT), transport(udp_transport),
+#else
+    transport(mqtt_transport),
+#endif
+    rpc(transport), states(rpc) {}
 
 bool RPCSystem::initSPIFFS() {
   if (!SPIFFS.begin(true)) {
@@ -23,297 +43,957 @@ bool RPCSystem::initSPIFFS() {
   return true;
 }
 
-bool RPCSystem::connectWiFi() {
-  Serial.print("Connecting to WiFi");
-  WiFi.begin(ssid, password);
-  unsigned long start = millis();
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
-    if (millis() - start > 20000) {
-      Serial.println("WiFi connection failed");
-      return false;
-    }
+// Where the last association went, kept in RTC memory so it survives deep
+// sleep (but not a power cycle). Used for a directed connect on wake: no scan,
+// and with the previous lease reused, no DHCP round trip either.
+struct WiFiCache {
+  uint32_t magic;
+  uint8_t bssid[6];
+  int32_t channel;
+  uint32_t ip, gateway, subnet, dns;
+};
+static const uint32_t WIFI_CACHE_MAGIC = 0x57494631; // "WIF1"
+RTC_DATA_ATTR static WiFiCache rtc_wifi;
+
+void RPCSystem::startWiFi() {
+  WiFi.disconnect();
+  // Only the first attempt is directed; any retry scans like a cold start
+  wifi_directed = WIFI_FAST_CONNECT && attempts == 0 && rtc_wifi.magic == WIFI_CACHE_MAGIC;
+  applyAddress();
+  if (wifi_directed) {
+    Serial.printf("Connecting to WiFi (channel %d, cached AP)\n", (int)rtc_wifi.channel);
+    WiFi.begin(ssid, password, rtc_wifi.channel, rtc_wifi.bssid);
+  } else {
+    Serial.println("Connecting to WiFi");
+    WiFi.begin(ssid, password);
   }
-  Serial.println();
-  Serial.print("Connected, IP: ");
-  Serial.println(WiFi.localIP());
-  return true;
+  wifi_started = millis();
+  setState(LinkState::WiFiConnecting);
 }
 
-bool RPCSystem::connectMQTT() {
+void RPCSystem::applyAddress() {
+#ifdef WIFI_STATIC_IP
+  WiFi.config(IPAddress(WIFI_STATIC_IP), IPAddress(WIFI_STATIC_GATEWAY),
+              IPAddress(WIFI_STATIC_SUBNET), IPAddress(WIFI_STATIC_DNS));
+#else
+  if (wifi_directed && rtc_wifi.ip != 0) {
+    WiFi.config(IPAddress(rtc_wifi.ip), IPAddress(rtc_wifi.gateway),
+                IPAddress(rtc_wifi.subnet), IPAddress(rtc_wifi.dns));
+  } else {
+    WiFi.config(IPAddress(), IPAddress(), IPAddress()); // all zero: DHCP
+  }
+#endif
+}
+
+void RPCSystem::rememberAP() {
+  memcpy(rtc_wifi.bssid, WiFi.BSSID(), sizeof(rtc_wifi.bssid));
+  rtc_wifi.channel = WiFi.channel();
+  rtc_wifi.ip = (uint32_t)WiFi.localIP();
+  rtc_wifi.gateway = (uint32_t)WiFi.gatewayIP();
+  rtc_wifi.subnet = (uint32_t)WiFi.subnetMask();
+  rtc_wifi.dns = (uint32_t)WiFi.dnsIP();
+  rtc_wifi.magic = WIFI_CACHE_MAGIC;
+}
+
+void RPCSystem::forgetAP() {
+  rtc_wifi.magic = 0;
+}
+
+// One connect attempt; for MQTT the TCP connect is bounded by the client's connect timeout.
+bool RPCSystem::connectTransport() {
+  Serial.printf("Connecting over %s\n", transport.name());
+#if MQTT_USE_TLS && MQTT_TLS_BENCHMARK
+  static bool benchmarked = false;
+  if (!benchmarked) {
+    benchmarked = true;
+    TlsClient::benchmark(mqtt_server, mqtt_port, MQTT_CA_PEM, MQTT_TLS_ALLOW_INSECURE, MQTT_TLS_BENCHMARK);
+  }
+#endif
+  // One client id per display: espdisplay-<uuid>, under which the broker keeps
+  // a persistent session. Before the server has assigned a UUID the id comes
+  // from the MAC address and the session is clean, since it would be orphaned.
+  char client_id[32];
+  connecting.session_uuid = rpc.getUUID();
+  if (connecting.session_uuid >= 0) {
+    snprintf(client_id, sizeof(client_id), "espdisplay-%d", connecting.session_uuid);
+  } else {
+    uint8_t mac[6];
+    WiFi.macAddress(mac);
+    snprintf(client_id, sizeof(client_id), "espdisplay-%02x%02x%02x%02x%02x%02x",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  }
+  bool ok = transport.connect(client_id, connecting.session_uuid >= 0);
+  Serial.printf(ok ? "Transport connected as %s\n" : "Transport connection failed (%s)\n", client_id);
+#if MQTT_USE_TLS && !RPC_TRANSPORT_UDP
+  if (ok) Serial.printf("TLS handshake %lu ms (%s)\n", client.handshakeMs(),
+                        client.resumptionOffered() ? "session resumption offered" : "full");
+#endif
+  return ok;
+}
+
+bool RPCSystem::begin(bool background) {
+  if (!initSPIFFS()) return false;
+  outbound.begin();
+#if MQTT_USE_TLS
+  client.setCACert(MQTT_CA_PEM);
+  if (MQTT_TLS_ALLOW_INSECURE) client.setInsecure();
+#endif
   mqtt.setServer(mqtt_server, mqtt_port);
-  Serial.print("Connecting to MQTT");
-  unsigned long start = millis();
-  while (!mqtt.connected()) {
-    bool ok;
-    if (mqtt_user && mqtt_pass) ok = mqtt.connect("esp32client", mqtt_user, mqtt_pass);
-    else ok = mqtt.connect("esp32client");
-    if (ok) {
-      Serial.println("MQTT connected");
+  mqtt.setBufferSize(MQTT_BUFFER_SIZE);
+  mqtt.setSocketTimeout(MQTT_SOCKET_TIMEOUT_S);
+  WiFi.mode(WIFI_STA);
+  if (!rpc.begin()) return false;
+  startWiFi();
+  if (background &&
+      xTaskCreatePinnedToCore(&RPCSystem::linkTask, "rpc_link", LINK_TASK_STACK, this, 1, &link_task, 0) != pdPASS) {
+    Serial.println("Could not start link task, connecting from loop()");
+    link_task = nullptr;
+  }
+  return true;
+}
+
+void RPCSystem::linkTask(void* arg) {
+  RPCSystem* self = (RPCSystem*)arg;
+  for (;;) {
+    self->advanceConnect();
+    vTaskDelay(pdMS_TO_TICKS(LINK_TASK_PERIOD_MS));
+  }
+}
+
+void RPCSystem::loop() {
+  if (!link_task) advanceConnect();
+  advanceSession();
+  if (isReady()) {
+    if (outbound.depth() > 0) outbound.replay(&RPCSystem::replayRecord, this);
+  } else {
+    states.drainTo(outbound); // hold updates until the link is back
+  }
+  states.loop(); // queued updates join this tick's batch
+  rpc.loop();
+}
+
+void RPCSystem::prepareForSleep() {
+  states.drainTo(outbound);
+  if (!outbound.persist()) Serial.println("failed to persist outbound queue");
+}
+
+// Replayed updates go back through the state queue, which coalesces them with
+// anything newer and resends until acknowledged.
+bool RPCSystem::replayRecord(const char* method, JsonVariantConst params, void* ctx) {
+  RPCSystem* self = (RPCSystem*)ctx;
+  if (strcmp(method, "update_state") == 0) {
+    const char* comp_id = params["comp_id"] | "";
+    size_t len = strlen(comp_id);
+    if (len == 0 || len >= StateUpdateQueue::MAX_COMP_ID_LEN) return true; // malformed, drop it
+    return self->states.push(comp_id, params["state"]);
+  }
+  return self->rpc.callAsync(method, params, nullptr) != 0;
+}
+
+void RPCSystem::setState(LinkState s) {
+  state_since = millis(); // before the store that may hand the link to the other side
+  state.store(s, std::memory_order_release);
+}
+
+// Exponential backoff with equal jitter: wait between half and all of the
+// current step, doubling the step after every failed attempt.
+void RPCSystem::scheduleRetry() {
+  if (transport.connected()) transport.disconnect();
+
+  uint8_t n = attempts.load();
+  unsigned long step = BACKOFF_MIN_MS << (n < 6 ? n : 6);
+  if (step > BACKOFF_MAX_MS) step = BACKOFF_MAX_MS;
+  backoff_ms = step / 2 + esp_random() % (step / 2 + 1);
+  if (n < 255) attempts.store(n + 1);
+
+  Serial.printf("Link down, retrying in %lu ms\n", backoff_ms);
+  setState(LinkState::Backoff);
+}
+
+void RPCSystem::advanceConnect() {
+  unsigned long elapsed = millis() - state_since;
+  bool wifi_up = WiFi.status() == WL_CONNECTED;
+
+  switch (state.load(std::memory_order_acquire)) {
+    case LinkState::WiFiConnecting:
+      if (wifi_up) {
+        connecting.association_ms = millis() - wifi_started;
+        Serial.print("Connected, IP: ");
+        Serial.println(WiFi.localIP());
+        Serial.printf("WiFi associated in %lu ms (%s)\n", connecting.association_ms, wifi_directed ? "directed" : "scan");
+        rememberAP();
+        boot_mark(BOOT_WIFI);
+        setState(LinkState::MQTTConnecting);
+      } else if (wifi_directed && elapsed > WIFI_DIRECTED_TIMEOUT_MS) {
+        Serial.println("Cached AP did not answer, scanning");
+        forgetAP();
+        startWiFi();
+      } else if (elapsed > WIFI_TIMEOUT_MS) {
+        Serial.println("WiFi connection failed");
+        scheduleRetry();
+      }
       break;
+
+    case LinkState::MQTTConnecting:
+      if (!wifi_up || !connectTransport()) {
+        if (wifi_directed) {
+          // A reused lease may have gone stale; rejoin with a scan and DHCP
+          forgetAP();
+          WiFi.disconnect();
+          wifi_directed = false;
+        }
+        scheduleRetry();
+        break;
+      }
+      boot_mark(BOOT_MQTT);
+      setState(LinkState::Handshake); // loop() takes over and starts the session
+      break;
+
+    case LinkState::Backoff:
+      if (elapsed < backoff_ms) break;
+      if (wifi_up) setState(LinkState::MQTTConnecting);
+      else startWiFi();
+      break;
+
+    default:
+      break;
+  }
+}
+
+void RPCSystem::advanceSession() {
+  LinkState s = state.load(std::memory_order_acquire);
+  if (s != LinkState::Handshake && s != LinkState::Ready) return;
+  bool link_up = WiFi.status() == WL_CONNECTED && transport.connected();
+
+  if (s == LinkState::Handshake) {
+    live = connecting; // the connect step leaves it alone until handed back
+    if (link_up && rpc.sessionState() == ESP32RPC::Session::Closed) rpc.startSession();
+    if (!link_up || rpc.sessionState() == ESP32RPC::Session::Failed) {
+      rpc.endSession();
+      scheduleRetry();
+    } else if (rpc.sessionState() == ESP32RPC::Session::Ready && rpc.getUUID() != live.session_uuid) {
+      reconnectPersistent();
+    } else if (rpc.sessionState() == ESP32RPC::Session::Ready) {
+      attempts = 0;
+      boot_mark(BOOT_SESSION);
+      setState(LinkState::Ready);
     }
-    delay(500);
-    Serial.print(".");
-    if (millis() - start > 10000) {
-      Serial.println("MQTT connection failed");
-      return false;
-    }
+    return;
+  }
+
+  if (!link_up) {
+    Serial.println("Connection lost");
+    rpc.endSession();
+    scheduleRetry();
   }
-  return true;
 }
 
-bool RPCSystem::begin() {
-  if (!initSPIFFS()) return false;
-  if (!connectWiFi()) return false;
-  if (!connectMQTT()) return false;
-  return rpc.begin();
+// The handshake just assigned a UUID: reconnect under the stable client id so
+// the broker starts keeping a session for this display.
+void RPCSystem::reconnectPersistent() {
+  Serial.printf("Reconnecting as espdisplay-%d with a persistent session\n", rpc.getUUID());
+  rpc.endSession();
+  transport.disconnect();
+  setState(LinkState::MQTTConnecting); // hands the connect back to the link task
+}
+
+const char* RPCSystem::stateName(LinkState s) {
+  switch (s) {
+    case LinkState::Idle: return "idle";
+    case LinkState::WiFiConnecting: return "wifi";
+    case LinkState::MQTTConnecting: return "mqtt";
+    case LinkState::Handshake: return "handshake";
+    case LinkState::Ready: return "ready";
+    case LinkState::Backoff: return "backoff";
+  }
+  return "?";
 }
 
 // ---------------- ESP32RPC ----------------
 
-static ESP32RPC* s_rpc_instance = nullptr;
+const uint8_t ESP32RPC::LANE_MAX_IN_FLIGHT[ESP32RPC::LANE_COUNT] = { 8, 52, 4 };
 
-ESP32RPC::ESP32RPC(PubSubClient &client, const String &uuid_file)
-  : mqtt(client), uuid_file(uuid_file) {
-  s_rpc_instance = this;
-}
+// The outbox, the request ring and the pending slots can hold documents for
+// many ticks, so they stay on the heap: only documents that end with their
+// message come from the JSON arena, which lets it empty and reset after every
+// message instead of filling up behind one long-lived document.
+ESP32RPC::ESP32RPC(RPCTransport &transport, const String &uuid_file)
+  : transport(transport), uuid_file(uuid_file) {}
 
 bool ESP32RPC::begin() {
-  mqtt.setCallback(&ESP32RPC::mqttThunk);
-  if (!loadUUID()) {
-    if (!requestUUID()) {
-      Serial.println("subscribe handshake failed");
-      return false;
-    }
-    if (!saveUUID()) {
-      Serial.println("failed to save UUID to SPIFFS");
-    }
+  transport.setReceiver(&ESP32RPC::onTransportMessage, this);
+  if (loadUUID()) internTopics();
+  return true;
+}
+
+void ESP32RPC::startSession() {
+  if (uuid >= 0) {
+    openSession();
+    return;
   }
+  session = Session::AwaitingUUID;
+  sendUUIDRequest();
+}
 
-  mqtt.subscribe(topicServer().c_str());
+void ESP32RPC::openSession() {
+  internTopics();
+  router.add(topic_server, &ESP32RPC::onServerMessage, this);
+  // (Re)subscribe everything routed so far, including filters added while offline
+  for (size_t i = 0; i < router.size(); i++) transport.subscribe(router.filterAt(i), qosFor(router.filterAt(i)));
+  session = Session::Ready;
 
   Serial.print("ESP32RPC ready, uuid=");
   Serial.println(uuid);
-  return true;
+}
+
+void ESP32RPC::endSession() {
+  if (session == Session::AwaitingUUID) router.remove(BROADCAST_TOPIC);
+  session = Session::Closed;
+  clearOutbox();
+  clearRequests(); // their replies could not be delivered; the server retries
+  // Calls still waiting can no longer be answered; fail them on the next loop
+  unsigned long now = millis();
+  for (size_t i = 0; i < MAX_PENDING; i++) {
+    if (pending[i].id == 0 || pending[i].done) continue;
+    pending[i].deadline = now;
+    pending[i].method_hash = 0; // a dead link says nothing about the server's latency
+  }
 }
 
 void ESP32RPC::loop() {
-  if (!mqtt.connected()) return;
-  mqtt.loop();
+  // Without a session the connection may still be in the hands of the link task
+  if (session != Session::Closed && transport.connected()) transport.loop();
+  if (session == Session::Ready) runQueuedRequests();
+  processPending();
+  // Everything queued during this tick leaves as one publish per lane
+  if (session == Session::Ready) flushOutbox();
+  else clearOutbox();
 }
 
 // --------- UUID storage ---------
 
+// The file holds the UUID, optionally followed by the negotiated encoding on a
+// second line (files written before encodings existed imply JSON).
 bool ESP32RPC::loadUUID() {
   File f = SPIFFS.open(uuid_file, "r");
   if (!f) return false;
-  String s = f.readString();
+  String s = f.readStringUntil('\n');
+  String enc = f.readStringUntil('\n');
   f.close();
   s.trim();
+  enc.trim();
   if (s.length() == 0) return false;
   uuid = s.toInt();
+  encoding = enc == "msgpack" ? Encoding::MsgPack : Encoding::Json;
   return uuid >= 0;
 }
 
 bool ESP32RPC::saveUUID() {
   File f = SPIFFS.open(uuid_file, "w");
   if (!f) return false;
-  f.printf("%d", uuid);
+  f.printf("%d\n%s\n", uuid, encoding == Encoding::MsgPack ? "msgpack" : "json");
   f.close();
   return true;
 }
 
 // --------- handshake with server ---------
 
-bool ESP32RPC::requestUUID() {
-  String req_id = newId();
+void ESP32RPC::sendUUIDRequest() {
+  // Waits in the call table like any call; onSubscribeReply runs on the reply or the timeout
+  Pending* p = allocPending(Priority::Interactive);
+  if (!p) {
+    session = Session::Failed;
+    return;
+  }
+  p->sent_at = millis();
+  p->deadline = p->sent_at + HANDSHAKE_TIMEOUT_MS;
+  p->adaptive = false;
+  p->handler = &ESP32RPC::onSubscribeReply;
+  p->ctx = this;
 
   JsonDocument doc;
-  doc["request_id"] = req_id;
+  doc["request_id"] = p->id;
   doc["request_type"] = "subscribe";
+  // Offered wire encodings, preferred first; the reply picks one
+  JsonArray encodings = doc["encodings"].to<JsonArray>();
+  encodings.add("msgpack");
+  encodings.add("json");
 
   String payload;
   serializeJson(doc, payload);
-  String rx_topic = "espdisplay/broadcast";
-  mqtt.subscribe(rx_topic.c_str());
-  mqtt.loop(); // process any pending messages
-  mqtt.publish("espdisplay/subscribe", payload.c_str());
-
-
-  unsigned long start = millis();
-  while (millis() - start < 5000) {
-    mqtt.loop();
-    if (uuid >= 0) {
-      mqtt.unsubscribe(rx_topic.c_str());
-      return true;
-    }
-    delay(5);
+  router.add(BROADCAST_TOPIC, &ESP32RPC::onBroadcast, this);
+  transport.subscribe(BROADCAST_TOPIC);
+  transport.loop(); // process any pending messages
+  transport.publish("espdisplay/subscribe", (const uint8_t*)payload.c_str(), payload.length());
+}
+
+void ESP32RPC::onSubscribeReply(bool ok, JsonVariantConst reply, void* ctx) {
+  ESP32RPC* self = (ESP32RPC*)ctx;
+  if (self->session != Session::AwaitingUUID) return; // the link dropped meanwhile
+
+  self->unsubscribe(BROADCAST_TOPIC);
+  int uuid = ok ? (reply["uuid"] | -1) : -1;
+  if (uuid < 0) {
+    Serial.println("subscribe handshake failed");
+    self->session = Session::Failed;
+    return;
   }
-  mqtt.unsubscribe(rx_topic.c_str());
-  return false;
+  const char* enc = reply["encoding"] | "json";
+  self->uuid = uuid;
+  self->encoding = strcmp(enc, "msgpack") == 0 ? Encoding::MsgPack : Encoding::Json;
+  Serial.print("Got UUID from server: ");
+  Serial.println(uuid);
+  Serial.print("Wire encoding: ");
+  Serial.println(enc);
+  if (!self->saveUUID()) {
+    Serial.println("failed to save UUID to SPIFFS");
+  }
+  self->openSession();
 }
 
 // --------- MQTT and topics ---------
 
-String ESP32RPC::topicServer() const {
-  String s = "espdisplay/";
-  s += String(uuid);
-  s += "/server";
-  return s;
+void ESP32RPC::internTopics() {
+  snprintf(topic_server, sizeof(topic_server), "espdisplay/%d/server", uuid);
+  snprintf(topic_client, sizeof(topic_client), "espdisplay/%d/client", uuid);
+}
+
+uint8_t ESP32RPC::qosFor(const char* filter) const {
+  if (strcmp(filter, topic_server) == 0) return SERVER_QOS;
+  for (size_t i = 0; i < group_count; i++) {
+    if (strcmp(filter, group_topics[i]) == 0) return SERVER_QOS;
+  }
+  return 0;
 }
 
-String ESP32RPC::topicClient() const {
-  String s = "espdisplay/";
-  s += String(uuid);
-  s += "/client";
-  return s;
+bool ESP32RPC::subscribe(const char* filter, TopicRouter::Handler handler, void* ctx) {
+  if (!router.add(filter, handler, ctx)) return false;
+  // While offline the route is kept and subscribed when the session opens
+  if (session == Session::Ready) transport.subscribe(filter, qosFor(filter));
+  return true;
 }
 
-void ESP32RPC::mqttThunk(char* topic, byte* payload, unsigned int length) {
-  Serial.println("MQTT message received");
-  if (!s_rpc_instance) return;
-  s_rpc_instance->onMQTT(topic, payload, length);
+bool ESP32RPC::unsubscribe(const char* filter) {
+  if (!router.remove(filter)) return false;
+  if (session != Session::Closed && transport.connected()) transport.unsubscribe(filter);
+  return true;
 }
 
-void ESP32RPC::onMQTT(char* topic, byte* payload, unsigned int length) {
-  String t(topic);
-  if (t == topicClient()) {
-    return;
-  }
-  Serial.print("Got MQTT message on topic: ");
-  Serial.println(t);
-  String s;
-  s.reserve(length + 1);
-  for (unsigned int i = 0; i < length; i++) s += (char)payload[i];
-
-  if (t == "espdisplay/broadcast") {
-    Serial.print("Got broadcast message: ");
-    Serial.println(s);
-    JsonDocument doc;
-    DeserializationError err = deserializeJson(doc, s);
-    if (err) return;
-    const char* type = doc["request_type"] | "";
-    const char* rid  = doc["request_id"] | "";
-    // print request_type and request_id for debugging
-    Serial.print("request_type: ");
-    Serial.println(type);
-    Serial.print("request_id: ");
-    Serial.println(rid);
-    if (strcmp(type, "subscribe_reply") == 0 && strlen(rid) > 0) {
-      uuid = doc["uuid"] | -1;
-      if (uuid >= 0) {
-        Serial.print("Got UUID from server: ");
-        Serial.println(uuid);
-      }
+size_t ESP32RPC::setGroups(JsonArrayConst names) {
+  for (size_t i = 0; i < group_count; i++) unsubscribe(group_topics[i]);
+  group_count = 0;
+
+  for (JsonVariantConst name : names) {
+    const char* n = name | "";
+    if (!*n || strchr(n, '/') || strchr(n, '+') || strchr(n, '#')) continue; // one plain topic level
+    if (group_count == MAX_GROUPS) {
+      Serial.println("Too many groups, ignoring the rest");
+      break;
     }
-    return;
+    char* topic = group_topics[group_count];
+    int len = snprintf(topic, TopicRouter::MAX_TOPIC_LEN, "espdisplay/group/%s", n);
+    if (len >= (int)TopicRouter::MAX_TOPIC_LEN) continue;
+    group_count++; // counted before subscribing, so it goes out with the server QoS
+    if (!subscribe(topic, &ESP32RPC::onServerMessage, this)) group_count--;
   }
+  return group_count;
+}
 
-  JsonDocument doc;
-  DeserializationError err = deserializeJson(doc, s);
+void ESP32RPC::onTransportMessage(const char* topic, const uint8_t* payload, size_t length, void* ctx) {
+  ESP32RPC* self = (ESP32RPC*)ctx;
+  if (self->router.route(topic, payload, length) == 0) {
+    Serial.print("Unrouted message on topic: ");
+    Serial.println(topic);
+  }
+}
+
+// Messages are parsed straight out of the transport's receive buffer; the
+// document, allocated from the JSON arena, is the only per-message copy of
+// the payload, and is gone by the end of the loop() that received it.
+
+void ESP32RPC::onBroadcast(const char* topic, const uint8_t* payload, size_t length, void* ctx) {
+  ESP32RPC* self = (ESP32RPC*)ctx;
+  Serial.print("Got broadcast message: ");
+  Serial.write(payload, length);
+  Serial.println();
+  JsonDocument doc(&JsonArena::instance());
+  DeserializationError err = deserializeJson(doc, payload, length);
   if (err) return;
-  handleIncomingJSON(t, doc);
+  const char* type = doc["request_type"] | "";
+  uint32_t rid = doc["request_id"] | 0u;
+  // print request_type and request_id for debugging
+  Serial.print("request_type: ");
+  Serial.println(type);
+  Serial.print("request_id: ");
+  Serial.println((unsigned long)rid);
+  if (strcmp(type, "subscribe_reply") != 0) return;
+  // Every display waiting for a UUID hears every reply; ours carries our id
+  Pending* p = self->findPending(rid);
+  if (!p || p->done || p->handler != &ESP32RPC::onSubscribeReply) return;
+  p->doc["result"].set(doc);
+  p->done = true;
+}
+
+void ESP32RPC::onServerMessage(const char* topic, const uint8_t* payload, size_t length, void* ctx) {
+  ESP32RPC* self = (ESP32RPC*)ctx;
+  JsonDocument doc(&JsonArena::instance());
+  DeserializationError err = decodeMessage(doc, payload, length);
+  if (err) return;
+  self->handleIncomingJSON(doc);
+}
+
+// Inbound messages are decoded by their first byte rather than the negotiated
+// encoding: a MessagePack map or array header is never valid leading JSON.
+DeserializationError ESP32RPC::decodeMessage(JsonDocument &doc, const uint8_t* payload, size_t length) {
+  bool msgpack = length > 0 && ((payload[0] & 0xE0) == 0x80 || (payload[0] >= 0xdc && payload[0] <= 0xdf));
+  if (msgpack) return deserializeMsgPack(doc, payload, length);
+  return deserializeJson(doc, payload, length);
 }
 
 // --------- JSON-RPC helpers ---------
 
-String ESP32RPC::newId() {
-  char buf[37];
-  for (int i = 0; i < 36; i++) buf[i] = "abcdef0123456789"[esp_random() % 16];
-  buf[36] = 0;
-  return String(buf);
+// Sits between the serializer and the transport so ArduinoJson's many small
+// writes reach the socket in chunks instead of one write per token.
+class PublishWriter : public Print {
+public:
+  explicit PublishWriter(RPCTransport &transport) : transport(transport) {}
+  ~PublishWriter() { flush(); }
+
+  size_t write(uint8_t c) override {
+    if (used == sizeof(buf)) flush();
+    buf[used++] = c;
+    return 1;
+  }
+
+  size_t write(const uint8_t* data, size_t size) override {
+    for (size_t i = 0; i < size; i++) write(data[i]);
+    return size;
+  }
+
+  void flush() override {
+    if (used) transport.write(buf, used);
+    used = 0;
+  }
+
+private:
+  RPCTransport &transport;
+  uint8_t buf[64];
+  size_t used = 0;
+};
+
+// The message is measured first so the transport's header can carry its
+// length, then serialized straight into the connection: no intermediate copy.
+ESP32RPC::SendResult ESP32RPC::sendMessage(const char* topic, JsonVariantConst msg, bool urgent) {
+  bool msgpack = encoding == Encoding::MsgPack;
+  size_t len = msgpack ? measureMsgPack(msg) : measureJson(msg);
+  if (len > transport.maxMessageSize()) return SendResult::TooLarge;
+  bool open = urgent ? transport.beginUrgentMessage(topic, len) : transport.beginMessage(topic, len);
+  if (!open) return SendResult::Busy;
+  {
+    PublishWriter out(transport);
+    if (msgpack) serializeMsgPack(msg, out);
+    else serializeJson(msg, out);
+  }
+  transport.endMessage();
+  return SendResult::Sent;
 }
 
-void ESP32RPC::sendJSON(const String &topic, JsonDocument const &doc) {
-  String out;
-  serializeJson(doc, out);
-  mqtt.publish(topic.c_str(), out.c_str());
+// Each box on its own: one the transport refuses stays queued without
+// stopping the boxes after it, so bulk traffic filling the transport never
+// keeps a user action or a reply the server is waiting on from going out.
+void ESP32RPC::flushOutbox() {
+  flushBox(outbox[(size_t)Priority::Interactive], true);
+  flushBox(replies);
+  for (size_t lane = (size_t)Priority::Background; lane < LANE_COUNT; lane++) flushBox(outbox[lane]);
 }
 
-void ESP32RPC::handleIncomingJSON(const String &topic, JsonDocument const &doc) {
-  if (doc["method"].is<JsonVariantConst>()) {
-    handleIncomingRequest(doc);
-  } else if (doc["result"].is<JsonVariantConst>()) {
-    handleIncomingResponse(doc);
-  } else if (doc["error"].is<JsonVariantConst>()) {
-    handleIncomingResponse(doc);
+// A lone message goes out as a plain object, anything more as one batch
+// array. A batch over the transport's limit is split into single messages;
+// whatever the transport is too busy for stays in the box for the next tick.
+void ESP32RPC::flushBox(JsonDocument &box, bool urgent) {
+  size_t n = box.size();
+  if (n == 0) return;
+  JsonVariantConst whole = n == 1 ? box[0].as<JsonVariantConst>() : box.as<JsonVariantConst>();
+  SendResult r = sendMessage(topic_client, whole, urgent);
+  if (r == SendResult::Busy) return;
+  if (r == SendResult::TooLarge && n == 1) dropOversize(box[0]);
+  if (r == SendResult::Sent || n == 1) {
+    box.clear();
+    return;
+  }
+
+  while (box.size() > 0) {
+    r = sendMessage(topic_client, box[0], urgent);
+    if (r == SendResult::Busy) return;
+    if (r == SendResult::TooLarge) dropOversize(box[0]);
+    box.remove((size_t)0);
   }
+  box.clear(); // releases what the removed members used
 }
 
-void ESP32RPC::handleIncomingRequest(JsonDocument const &doc) {
-  String method = doc["method"] | "";
-  JsonVariantConst params = doc["params"];
-  String id = doc["id"] | "";
+// Nothing can carry the message. A call fails at once, without marking the
+// method slow; a reply or notification is lost, and the server times out.
+void ESP32RPC::dropOversize(JsonVariantConst msg) {
+  Serial.printf("RPC message too large for %s (limit %u bytes), dropped\n",
+                transport.name(), (unsigned)transport.maxMessageSize());
+  uint32_t id = msg["id"] | 0u;
+  if (!id || !msg["method"].is<const char*>()) return;
+  Pending* p = findPending(id);
+  if (!p || p->done) return;
+  p->deadline = millis();
+  p->method_hash = 0;
+  p->adaptive = false;
+}
 
-  auto it = methods.find(method);
-  JsonDocument reply;
+void ESP32RPC::clearOutbox() {
+  replies.clear();
+  for (size_t lane = 0; lane < LANE_COUNT; lane++) outbox[lane].clear();
+}
 
+void ESP32RPC::handleIncomingJSON(JsonDocument &doc) {
+  if (doc.is<JsonArrayConst>()) {
+    // Batch: requests are queued one by one; their replies leave with whatever others the tick produces
+    for (JsonVariantConst msg : doc.as<JsonArrayConst>()) handleIncomingMessage(msg, nullptr);
+    return;
+  }
+  handleIncomingMessage(doc.as<JsonVariantConst>(), &doc);
+}
+
+void ESP32RPC::handleIncomingMessage(JsonVariantConst msg, JsonDocument* owner) {
+  if (msg["method"].is<JsonVariantConst>()) {
+    const char* method = msg["method"] | "";
+    const MethodEntry* m = findMethod(method, strlen(method));
+    if (m && m->dispatch == Dispatch::OnArrival) handleIncomingRequest(msg);
+    else queueRequest(msg);
+  } else if (msg["result"].is<JsonVariantConst>()) {
+    handleIncomingResponse(msg, owner);
+  } else if (msg["error"].is<JsonVariantConst>()) {
+    handleIncomingResponse(msg, owner);
+  }
+}
+
+// --------- deferred server requests ---------
+
+void ESP32RPC::queueRequest(JsonVariantConst msg) {
+  if (request_count == MAX_QUEUED_REQUESTS) {
+    busy_rejects++;
+    if (!msg["id"].is<JsonVariantConst>()) return; // a dropped notification needs no answer
+    JsonObject reply = replies.add<JsonObject>();
+    reply["jsonrpc"] = "2.0";
+    JsonObject err = reply["error"].to<JsonObject>();
+    err["code"] = (int)BUSY_ERROR; // by value: set() takes a reference
+    err["message"] = "Busy, retry later";
+    reply["id"] = msg["id"];
+    return;
+  }
+  requests[(request_head + request_count) % MAX_QUEUED_REQUESTS].set(msg);
+  request_count++;
+}
+
+void ESP32RPC::runQueuedRequests() {
+  unsigned long start = micros();
+  while (request_count > 0) {
+    JsonDocument &req = requests[request_head];
+    handleIncomingRequest(req.as<JsonVariantConst>());
+    req.clear();
+    request_head = (request_head + 1) % MAX_QUEUED_REQUESTS;
+    request_count--;
+    // whatever is left waits for the next tick
+    if (micros() - start >= request_budget_us) break;
+  }
+}
+
+void ESP32RPC::clearRequests() {
+  for (size_t i = 0; i < MAX_QUEUED_REQUESTS; i++) requests[i].clear();
+  request_head = 0;
+  request_count = 0;
+}
+
+void ESP32RPC::handleIncomingRequest(JsonVariantConst msg) {
+  const char* method = msg["method"] | "";
+  const MethodEntry* m = findMethod(method, strlen(method));
+  bool notification = !msg["id"].is<JsonVariantConst>();
+  if (notification) {
+    // No reply expected; the handler's result goes nowhere
+    JsonDocument scratch(&JsonArena::instance());
+    if (m) m->handler(msg["params"], scratch.to<JsonVariant>(), m->ctx);
+    return;
+  }
+
+  JsonObject reply = replies.add<JsonObject>();
   reply["jsonrpc"] = "2.0";
-  if (it == methods.end()) {
+  if (!m) {
     JsonObject err = reply["error"].to<JsonObject>();
     err["code"] = -32601;
     err["message"] = "Unknown method";
-    reply["id"] = id;
-  } else {
-    JsonVariant result = it->second(params);
-    reply["result"] = result;
-    reply["id"] = id;
+  } else if (!m->handler(msg["params"], reply["result"].to<JsonVariant>(), m->ctx)) {
+    reply.remove("result");
+    JsonObject err = reply["error"].to<JsonObject>();
+    err["code"] = -32603;
+    err["message"] = "Internal error";
   }
+  reply["id"] = msg["id"];
+}
 
-  sendJSON(topicClient(), reply);
+void ESP32RPC::handleIncomingResponse(JsonVariantConst msg, JsonDocument* owner) {
+  if (!msg["id"].is<uint32_t>()) return;
+  Pending* p = findPending(msg["id"].as<uint32_t>());
+  if (!p || p->done) return; // stale or duplicate reply
+  // Ids are never reused, so the sample is unambiguous even for resent updates
+  if (p->method_hash) sampleRtt(p->method_hash, millis() - p->sent_at);
+  // A standalone reply is handed over without copying, arena and all: its
+  // callback runs from this same loop(). Batch members are copied out.
+  if (owner) p->doc = std::move(*owner);
+  else p->doc.set(msg);
+  p->done = true;
 }
 
-void ESP32RPC::handleIncomingResponse(JsonDocument const &doc) {
-  String id = doc["id"] | "";
-  auto it = pending.find(id);
-  if (it == pending.end()) return;
-  Pending* p = it->second;
-  p->doc.clear();
-  for (JsonPairConst kv : doc.as<JsonObjectConst>()) {
-    p->doc[kv.key()] = kv.value();
+// --------- pending call table ---------
+
+ESP32RPC::Pending* ESP32RPC::allocPending(Priority prio) {
+  size_t lane = (size_t)prio;
+  if (lane_in_flight[lane] >= LANE_MAX_IN_FLIGHT[lane]) return nullptr;
+  for (size_t tries = 0; tries < MAX_PENDING; tries++) {
+    uint32_t id = next_id++;
+    if (next_id == 0) next_id = 1;
+    Pending &p = pending[id % MAX_PENDING];
+    if (p.id != 0) continue;
+    p.id = id;
+    p.done = false;
+    p.lane = lane;
+    in_flight++;
+    lane_in_flight[lane]++;
+    return &p;
   }
-  p->done = true;
+  return nullptr;
+}
+
+ESP32RPC::Pending* ESP32RPC::findPending(uint32_t id) {
+  if (id == 0) return nullptr;
+  Pending &p = pending[id % MAX_PENDING];
+  return p.id == id ? &p : nullptr;
+}
+
+void ESP32RPC::releasePending(Pending &p) {
+  p.id = 0;
+  p.done = false;
+  p.method_hash = 0;
+  p.handler = nullptr;
+  p.ctx = nullptr;
+  p.cb = nullptr;
+  p.doc = JsonDocument(); // back on the heap, and a moved-in reply's arena blocks freed
+  in_flight--;
+  lane_in_flight[p.lane]--;
 }
 
 // --------- device makes JSON-RPC call to server ---------
 
-JsonDocument ESP32RPC::call(const String &method, JsonVariantConst params, unsigned long timeout) {
-  String id = newId();
-  JsonDocument req;
+bool ESP32RPC::canSend(Priority prio) const {
+  size_t lane = (size_t)prio;
+  if (session != Session::Ready) return false;
+  if (lane_in_flight[lane] >= LANE_MAX_IN_FLIGHT[lane]) return false;
+  return prio == Priority::Interactive || outbox[lane].size() < LANE_MAX_QUEUED;
+}
+
+ESP32RPC::CallHandle ESP32RPC::callAsync(const String &method, JsonVariantConst params, ResponseCallback cb,
+                                         unsigned long timeout, Priority prio) {
+  CallHandle h = callAsync(method, params, nullptr, nullptr, timeout, prio);
+  if (h) findPending(h)->cb = std::move(cb);
+  return h;
+}
+
+ESP32RPC::CallHandle ESP32RPC::callAsync(const String &method, JsonVariantConst params, ResponseHandler handler,
+                                         void* ctx, unsigned long timeout, Priority prio) {
+  if (!canSend(prio)) return 0; // backpressure: the caller keeps the request and retries
+  Pending* p = allocPending(prio);
+  if (!p) {
+    Serial.println("RPC call table full");
+    return 0;
+  }
+  uint32_t hash = fnv1a_n(method.c_str(), method.length());
+  p->adaptive = timeout == 0;
+  if (p->adaptive) timeout = timeoutFor(hash);
+  p->sent_at = millis();
+  p->deadline = p->sent_at + timeout;
+  p->method_hash = hash;
+  p->handler = handler;
+  p->ctx = ctx;
+
+  JsonObject req = outbox[(size_t)prio].add<JsonObject>();
   req["jsonrpc"] = "2.0";
   req["method"] = method;
   if (!params.isNull()) req["params"] = params;
-  req["id"] = id;
+  req["id"] = p->id;
+  return p->id;
+}
 
-  Pending* p = new Pending();
-  pending[id] = p;
+bool ESP32RPC::notify(const String &method, JsonVariantConst params, Priority prio) {
+  size_t lane = (size_t)prio;
+  if (session != Session::Ready) return false;
+  if (prio != Priority::Interactive && outbox[lane].size() >= LANE_MAX_QUEUED) return false;
+  JsonObject req = outbox[lane].add<JsonObject>();
+  req["jsonrpc"] = "2.0";
+  req["method"] = method;
+  if (!params.isNull()) req["params"] = params;
+  return true;
+}
+
+bool ESP32RPC::cancel(CallHandle handle) {
+  Pending* p = findPending(handle);
+  if (!p) return false;
+  releasePending(*p);
+  return true;
+}
 
-  sendJSON(topicClient(), req);
+void ESP32RPC::processPending() {
+  if (in_flight == 0) return;
+
+  unsigned long now = millis();
+  for (size_t i = 0; i < MAX_PENDING; i++) {
+    Pending &p = pending[i];
+    if (p.id == 0) continue;
+    if (!p.done && (long)(now - p.deadline) < 0) continue;
+
+    // Free the slot before running the callback: it may issue new calls.
+    bool done = p.done;
+    bool adaptive = p.adaptive;
+    uint32_t method_hash = p.method_hash;
+    ResponseHandler handler = p.handler;
+    void* ctx = p.ctx;
+    ResponseCallback cb = std::move(p.cb);
+    JsonDocument doc = std::move(p.doc);
+    releasePending(p);
+
+    if (!done && adaptive && method_hash) backoffRto(method_hash);
+    if (!handler && !cb) continue;
+
+    bool ok = done && doc["result"].is<JsonVariantConst>();
+    JsonVariantConst result;
+    if (done) result = doc[ok ? "result" : "error"];
+    if (handler) handler(ok, result, ctx);
+    else cb(ok, result);
+  }
+}
 
-  unsigned long start = millis();
-  while (millis() - start < timeout) {
-    mqtt.loop();
-    if (p->done) break;
+JsonDocument ESP32RPC::call(const String &method, JsonVariantConst params, unsigned long timeout) {
+  JsonDocument out; // stays empty on timeout or error reply
+  bool finished = false;
+  CallHandle h = callAsync(method, params, [&out, &finished](bool ok, JsonVariantConst result) {
+    if (ok) out.set(result);
+    finished = true;
+  }, timeout);
+  if (!h) return out;
+
+  while (!finished) {
+    loop();
     delay(5);
   }
+  return out;
+}
+
+// --------- round-trip estimation ---------
 
-  JsonDocument out; // make a deep copy of result
-  if (p->done) {
-    if (p->doc["result"].is<JsonVariantConst>()) {
-      out.set(p->doc["result"]);
-    } else if (p->doc["error"].is<JsonVariantConst>()) {
-      // leave out empty to signal error
+ESP32RPC::RttEstimate* ESP32RPC::findRtt(uint32_t hash) {
+  return const_cast<RttEstimate*>(static_cast<const ESP32RPC*>(this)->findRtt(hash));
+}
+
+const ESP32RPC::RttEstimate* ESP32RPC::findRtt(uint32_t hash) const {
+  for (size_t i = 0; i < MAX_RTT_METHODS; i++) {
+    if (rtt[i].hash == hash) return &rtt[i];
+  }
+  return nullptr;
+}
+
+unsigned long ESP32RPC::timeoutFor(uint32_t method_hash) const {
+  const RttEstimate* e = findRtt(method_hash);
+  return e ? e->rto : INITIAL_RTO_MS;
+}
+
+void ESP32RPC::sampleRtt(uint32_t hash, unsigned long ms) {
+  RttEstimate* e = findRtt(hash);
+  if (!e) {
+    e = findRtt(0);
+    // Table full: the least measured method makes room
+    if (!e) {
+      e = &rtt[0];
+      for (size_t i = 1; i < MAX_RTT_METHODS; i++) {
+        if (rtt[i].samples < e->samples) e = &rtt[i];
+      }
     }
+    *e = RttEstimate();
+    e->hash = hash;
+  }
+
+  // RFC 6298 gains (1/8 and 1/4) in integer milliseconds
+  if (e->samples == 0) {
+    e->srtt = ms;
+    e->rttvar = ms / 2;
   } else {
-    // timeout: leave out empty
+    unsigned long delta = ms > e->srtt ? ms - e->srtt : e->srtt - ms;
+    e->rttvar = (3 * e->rttvar + delta) / 4;
+    e->srtt = (7 * e->srtt + ms) / 8;
   }
+  if (e->samples < UINT16_MAX) e->samples++;
 
-  pending.erase(id);
-  delete p;
-  return out;
+  unsigned long rto = e->srtt + 4 * e->rttvar;
+  e->rto = rto < MIN_RTO_MS ? MIN_RTO_MS : rto > MAX_RTO_MS ? MAX_RTO_MS : rto;
+}
+
+void ESP32RPC::backoffRto(uint32_t hash) {
+  RttEstimate* e = findRtt(hash);
+  if (!e) return; // unmeasured methods keep INITIAL_RTO_MS
+  e->rto = e->rto * 2 > MAX_RTO_MS ? MAX_RTO_MS : e->rto * 2;
+  Serial.printf("RPC timeout, RTO now %lu ms\n", e->rto);
 }
 
-void ESP32RPC::registerMethod(const String &name, Callback cb) {
-  methods[name] = cb;
+// --------- server makes JSON-RPC call to device ---------
+
+bool ESP32RPC::registerMethod(uint32_t method_hash, MethodHandler handler, void* ctx, Dispatch dispatch) {
+  return addMethod(method_hash, nullptr, handler, ctx, dispatch);
+}
+
+bool ESP32RPC::registerMethod(const char* name, MethodHandler handler, void* ctx, Dispatch dispatch) {
+  return name && addMethod(fnv1a_n(name, strlen(name)), name, handler, ctx, dispatch);
+}
+
+bool ESP32RPC::addMethod(uint32_t hash, const char* name, MethodHandler handler, void* ctx, Dispatch dispatch) {
+  if (!handler) return false;
+  for (size_t i = 0; i < METHOD_TABLE_SIZE; i++) {
+    MethodEntry &e = methods[(hash + i) & (METHOD_TABLE_SIZE - 1)];
+    if (e.handler && e.hash != hash) continue;
+    if (e.handler) {
+      // Same hash: only the same method may take the entry over
+      bool same = name && e.name ? strcmp(name, e.name) == 0 : e.handler == handler && e.ctx == ctx;
+      if (!same) {
+        Serial.printf("RPC method %s refused, hash 0x%08lx already taken by %s\n", name ? name : "?",
+                      (unsigned long)hash, e.name ? e.name : "another handler");
+        return false;
+      }
+      if (!e.name) e.name = name;
+    } else {
+      if (method_count >= MAX_METHODS) break;
+      method_count++;
+      e.name = name;
+    }
+    e.hash = hash;
+    e.handler = handler;
+    e.ctx = ctx;
+    e.dispatch = dispatch;
+    return true;
+  }
+  Serial.println("RPC method table full");
+  return false;
+}
+
+// A name that only shares its hash with a registered method is unknown
+const ESP32RPC::MethodEntry* ESP32RPC::findMethod(const char* name, size_t len) const {
+  uint32_t hash = fnv1a_n(name, len);
+  for (size_t i = 0; i < METHOD_TABLE_SIZE; i++) {
+    const MethodEntry &e = methods[(hash + i) & (METHOD_TABLE_SIZE - 1)];
+    if (!e.handler) return nullptr;
+    if (e.hash != hash) continue;
+    if (e.name && (strncmp(e.name, name, len) != 0 || e.name[len] != 0)) return nullptr;
+    return &e;
+  }
+  return nullptr;
 }
@@ -5,54 +5,254 @@
 #include <FS.h>
 #include <SPIFFS.h>
 #include <functional>
-#include <map>
+#include <atomic>
+#include "RPCHash.hpp"
+#include "TopicRouter.hpp"
+#include "StateUpdateQueue.hpp"
+#include "OutboundQueue.hpp"
+#include "JsonArena.hpp"
+#include "RPCTransport.hpp"
+#include "MqttTransport.hpp"
+#include "UdpTransport.hpp"
+#include "config.h"
+#if MQTT_USE_TLS
+#include "TlsClient.hpp"
+#endif
 
 class ESP32RPC {
 public:
-    using Callback = std::function<JsonVariant(JsonVariantConst)>;
+    // Server-initiated request handler. Writes its answer into result and
+    // returns false to reply with an internal error instead.
+    typedef bool (*MethodHandler)(JsonVariantConst params, JsonVariant result, void* ctx);
+    // Completion of an async call. ok is false on timeout or error reply; result
+    // then holds the "error" object (or null on timeout). Only valid during the call.
+    using ResponseCallback = std::function<void(bool ok, JsonVariantConst result)>;
+    // The same as a plain function and context, which costs nothing to store
+    // or call; the form used by the display's own traffic.
+    typedef void (*ResponseHandler)(bool ok, JsonVariantConst result, void* ctx);
+    using CallHandle = uint32_t; // the JSON-RPC id; 0 means the call could not be issued
 
-    ESP32RPC(PubSubClient &client, const String &uuid_file = "/uuid.txt");
+    static const size_t MAX_PENDING = 64; // room for a scene's worth of calls in flight at once
+    static const size_t MAX_METHODS = 64;
 
-    bool begin();
+    // Call timeouts adapt per method from measured round trips, the way TCP
+    // derives its retransmission timeout: RTO = SRTT + 4 * RTTVAR, clamped,
+    // and doubled after every timeout until a reply brings a new sample.
+    static const size_t MAX_RTT_METHODS = 16;
+    static const unsigned long INITIAL_RTO_MS = 5000; // until a method has been measured
+    static const unsigned long MIN_RTO_MS = 250;
+    static const unsigned long MAX_RTO_MS = 30000;
+
+    // Traffic classes. Each loop() tick publishes the lanes in this order, one
+    // batch per lane, so a user action never waits behind bulk traffic. Each
+    // lane has its own in-flight cap; when a lane is full, calls on it return
+    // 0 (and notify() false) until replies come back. Replies to server
+    // requests go out after Interactive and ahead of the other lanes, in a
+    // batch of their own: a batch never mixes the device's requests with its
+    // responses. Interactive is sent as urgent, on the share of the
+    // transport's capacity bulk traffic cannot take, and a box the transport
+    // is busy for waits for the next tick without holding up the others.
+    enum class Priority : uint8_t { Interactive, Background, Telemetry };
+    static const size_t LANE_COUNT = 3;
+    static const uint8_t LANE_MAX_IN_FLIGHT[LANE_COUNT]; // adds up to MAX_PENDING
+    static const size_t LANE_MAX_QUEUED = 8; // per tick on the Background and Telemetry lanes
+
+    // Server requests are queued on arrival and their handlers run from loop(),
+    // for at most the request budget per tick (at least one request), so a
+    // burst from the server cannot stall the UI. A full queue answers "busy".
+    static const size_t MAX_QUEUED_REQUESTS = 8;
+    static const unsigned long DEFAULT_REQUEST_BUDGET_US = 2000;
+    static const int BUSY_ERROR = -32001;
+
+    ESP32RPC(RPCTransport &transport, const String &uuid_file = "/uuid.txt");
+
+    // Session with the server on top of a connected transport
+    enum class Session : uint8_t { Closed, AwaitingUUID, Ready, Failed };
+
+    bool begin(); // installs the MQTT callback and loads a stored UUID
     void loop();
 
+    void startSession(); // after the transport connects: handshake if needed, then (re)subscribe
+    void endSession();   // link lost: drop queued traffic and fail waiting calls
+    Session sessionState() const { return session; }
+
+    // Wire encoding of JSON-RPC traffic, negotiated in the subscribe handshake
+    enum class Encoding : uint8_t { Json, MsgPack };
+
     int getUUID() const { return uuid; }
+    Encoding getEncoding() const { return encoding; }
+
+    // Non-blocking: the request is queued and cb runs from loop() once the reply
+    // arrives or the deadline passes. Returns 0 when the session is not ready or
+    // all MAX_PENDING slots are in use. Calls made within one loop() tick are
+    // published as one batch; a batch the transport cannot take yet waits for
+    // the next tick, and one over maxMessageSize() goes out a message at a
+    // time. A call too large to send at all fails from the next loop(). A
+    // timeout of 0 uses the method's current RTO.
+    CallHandle callAsync(const String &method, JsonVariantConst params, ResponseCallback cb,
+                         unsigned long timeout = 0, Priority prio = Priority::Background);
+    CallHandle callAsync(const String &method, JsonVariantConst params, ResponseHandler handler, void* ctx,
+                         unsigned long timeout = 0, Priority prio = Priority::Background);
+    bool notify(const String &method, JsonVariantConst params, Priority prio = Priority::Background); // no id, no reply
+    bool cancel(CallHandle handle); // drops the call without running its callback
+    size_t inFlight() const { return in_flight; }
+    size_t inFlight(Priority prio) const { return lane_in_flight[(size_t)prio]; }
+    bool canSend(Priority prio) const; // false while the lane is full or the session is down
+
+    void setRequestBudget(unsigned long us) { request_budget_us = us; }
+    size_t queuedRequests() const { return request_count; }
+    uint32_t busyRejects() const { return busy_rejects; } // requests refused since boot
+
+    // Blocking wrapper around callAsync, only meant for use before the UI is running.
+    JsonDocument call(const String &method, JsonVariantConst params, unsigned long timeout = 0);
+
+    size_t maxMessageSize() { return transport.maxMessageSize(); } // encoded, either direction
+
+    // Current retransmission timeout of a method, also a sensible retry interval
+    unsigned long timeoutFor(uint32_t method_hash) const;
+    unsigned long timeoutFor(const char* method) const { return timeoutFor(fnv1a(method)); }
+
+    // Handlers are keyed by the FNV-1a hash of the method name. Registered by
+    // name, which must outlive the RPC object (a literal), the name is also
+    // compared on dispatch, and a different name with the same hash is
+    // refused instead of replacing the handler. Registered by hash alone,
+    // e.g. registerMethod(fnv1a("clock_sync"), onClockSync, this), a hash
+    // already taken by another handler or ctx is refused.
+    //
+    // A Queued handler runs from loop() within the request budget. One
+    // registered OnArrival runs as soon as its message is parsed, bypassing
+    // the request queue: for handlers that only record the request for later,
+    // so a burst of them never fills the queue and gets answered "busy".
+    enum class Dispatch : uint8_t { Queued, OnArrival };
+    bool registerMethod(uint32_t method_hash, MethodHandler handler, void* ctx = nullptr,
+                        Dispatch dispatch = Dispatch::Queued);
+    bool registerMethod(const char* name, MethodHandler handler, void* ctx = nullptr,
+                        Dispatch dispatch = Dispatch::Queued);
+
+    // Routes messages on filter (which may contain + or #) to handler and
+    // subscribes to it on the broker, now or when the next session opens.
+    bool subscribe(const char* filter, TopicRouter::Handler handler, void* ctx = nullptr);
+    bool unsubscribe(const char* filter);
 
-    JsonDocument call(const String &method, JsonVariantConst params, unsigned long timeout = 5000);
-    void registerMethod(const String &name, Callback cb);
+    // Group topics, espdisplay/group/<name>, carry messages the server
+    // publishes once for every display in the group (a room, a set of
+    // entities). They are dispatched exactly like the device's own server
+    // topic. Replaces the current set and returns how many were joined.
+    static const size_t MAX_GROUPS = 8;
+    size_t setGroups(JsonArrayConst names);
+
+    // The server topic and group topics are subscribed with QoS 1. On a
+    // persistent session the broker then queues what the server sends while
+    // the display sleeps and replays it on reconnect; anything else is QoS 0.
+    static const uint8_t SERVER_QOS = 1;
 
 private:
-    PubSubClient &mqtt;
+    RPCTransport &transport;
     int uuid = -1;
+    Session session = Session::Closed;
+    Encoding encoding = Encoding::Json;
     String uuid_file;
-    std::map<String, Callback> methods;
 
+    // Open-addressed, linear-probed table; twice MAX_METHODS keeps probes short.
+    static const size_t METHOD_TABLE_SIZE = MAX_METHODS * 2;
+    static_assert((METHOD_TABLE_SIZE & (METHOD_TABLE_SIZE - 1)) == 0, "probing masks with METHOD_TABLE_SIZE - 1");
+    struct MethodEntry {
+      uint32_t hash = 0;
+      const char* name = nullptr; // nullptr when registered by hash
+      MethodHandler handler = nullptr; // nullptr = empty entry
+      void* ctx = nullptr;
+      Dispatch dispatch = Dispatch::Queued;
+    };
+    MethodEntry methods[METHOD_TABLE_SIZE];
+    size_t method_count = 0;
+
+    // Pending calls live in a preallocated table. Ids come from a 32-bit
+    // counter and id % MAX_PENDING selects the slot; the slot keeps the full id
+    // as its generation, so replies to expired or cancelled calls never match.
     struct Pending {
+      uint32_t id = 0; // 0 = free slot
       bool done = false;
-      JsonDocument doc; // holds either result or error form
-      Pending(): doc() {}
+      JsonDocument doc; // holds either result or error form; on the heap unless a reply was moved in
+      unsigned long deadline = 0;
+      unsigned long sent_at = 0;
+      uint32_t method_hash = 0; // 0 = the round trip is not sampled
+      bool adaptive = false;    // timeout came from the RTO, so a timeout backs it off
+      uint8_t lane = 0;
+      ResponseHandler handler = nullptr; // either handler and ctx,
+      void* ctx = nullptr;
+      ResponseCallback cb;               // or cb, or neither
     };
-    std::map<String, Pending*> pending;
+    Pending pending[MAX_PENDING];
+    size_t in_flight = 0;
+    size_t lane_in_flight[LANE_COUNT] = {};
+    uint32_t next_id = 1;
 
-    // topics
-    String topicServer() const; // server publishes requests here, device must subscribe
-    String topicClient() const; // server listens here, device publishes requests and responses
+    struct RttEstimate {
+      uint32_t hash = 0; // 0 = unused
+      unsigned long srtt = 0;
+      unsigned long rttvar = 0;
+      unsigned long rto = INITIAL_RTO_MS;
+      uint16_t samples = 0;
+    };
+    RttEstimate rtt[MAX_RTT_METHODS];
+    RttEstimate* findRtt(uint32_t hash);
+    const RttEstimate* findRtt(uint32_t hash) const;
+    void sampleRtt(uint32_t hash, unsigned long ms);
+    void backoffRto(uint32_t hash);
 
-    // handshake
-    bool requestUUID();
+    // topics, interned once the UUID is known
+    TopicRouter router;
+    char topic_server[TopicRouter::MAX_TOPIC_LEN] = ""; // server publishes requests here, device must subscribe
+    char topic_client[TopicRouter::MAX_TOPIC_LEN] = ""; // server listens here, device publishes requests and responses
+    void internTopics();
+    uint8_t qosFor(const char* filter) const;
+    char group_topics[MAX_GROUPS][TopicRouter::MAX_TOPIC_LEN];
+    size_t group_count = 0;
+
+    // handshake: the request takes a pending slot, and its numeric id is the
+    // request_id the server echoes on the shared broadcast topic
+    static constexpr const char* BROADCAST_TOPIC = "espdisplay/broadcast";
+    static const unsigned long HANDSHAKE_TIMEOUT_MS = 5000;
+    void sendUUIDRequest();
+    static void onSubscribeReply(bool ok, JsonVariantConst reply, void* ctx);
+    void openSession();
     bool loadUUID();
     bool saveUUID();
 
     // message handling
-    static void mqttThunk(char* topic, byte* payload, unsigned int length);
-    void onMQTT(char* topic, byte* payload, unsigned int length);
+    static void onTransportMessage(const char* topic, const uint8_t* payload, size_t length, void* ctx);
+    static void onBroadcast(const char* topic, const uint8_t* payload, size_t length, void* ctx);
+    static void onServerMessage(const char* topic, const uint8_t* payload, size_t length, void* ctx);
 
     // JSON-RPC helpers
-    String newId();
-    void sendJSON(const String &topic, JsonDocument const &doc);
-    void handleIncomingJSON(const String &topic, JsonDocument const &doc);
-    void handleIncomingRequest(JsonDocument const &doc);
-    void handleIncomingResponse(JsonDocument const &doc);
+    JsonDocument requests[MAX_QUEUED_REQUESTS]; // ring of server requests awaiting their handler
+    size_t request_head = 0;
+    size_t request_count = 0;
+    unsigned long request_budget_us = DEFAULT_REQUEST_BUDGET_US;
+    uint32_t busy_rejects = 0;
+    void queueRequest(JsonVariantConst msg); // copied: it may wait longer than the arena message
+    void runQueuedRequests();
+    void clearRequests();
+
+    JsonDocument outbox[LANE_COUNT]; // JSON-RPC messages queued during the current loop() tick
+    JsonDocument replies;            // responses to server requests, queued the same way
+    void clearOutbox();
+    enum class SendResult : uint8_t { Sent, Busy, TooLarge };
+    SendResult sendMessage(const char* topic, JsonVariantConst msg, bool urgent = false); // in the negotiated encoding
+    static DeserializationError decodeMessage(JsonDocument &doc, const uint8_t* payload, size_t length);
+    void flushOutbox();
+    void flushBox(JsonDocument &box, bool urgent = false);
+    void dropOversize(JsonVariantConst msg);
+    bool addMethod(uint32_t hash, const char* name, MethodHandler handler, void* ctx, Dispatch dispatch);
+    const MethodEntry* findMethod(const char* name, size_t len) const;
+    void handleIncomingJSON(JsonDocument &doc);
+    void handleIncomingMessage(JsonVariantConst msg, JsonDocument* owner);
+    void handleIncomingRequest(JsonVariantConst msg);
+    void handleIncomingResponse(JsonVariantConst msg, JsonDocument* owner); // moves *owner when set
+    Pending* allocPending(Priority prio);
+    Pending* findPending(uint32_t id);
+    void releasePending(Pending &p);
+    void processPending(); // completes answered calls and expires overdue ones
 };
 
 class RPCSystem {
@@ -66,9 +266,36 @@ public:
         const char* mqtt_pass = nullptr
     );
 
-    bool begin();
+    // Connection progress, advanced from loop() with backoff between attempts
+    enum class LinkState : uint8_t { Idle, WiFiConnecting, MQTTConnecting, Handshake, Ready, Backoff };
+
+    // Mounts SPIFFS and starts connecting; never blocks on the network. With
+    // background set, WiFi association and the MQTT connect run in their own
+    // FreeRTOS task, so a slow broker never stalls loop(). The session itself
+    // (handshake, calls, callbacks) always stays on the loop() thread.
+    bool begin(bool background = false);
+    void loop();
+    LinkState getState() const { return state; }
+    bool isReady() const { return state == LinkState::Ready; }
+    static const char* stateName(LinkState s);
+
     ESP32RPC& getRPC() { return rpc; }
     PubSubClient& getMQTT() { return mqtt; }
+    RPCTransport& getTransport() { return transport; } // MQTT, or UDP with RPC_TRANSPORT_UDP
+    StateUpdateQueue& getStateUpdates() { return states; }
+    size_t outboundDepth() const { return outbound.depth(); } // updates held while offline
+    unsigned long associationMs() const { return live.association_ms; } // WiFi.begin() to connected, for the live link
+
+    void prepareForSleep(); // writes held updates to flash so they survive deep sleep
+
+    static const uint16_t MQTT_BUFFER_SIZE = 2048; // largest inbound message; publishes are streamed
+    static const uint16_t MQTT_SOCKET_TIMEOUT_S = 2;
+    static const unsigned long WIFI_TIMEOUT_MS = 20000;
+    static const unsigned long WIFI_DIRECTED_TIMEOUT_MS = 4000; // then fall back to a full scan
+    static const unsigned long BACKOFF_MIN_MS = 500;
+    static const unsigned long BACKOFF_MAX_MS = 60000;
+    static const uint32_t LINK_TASK_STACK = MQTT_USE_TLS ? 8192 : 4096; // the TLS handshake runs in the link task
+    static const unsigned long LINK_TASK_PERIOD_MS = 20;
 
 private:
     const char* ssid;
@@ -78,11 +305,55 @@ private:
     const char* mqtt_user;
     const char* mqtt_pass;
 
+#if MQTT_USE_TLS
+    TlsClient client;
+#else
     WiFiClient client;
+#endif
     PubSubClient mqtt;
+    MqttTransport mqtt_transport;
+#if RPC_TRANSPORT_UDP
+    UdpTransport udp_transport;
+#endif
+    RPCTransport &transport; // the one the session runs on
     ESP32RPC rpc;
+    StateUpdateQueue states;
+    OutboundQueue outbound;
+
+    // What the connect step learned about the connection it handed over
+    struct LinkInfo {
+      unsigned long association_ms = 0; // WiFi.begin() to connected
+      int session_uuid = -1; // UUID in the client id, -1 before one is assigned
+    };
+
+    // Idle, WiFiConnecting, MQTTConnecting and Backoff belong to the connect
+    // step (the link task, if any); Handshake and Ready to loop(). Each side
+    // only acts on its own states, and storing the next state hands over:
+    // setState() stores with release and both sides load with acquire, so
+    // whatever one side wrote before the store is visible to the other.
+    std::atomic<LinkState> state{LinkState::Idle};
+    TaskHandle_t link_task = nullptr;
+    unsigned long state_since = 0;
+    unsigned long backoff_ms = 0;
+    std::atomic<uint8_t> attempts{0}; // failed attempts in a row; loop() clears it on Ready
+    // Connect step only
+    unsigned long wifi_started = 0;
+    bool wifi_directed = false; // current attempt uses the cached AP and address
+    LinkInfo connecting;
+    // loop() only: copied from connecting once Handshake is handed over
+    LinkInfo live;
 
     bool initSPIFFS();
-    bool connectWiFi();
-    bool connectMQTT();
+    void startWiFi();
+    void applyAddress(); // static, cached or DHCP address for the next WiFi.begin()
+    void rememberAP();
+    static void forgetAP();
+    bool connectTransport();
+    void reconnectPersistent();
+    void setState(LinkState s);
+    void scheduleRetry();
+    void advanceConnect(); // WiFi and MQTT connect, may block for the socket timeout
+    void advanceSession(); // handshake and link supervision
+    static void linkTask(void* arg);
+    static bool replayRecord(const char* method, JsonVariantConst params, void* ctx);
 };
@@ -0,0 +1,55 @@
+#pragma once
+#include <Arduino.h>
+
+// What ESP32RPC needs from the network: topic-addressed messages in both
+// directions. Connection management (when to connect, backoff) stays with
+// the caller; a transport only performs single attempts.
+class RPCTransport {
+public:
+    typedef void (*Receiver)(const char* topic, const uint8_t* payload, size_t length, void* ctx);
+
+    virtual ~RPCTransport() = default;
+    virtual const char* name() const = 0;
+
+    // One attempt, may block briefly. A persistent connect asks the peer to
+    // keep the client's subscriptions, and its QoS 1 messages, while it is away.
+    virtual bool connect(const char* client_id, bool persistent = false) = 0;
+    virtual void disconnect() = 0;
+    virtual bool connected() = 0;
+    virtual void loop() = 0; // receives, and delivers to the receiver from this call only
+
+    virtual bool subscribe(const char* filter, uint8_t qos = 0) = 0; // qos 1: at least once
+    virtual bool unsubscribe(const char* filter) = 0;
+
+    // A message whose length is known up front, written in pieces; false from
+    // beginMessage means nothing was sent (not connected, too large, or the
+    // transport's send window is full).
+    virtual bool beginMessage(const char* topic, size_t length) = 0;
+    // The same for a message a user is waiting on. A transport with a send
+    // window keeps part of it for these, so bulk traffic that fills the
+    // window never holds up a user action.
+    virtual bool beginUrgentMessage(const char* topic, size_t length) { return beginMessage(topic, length); }
+    virtual size_t write(const uint8_t* data, size_t length) = 0;
+    virtual bool endMessage() = 0;
+
+    // Largest payload one message can carry in either direction, on a topic
+    // of up to TopicRouter::MAX_TOPIC_LEN. Anything longer is refused.
+    virtual size_t maxMessageSize() = 0;
+
+    bool publish(const char* topic, const uint8_t* payload, size_t length) {
+        if (!beginMessage(topic, length)) return false;
+        write(payload, length);
+        return endMessage();
+    }
+
+    void setReceiver(Receiver r, void* ctx) { receiver = r; receiver_ctx = ctx; }
+
+protected:
+    void deliver(const char* topic, const uint8_t* payload, size_t length) {
+        if (receiver) receiver(topic, payload, length, receiver_ctx);
+    }
+
+private:
+    Receiver receiver = nullptr;
+    void* receiver_ctx = nullptr;
+};
@@ -0,0 +1,114 @@
+#include "StateUpdateQueue.hpp"
+#include "RPCSystem.hpp"
+#include "OutboundQueue.hpp"
+
+StateUpdateQueue::StateUpdateQueue(ESP32RPC &rpc, unsigned long flush_interval)
+  : rpc(rpc), flush_interval(flush_interval) {}
+
+StateUpdateQueue::Entry* StateUpdateQueue::find(const char* comp_id) {
+  for (size_t i = 0; i < MAX_COMPONENTS; i++) {
+    if (entries[i].used && strcmp(entries[i].comp_id, comp_id) == 0) return &entries[i];
+  }
+  return nullptr;
+}
+
+bool StateUpdateQueue::push(const char* comp_id, JsonVariantConst state) {
+  size_t len = strlen(comp_id);
+  if (len == 0 || len >= MAX_COMP_ID_LEN) return false;
+
+  Entry* e = find(comp_id);
+  if (!e) {
+    for (size_t i = 0; i < MAX_COMPONENTS && !e; i++) {
+      if (!entries[i].used) e = &entries[i];
+    }
+    if (!e) {
+      Serial.println("State update queue full");
+      return false;
+    }
+    memcpy(e->comp_id, comp_id, len + 1);
+    e->used = true;
+    e->version = e->sent_version = e->acked_version = 0;
+    e->inflight = 0;
+    e->retrying = false;
+    e->last_sent = millis() - flush_interval; // first update goes out right away
+  } else if (e->version != e->sent_version) {
+    coalesced++;
+  }
+
+  e->state.set(state);
+  e->version++;
+  pushed++;
+  return true;
+}
+
+void StateUpdateQueue::loop() {
+  unsigned long now = millis();
+  for (size_t i = 0; i < MAX_COMPONENTS; i++) {
+    Entry &e = entries[i];
+    if (!e.used || e.inflight) continue;
+    if (e.acked_version == e.version) {
+      // Server is up to date, free the slot
+      e.used = false;
+      e.state.clear();
+      continue;
+    }
+    unsigned long wait = e.retrying ? rpc.timeoutFor(fnv1a("update_state")) : flush_interval;
+    if (now - e.last_sent < wait) continue;
+    send(e);
+  }
+}
+
+void StateUpdateQueue::send(Entry &e) {
+  JsonDocument params;
+  params["comp_id"] = e.comp_id;
+  params["state"] = e.state;
+
+  uint32_t v = e.version;
+  // user actions go ahead of bulk traffic
+  ESP32RPC::CallHandle h = rpc.callAsync("update_state", params.as<JsonVariantConst>(), &StateUpdateQueue::onUpdateReply, &e,
+                                         0, ESP32RPC::Priority::Interactive);
+  if (!h) return; // lane full, retry on a later loop
+
+  if (e.sent_version == v) resent++;
+  e.inflight = h;
+  e.sent_version = v;
+  e.last_sent = millis();
+  sent++;
+}
+
+// sent_version stays put while a call is in flight, so it is the version this reply confirms
+void StateUpdateQueue::onUpdateReply(bool ok, JsonVariantConst, void* ctx) {
+  Entry* ep = (Entry*)ctx;
+  ep->inflight = 0;
+  ep->retrying = !ok;
+  if (ok && ep->sent_version > ep->acked_version) ep->acked_version = ep->sent_version;
+  else if (!ok) {
+    ep->last_sent = millis(); // the retry wait starts now, not when the call went out
+    Serial.println("update_state failed, will resend");
+  }
+}
+
+size_t StateUpdateQueue::drainTo(OutboundQueue &q) {
+  size_t n = 0;
+  for (size_t i = 0; i < MAX_COMPONENTS; i++) {
+    Entry &e = entries[i];
+    if (!e.used || e.inflight || e.acked_version == e.version) continue;
+
+    JsonDocument params;
+    params["comp_id"] = e.comp_id;
+    params["state"] = e.state;
+    if (!q.push("update_state", params.as<JsonVariantConst>(), e.comp_id)) continue;
+    e.used = false;
+    e.state.clear();
+    n++;
+  }
+  return n;
+}
+
+size_t StateUpdateQueue::pendingCount() const {
+  size_t n = 0;
+  for (size_t i = 0; i < MAX_COMPONENTS; i++) {
+    if (entries[i].used && entries[i].acked_version != entries[i].version) n++;
+  }
+  return n;
+}
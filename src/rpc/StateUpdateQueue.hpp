@@ -0,0 +1,62 @@
+#pragma once
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+class ESP32RPC;
+class OutboundQueue;
+
+// Outbound update_state calls, newest state wins per component. An update is
+// sent once the previous one for that component has been acknowledged and
+// flush_interval has passed, so rapid taps collapse into a few calls; an
+// update that fails or times out is sent again after the method's current
+// RPC timeout, so retries slow down along with the server.
+class StateUpdateQueue {
+public:
+    static const size_t MAX_COMPONENTS = 16;
+    static const size_t MAX_COMP_ID_LEN = 48; // including the terminator
+
+    explicit StateUpdateQueue(ESP32RPC &rpc, unsigned long flush_interval = 50);
+
+    // Returns false when every slot holds another component's unacknowledged state.
+    bool push(const char* comp_id, JsonVariantConst state);
+    void loop();
+
+    // Moves every unacknowledged state not currently in flight into q as an
+    // update_state record keyed by comp_id, freeing its slot.
+    size_t drainTo(OutboundQueue &q);
+
+    void setFlushInterval(unsigned long ms) { flush_interval = ms; }
+    size_t pendingCount() const;
+
+    // counters since boot
+    uint32_t pushedCount() const { return pushed; }       // push() calls
+    uint32_t sentCount() const { return sent; }           // update_state calls issued
+    uint32_t coalescedCount() const { return coalesced; } // states replaced before being sent
+    uint32_t resentCount() const { return resent; }       // retries after a failed call
+
+private:
+    struct Entry {
+      char comp_id[MAX_COMP_ID_LEN] = "";
+      bool used = false;
+      JsonDocument state;
+      uint32_t version = 0;       // bumped by every push()
+      uint32_t sent_version = 0;  // version carried by the last call
+      uint32_t acked_version = 0; // version the server has confirmed
+      uint32_t inflight = 0;      // ESP32RPC::CallHandle of the call awaiting a reply
+      unsigned long last_sent = 0;
+      bool retrying = false;      // last call failed, wait a full RTO before resending
+    };
+
+    ESP32RPC &rpc;
+    unsigned long flush_interval;
+    Entry entries[MAX_COMPONENTS];
+
+    uint32_t pushed = 0;
+    uint32_t sent = 0;
+    uint32_t coalesced = 0;
+    uint32_t resent = 0;
+
+    Entry* find(const char* comp_id);
+    void send(Entry &e);
+    static void onUpdateReply(bool ok, JsonVariantConst result, void* ctx);
+};
@@ -0,0 +1,282 @@
+#include "TlsClient.hpp"
+#include "RPCHash.hpp"
+#include <mbedtls/platform.h>
+#include <algorithm>
+
+// mbedtls 3 hides the session's fields behind MBEDTLS_PRIVATE; 2.x has no such macro
+#ifndef MBEDTLS_PRIVATE
+#define MBEDTLS_PRIVATE(member) member
+#endif
+
+// The last session, for one peer (FNV-1a of host, mixed with the port). Kept
+// in RTC memory so it survives deep sleep, but not a power cycle.
+struct TlsSessionCache {
+  uint32_t magic;
+  uint32_t peer;
+  uint16_t length;
+  uint8_t data[TlsClient::SESSION_CACHE_SIZE];
+};
+static const uint32_t TLS_CACHE_MAGIC = 0x544C5331; // "TLS1"
+RTC_DATA_ATTR static TlsSessionCache rtc_tls;
+// RTC slow memory is 8 KB, shared with the WiFi cache in RPCSystem.cpp and
+// whatever the core keeps there
+static_assert(sizeof(TlsSessionCache) <= 2048, "TLS session cache takes too much RTC memory");
+
+TlsClient::TlsClient() {
+  mbedtls_ssl_config_init(&conf);
+  mbedtls_entropy_init(&entropy);
+  mbedtls_ctr_drbg_init(&ctr_drbg);
+  mbedtls_x509_crt_init(&ca);
+}
+
+TlsClient::~TlsClient() {
+  stop();
+  mbedtls_x509_crt_free(&ca);
+  mbedtls_ctr_drbg_free(&ctr_drbg);
+  mbedtls_entropy_free(&entropy);
+  mbedtls_ssl_config_free(&conf);
+}
+
+bool TlsClient::setupConfig() {
+  if (configured) return true;
+  if (!ca_pem && !insecure) {
+    Serial.println("No MQTT CA certificate, refusing an unverified TLS connection");
+    return false;
+  }
+  static const char pers[] = "espdisplay";
+  if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const unsigned char*)pers, sizeof(pers) - 1) != 0 ||
+      mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+    Serial.println("TLS setup failed");
+    return false;
+  }
+  if (ca_pem) {
+    // PEM input must include the terminating NUL
+    if (mbedtls_x509_crt_parse(&ca, (const unsigned char*)ca_pem, strlen(ca_pem) + 1) != 0) {
+      Serial.println("Could not parse MQTT CA certificate");
+      return false;
+    }
+    mbedtls_ssl_conf_ca_chain(&conf, &ca, nullptr);
+    mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  } else {
+    Serial.println("TLS without a CA: the broker is not verified");
+    mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_NONE);
+  }
+  mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
+  mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+  configured = true;
+  return true;
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port) {
+  return connect(ip.toString().c_str(), port);
+}
+
+int TlsClient::connect(const char* host, uint16_t port) {
+  stop();
+  if (!setupConfig() || !sock.connect(host, port)) return 0;
+
+  unsigned long start = millis();
+  mbedtls_ssl_init(&ssl);
+  session_open = true;
+  if (mbedtls_ssl_setup(&ssl, &conf) != 0 || mbedtls_ssl_set_hostname(&ssl, host) != 0) {
+    stop();
+    return 0;
+  }
+  mbedtls_ssl_set_bio(&ssl, &sock, &TlsClient::bioSend, &TlsClient::bioRecv, nullptr);
+
+  uint32_t peer = fnv1a(host) ^ port;
+  resumption_offered = restoreSession(peer);
+
+  int ret;
+  while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
+    bool pending = ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE;
+    if (!pending || millis() - start > HANDSHAKE_TIMEOUT_MS) {
+      Serial.printf("TLS handshake failed (-0x%04x)\n", (unsigned)-ret);
+      // Brokers fall back to a full handshake on an unknown session, but a
+      // cached one that trips up the handshake must not fail every retry
+      if (resumption_offered) forgetSession();
+      stop();
+      return 0;
+    }
+    delay(1);
+  }
+  handshake_ms = millis() - start;
+  saveSession(peer);
+  return 1;
+}
+
+bool TlsClient::restoreSession(uint32_t peer) {
+  if (rtc_tls.magic != TLS_CACHE_MAGIC || rtc_tls.peer != peer) return false;
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  bool ok = mbedtls_ssl_session_load(&session, rtc_tls.data, rtc_tls.length) == 0 &&
+            mbedtls_ssl_set_session(&ssl, &session) == 0;
+  mbedtls_ssl_session_free(&session);
+  if (!ok) forgetSession(); // written by a different build, or corrupted
+  return ok;
+}
+
+// The ESP32's mbedtls keeps the peer certificate in the session
+// (MBEDTLS_SSL_KEEP_PEER_CERTIFICATE), and serializes it along with it: a
+// broker's leaf certificate is 1-2 KB, the rest of a session a few hundred
+// bytes with the ticket.
+static void dropPeerCert(mbedtls_ssl_session &session) {
+#if defined(MBEDTLS_SSL_KEEP_PEER_CERTIFICATE)
+  mbedtls_x509_crt* &cert = session.MBEDTLS_PRIVATE(peer_cert);
+  if (!cert) return;
+  mbedtls_x509_crt_free(cert);
+  mbedtls_free(cert);
+  cert = nullptr;
+#endif
+}
+
+// Called after every handshake: a resumed one may come with a fresh ticket.
+void TlsClient::saveSession(uint32_t peer) {
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  size_t len = 0;
+  rtc_tls.magic = 0; // invalid while the buffer is being rewritten
+  if (mbedtls_ssl_get_session(&ssl, &session) == 0) {
+    dropPeerCert(session);
+    int ret = mbedtls_ssl_session_save(&session, rtc_tls.data, sizeof(rtc_tls.data), &len);
+    if (ret == 0) {
+      rtc_tls.peer = peer;
+      rtc_tls.length = (uint16_t)len;
+      rtc_tls.magic = TLS_CACHE_MAGIC;
+    } else if (ret == MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL) {
+      // len is the size it needed; every wake will do a full handshake
+      Serial.printf("TLS session needs %u bytes, SESSION_CACHE_SIZE is %u: not kept\n", (unsigned)len,
+                    (unsigned)SESSION_CACHE_SIZE);
+    } else {
+      Serial.printf("TLS session not kept (-0x%04x)\n", (unsigned)-ret);
+    }
+  }
+  mbedtls_ssl_session_free(&session);
+}
+
+void TlsClient::forgetSession() {
+  rtc_tls.magic = 0;
+}
+
+void TlsClient::stop() {
+  if (session_open) {
+    if (sock.connected()) mbedtls_ssl_close_notify(&ssl);
+    mbedtls_ssl_free(&ssl);
+    session_open = false;
+  }
+  sock.stop();
+  peeked = -1;
+}
+
+uint8_t TlsClient::connected() {
+  return session_open && sock.connected();
+}
+
+size_t TlsClient::write(const uint8_t* buf, size_t size) {
+  if (!session_open) return 0;
+  size_t written = 0;
+  unsigned long start = millis();
+  while (written < size) {
+    int ret = mbedtls_ssl_write(&ssl, buf + written, size - written);
+    if (ret > 0) {
+      written += ret;
+    } else if ((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) ||
+               millis() - start > WRITE_TIMEOUT_MS) {
+      break;
+    } else {
+      delay(1); // the socket buffer is full: let the WiFi task drain it
+    }
+  }
+  return written;
+}
+
+int TlsClient::available() {
+  if (!session_open) return 0;
+  // A zero-length read processes whatever records have arrived on the socket
+  int ret = mbedtls_ssl_read(&ssl, nullptr, 0);
+  if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_SSL_CONN_EOF) {
+    stop();
+    return 0;
+  }
+  return (peeked >= 0 ? 1 : 0) + (int)mbedtls_ssl_get_bytes_avail(&ssl);
+}
+
+int TlsClient::read() {
+  uint8_t b;
+  return read(&b, 1) == 1 ? b : -1;
+}
+
+int TlsClient::read(uint8_t* buf, size_t size) {
+  if (!session_open || size == 0) return -1;
+  int n = 0;
+  if (peeked >= 0) {
+    buf[n++] = (uint8_t)peeked;
+    peeked = -1;
+    if (size == 1) return 1;
+  }
+  int ret = mbedtls_ssl_read(&ssl, buf + n, size - n);
+  if (ret > 0) return n + ret;
+  if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_SSL_CONN_EOF || ret == 0) stop();
+  return n > 0 ? n : -1;
+}
+
+int TlsClient::peek() {
+  if (peeked < 0 && session_open) {
+    uint8_t b;
+    if (mbedtls_ssl_read(&ssl, &b, 1) == 1) peeked = b;
+  }
+  return peeked;
+}
+
+int TlsClient::bioSend(void* ctx, const unsigned char* buf, size_t len) {
+  WiFiClient* sock = (WiFiClient*)ctx;
+  if (!sock->connected()) return MBEDTLS_ERR_SSL_CONN_EOF;
+  size_t n = sock->write(buf, len);
+  return n > 0 ? (int)n : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+int TlsClient::bioRecv(void* ctx, unsigned char* buf, size_t len) {
+  WiFiClient* sock = (WiFiClient*)ctx;
+  if (sock->available() <= 0) return sock->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_SSL_CONN_EOF;
+  int n = sock->read(buf, len);
+  return n > 0 ? n : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+static unsigned long median(unsigned long* v, size_t n) {
+  std::sort(v, v + n);
+  return v[n / 2];
+}
+
+void TlsClient::benchmark(const char* host, uint16_t port, const char* ca_pem, bool insecure, size_t rounds) {
+  if (rounds > MAX_BENCH_ROUNDS) rounds = MAX_BENCH_ROUNDS;
+  unsigned long full[MAX_BENCH_ROUNDS], resumed[MAX_BENCH_ROUNDS];
+  size_t n_full = 0, n_resumed = 0;
+
+  TlsClient* c = new TlsClient(); // its mbedtls contexts are too large for the link task stack
+  c->setCACert(ca_pem);
+  if (insecure) c->setInsecure();
+  Serial.printf("[bench] %u TLS handshake pairs with %s:%u\n", (unsigned)rounds, host, port);
+  for (size_t i = 0; i < rounds; i++) {
+    forgetSession();
+    if (c->connect(host, port)) full[n_full++] = c->handshakeMs();
+    c->stop();
+    if (c->connect(host, port) && c->resumptionOffered()) resumed[n_resumed++] = c->handshakeMs();
+    c->stop();
+  }
+  delete c;
+  if (n_full == 0) {
+    Serial.println("[bench] TLS: no handshake completed");
+    return;
+  }
+  unsigned long full_ms = median(full, n_full);
+  Serial.printf("[bench] TLS full handshake: n=%u median %lu ms  max %lu ms\n",
+                (unsigned)n_full, full_ms, full[n_full - 1]);
+  if (n_resumed == 0) {
+    Serial.println("[bench] TLS: the broker issued no session to resume");
+    return;
+  }
+  // Whether the broker actually accepted the session shows in the time
+  unsigned long resumed_ms = median(resumed, n_resumed);
+  Serial.printf("[bench] TLS resumption offered: n=%u median %lu ms  max %lu ms\n",
+                (unsigned)n_resumed, resumed_ms, resumed[n_resumed - 1]);
+}
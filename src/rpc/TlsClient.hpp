@@ -0,0 +1,78 @@
+#pragma once
+#include <Arduino.h>
+#include <WiFi.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+
+// TLS over a WiFiClient, for PubSubClient to run MQTT on port 8883.
+//
+// A full handshake costs several hundred milliseconds of public-key math on
+// the ESP32, on every wake. The session the broker hands out (ticket or id)
+// is therefore kept in RTC memory, which survives deep sleep, and offered on
+// the next connect to the same host and port. If the broker accepts it, the
+// handshake is one round trip of symmetric crypto; if not, it quietly falls
+// back to a full one. The broker's certificate is left out of the kept
+// session: it was verified in the full handshake and is not sent again on
+// resumption, and it would be most of the session's size.
+class TlsClient : public Client {
+public:
+    TlsClient();
+    ~TlsClient();
+
+    // PEM of the CA that signed the broker certificate. Without one, connect
+    // fails unless setInsecure() was called, which accepts any broker: the
+    // connection is then encrypted but open to a man in the middle.
+    void setCACert(const char* pem) { ca_pem = pem; }
+    void setInsecure() { insecure = true; }
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char* host, uint16_t port) override;
+    size_t write(uint8_t b) override { return write(&b, 1); }
+    size_t write(const uint8_t* buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t* buf, size_t size) override;
+    int peek() override;
+    void flush() override {}
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override { return connected(); }
+
+    unsigned long handshakeMs() const { return handshake_ms; } // last successful connect
+    bool resumptionOffered() const { return resumption_offered; } // a cached session was sent
+    static void forgetSession();
+
+    // Times rounds full handshakes, each followed by a resumed one, against
+    // host:port and prints both medians. Blocking; diagnostics only.
+    static void benchmark(const char* host, uint16_t port, const char* ca_pem, bool insecure, size_t rounds);
+
+    static const size_t SESSION_CACHE_SIZE = 1024; // serialized session without the certificate, RTC memory
+    static const unsigned long HANDSHAKE_TIMEOUT_MS = 8000;
+    static const unsigned long WRITE_TIMEOUT_MS = 5000;
+    static const size_t MAX_BENCH_ROUNDS = 16;
+
+private:
+    WiFiClient sock;
+    const char* ca_pem = nullptr;
+    bool insecure = false;
+
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_x509_crt ca;
+    bool configured = false; // conf, rng and CA chain are set up once per client
+    bool session_open = false; // ssl is initialized
+    int peeked = -1;
+
+    unsigned long handshake_ms = 0;
+    bool resumption_offered = false;
+
+    bool setupConfig();
+    bool restoreSession(uint32_t peer);
+    void saveSession(uint32_t peer);
+    static int bioSend(void* ctx, const unsigned char* buf, size_t len);
+    static int bioRecv(void* ctx, unsigned char* buf, size_t len);
+};
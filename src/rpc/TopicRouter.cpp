@@ -0,0 +1,99 @@
+#include "TopicRouter.hpp"
+
+static bool isWildcard(const char* filter) {
+  return strchr(filter, '+') || strchr(filter, '#');
+}
+
+size_t TopicRouter::lowerBound(uint32_t hash) const {
+  size_t lo = 0, hi = exact_count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (routes[mid].hash < hash) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+int TopicRouter::find(const char* filter, uint32_t hash, bool wildcard) const {
+  size_t i = wildcard ? exact_count : lowerBound(hash);
+  size_t end = wildcard ? count : exact_count;
+  for (; i < end; i++) {
+    if (!wildcard && routes[i].hash != hash) break;
+    if (strcmp(routes[i].filter, filter) == 0) return (int)i;
+  }
+  return -1;
+}
+
+bool TopicRouter::add(const char* filter, Handler handler, void* ctx) {
+  size_t len = strlen(filter);
+  if (!handler || len == 0 || len >= MAX_TOPIC_LEN) return false;
+
+  bool wildcard = isWildcard(filter);
+  uint32_t hash = fnv1a_n(filter, len);
+  int existing = find(filter, hash, wildcard);
+  if (existing >= 0) {
+    routes[existing].handler = handler;
+    routes[existing].ctx = ctx;
+    return true;
+  }
+  if (count >= MAX_ROUTES) {
+    Serial.println("Topic router full");
+    return false;
+  }
+
+  size_t pos = wildcard ? count : lowerBound(hash);
+  memmove(&routes[pos + 1], &routes[pos], (count - pos) * sizeof(Route));
+  Route &r = routes[pos];
+  memcpy(r.filter, filter, len + 1);
+  r.hash = hash;
+  r.handler = handler;
+  r.ctx = ctx;
+  count++;
+  if (!wildcard) exact_count++;
+  return true;
+}
+
+bool TopicRouter::remove(const char* filter) {
+  bool wildcard = isWildcard(filter);
+  int i = find(filter, fnv1a_n(filter, strlen(filter)), wildcard);
+  if (i < 0) return false;
+  memmove(&routes[i], &routes[i + 1], (count - i - 1) * sizeof(Route));
+  count--;
+  if (!wildcard) exact_count--;
+  return true;
+}
+
+size_t TopicRouter::route(const char* topic, const uint8_t* payload, size_t length) const {
+  size_t ran = 0;
+  uint32_t hash = fnv1a_n(topic, strlen(topic));
+  for (size_t i = lowerBound(hash); i < exact_count && routes[i].hash == hash; i++) {
+    if (strcmp(routes[i].filter, topic) != 0) continue;
+    routes[i].handler(topic, payload, length, routes[i].ctx);
+    ran++;
+  }
+  for (size_t i = exact_count; i < count; i++) {
+    if (!matches(routes[i].filter, topic)) continue;
+    routes[i].handler(topic, payload, length, routes[i].ctx);
+    ran++;
+  }
+  return ran;
+}
+
+bool TopicRouter::matches(const char* filter, const char* topic) {
+  const char* f = filter;
+  const char* t = topic;
+  while (*f) {
+    if (*f == '#') return true;
+    if (*f == '+') {
+      while (*t && *t != '/') t++;
+      f++;
+      continue;
+    }
+    // "a/#" also matches its parent level "a"
+    if (*t == 0) return f[0] == '/' && f[1] == '#' && f[2] == 0;
+    if (*f != *t) return false;
+    f++;
+    t++;
+  }
+  return *t == 0;
+}
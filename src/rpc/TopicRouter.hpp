@@ -0,0 +1,42 @@
+#pragma once
+#include <Arduino.h>
+#include "RPCHash.hpp"
+
+// Maps MQTT topics to handlers without allocating. Exact filters are kept
+// sorted by hash and found with a binary search, so many per-entity topics
+// stay cheap; filters containing + or # are matched level by level.
+class TopicRouter {
+public:
+    typedef void (*Handler)(const char* topic, const uint8_t* payload, size_t length, void* ctx);
+
+    static const size_t MAX_ROUTES = 48;
+    static const size_t MAX_TOPIC_LEN = 64; // including the terminator
+
+    // Adding an existing filter replaces its handler.
+    bool add(const char* filter, Handler handler, void* ctx = nullptr);
+    bool remove(const char* filter);
+
+    // Runs every handler whose filter matches topic and returns how many ran.
+    size_t route(const char* topic, const uint8_t* payload, size_t length) const;
+
+    size_t size() const { return count; }
+    const char* filterAt(size_t i) const { return routes[i].filter; }
+
+    // MQTT filter semantics: + matches one level, a trailing # the rest.
+    static bool matches(const char* filter, const char* topic);
+
+private:
+    struct Route {
+      char filter[MAX_TOPIC_LEN];
+      uint32_t hash;
+      Handler handler;
+      void* ctx;
+    };
+    // [0, exact_count) holds exact filters sorted by hash, wildcards follow.
+    Route routes[MAX_ROUTES];
+    size_t count = 0;
+    size_t exact_count = 0;
+
+    size_t lowerBound(uint32_t hash) const;
+    int find(const char* filter, uint32_t hash, bool wildcard) const;
+};
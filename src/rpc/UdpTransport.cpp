@@ -0,0 +1,241 @@
+#include "UdpTransport.hpp"
+
+static void putSeq(uint8_t* p, uint32_t seq) {
+  for (int i = 0; i < 4; i++) p[i] = (seq >> (8 * i)) & 0xff;
+}
+
+static uint32_t getSeq(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+UdpTransport::UdpTransport(const char* host, uint16_t port, uint16_t local_port)
+  : host(host), port(port), local_port(local_port ? local_port : port) {}
+
+bool UdpTransport::connect(const char* client_id, bool persistent) {
+  (void)persistent;
+  disconnect();
+  if (!udp.begin(local_port)) return false;
+  next_seq = esp_random(); // a fresh range, so the gateway never mistakes new datagrams for old ones
+  rx_started = false;
+
+  // HELLO is the one datagram waited for here; anything else that arrives
+  // meanwhile is dropped, and the gateway sends it again after the ack
+  Slot* hello = openSlot(HELLO, client_id, 0);
+  if (!hello) return false;
+  uint32_t seq = hello->seq;
+  transmit(*hello);
+
+  unsigned long start = millis();
+  while (millis() - start < CONNECT_TIMEOUT_MS) {
+    int len = udp.parsePacket();
+    if (len >= (int)HEADER) {
+      size_t n = udp.read(rx_buf, sizeof(rx_buf));
+      if (n >= HEADER && rx_buf[0] == ACK && getSeq(rx_buf + 1) == seq) {
+        acked(seq);
+        is_connected = true;
+        return true;
+      }
+    }
+    retransmit();
+    delay(1);
+  }
+  disconnect();
+  return false;
+}
+
+void UdpTransport::disconnect() {
+  is_connected = false;
+  building = nullptr;
+  control_count = 0; // the next connect subscribes everything again
+  for (size_t i = 0; i < WINDOW; i++) window[i].used = false;
+  udp.stop();
+}
+
+// Takes a free slot unless that would leave fewer than keep_free of them.
+UdpTransport::Slot* UdpTransport::openSlot(Type type, const char* topic, size_t payload_len, size_t keep_free) {
+  size_t topic_len = strlen(topic);
+  if (HEADER + topic_len + 1 + payload_len > MAX_DATAGRAM) return nullptr;
+  size_t free_slots = 0;
+  for (size_t i = 0; i < WINDOW; i++) free_slots += !window[i].used;
+  if (free_slots <= keep_free) return nullptr;
+  for (size_t i = 0; i < WINDOW; i++) {
+    Slot &s = window[i];
+    if (s.used) continue;
+    s.used = true;
+    s.tries = 0;
+    s.seq = next_seq++;
+    s.data[0] = type;
+    putSeq(s.data + 1, s.seq);
+    memcpy(s.data + HEADER, topic, topic_len + 1);
+    s.len = HEADER + topic_len + 1;
+    return &s;
+  }
+  return nullptr; // window full: the caller retries later
+}
+
+void UdpTransport::transmit(Slot &s) {
+  udp.beginPacket(host, port);
+  udp.write(s.data, s.len);
+  udp.endPacket();
+  s.sent_at = millis();
+  s.tries++;
+}
+
+bool UdpTransport::sendControl(Type type, const char* topic) {
+  if (!is_connected) return false;
+  Slot* s = openSlot(type, topic, 0);
+  if (!s) return false;
+  transmit(*s);
+  return true;
+}
+
+// Sent at once when the window has room and nothing is queued ahead of it.
+// A queued SUB or UNSUB for the same filter is replaced: only the last one
+// decides what the gateway ends up with.
+bool UdpTransport::queueControl(Type type, const char* filter) {
+  if (!is_connected || strlen(filter) >= TopicRouter::MAX_TOPIC_LEN) return false;
+  if (control_count == 0 && sendControl(type, filter)) return true;
+  for (size_t i = 0; i < control_count; i++) {
+    if (strcmp(controls[i].filter, filter) != 0) continue;
+    controls[i].type = type;
+    return true;
+  }
+  if (control_count == MAX_CONTROLS) return false;
+  Control &c = controls[control_count++];
+  c.type = type;
+  strcpy(c.filter, filter);
+  return true;
+}
+
+void UdpTransport::flushControls() {
+  size_t sent = 0;
+  while (sent < control_count && !building && sendControl(controls[sent].type, controls[sent].filter)) sent++;
+  if (sent == 0) return;
+  memmove(controls, controls + sent, (control_count - sent) * sizeof(Control));
+  control_count -= sent;
+}
+
+bool UdpTransport::beginData(const char* topic, size_t length, size_t keep_free) {
+  if (!is_connected || building) return false;
+  flushControls(); // subscriptions first, or the replies they are for may be missed
+  building = openSlot(DATA, topic, length, keep_free);
+  return building != nullptr;
+}
+
+size_t UdpTransport::write(const uint8_t* data, size_t length) {
+  if (!building || building->len + length > MAX_DATAGRAM) return 0;
+  memcpy(building->data + building->len, data, length);
+  building->len += length;
+  return length;
+}
+
+bool UdpTransport::endMessage() {
+  if (!building) return false;
+  transmit(*building);
+  building = nullptr;
+  return true;
+}
+
+void UdpTransport::sendAck(uint32_t seq) {
+  uint8_t ack[HEADER];
+  ack[0] = ACK;
+  putSeq(ack + 1, seq);
+  udp.beginPacket(host, port);
+  udp.write(ack, sizeof(ack));
+  udp.endPacket();
+}
+
+bool UdpTransport::acked(uint32_t seq) {
+  for (size_t i = 0; i < WINDOW; i++) {
+    if (window[i].used && window[i].seq == seq && &window[i] != building) {
+      window[i].used = false;
+      return true;
+    }
+  }
+  return false;
+}
+
+void UdpTransport::restartWindow(uint32_t seq) {
+  rx_started = true;
+  rx_high = seq;
+  rx_seen = 0;
+}
+
+bool UdpTransport::firstSight(uint32_t seq) {
+  if (!rx_started) {
+    restartWindow(seq);
+    return true;
+  }
+  int32_t ahead = (int32_t)(seq - rx_high);
+  if (ahead > 0) {
+    if (ahead > 32) rx_seen = 0;
+    else rx_seen = (ahead == 32 ? 0 : rx_seen << ahead) | (1u << (ahead - 1));
+    rx_high = seq;
+    return true;
+  }
+  if (ahead == 0) return false;
+  uint32_t back = rx_high - seq - 1;
+  if (back >= RESYNC_DISTANCE) {
+    // Nothing in flight is that old: the gateway restarted with a new range
+    Serial.println("UDP gateway restarted, resyncing");
+    resyncs++;
+    restartWindow(seq);
+    return true;
+  }
+  if (back >= 32) return false; // too old to tell, treat as a duplicate
+  if (rx_seen & (1u << back)) return false;
+  rx_seen |= 1u << back;
+  return true;
+}
+
+void UdpTransport::handlePacket(size_t len) {
+  if (len < HEADER) return;
+  uint8_t type = rx_buf[0];
+  uint32_t seq = getSeq(rx_buf + 1);
+
+  if (type == ACK) {
+    acked(seq);
+    return;
+  }
+  if (type != DATA) return;
+
+  // Acked even when already seen: the earlier ack may have been the one lost
+  sendAck(seq);
+  if (!firstSight(seq)) {
+    duplicates++;
+    return;
+  }
+  const char* topic = (const char*)rx_buf + HEADER;
+  size_t topic_len = strnlen(topic, len - HEADER);
+  if (HEADER + topic_len >= len) return; // no terminator
+  const uint8_t* payload = rx_buf + HEADER + topic_len + 1;
+  deliver(topic, payload, len - HEADER - topic_len - 1);
+}
+
+void UdpTransport::retransmit() {
+  unsigned long now = millis();
+  for (size_t i = 0; i < WINDOW; i++) {
+    Slot &s = window[i];
+    if (!s.used || &s == building) continue;
+    if (now - s.sent_at < (RETRANSMIT_MS << (s.tries - 1))) continue;
+    if (s.tries >= MAX_TRIES) {
+      Serial.println("UDP peer not answering");
+      is_connected = false;
+      s.used = false;
+      continue;
+    }
+    retransmits++;
+    transmit(s);
+  }
+}
+
+void UdpTransport::loop() {
+  if (!is_connected) return;
+  int len;
+  while ((len = udp.parsePacket()) > 0) {
+    size_t n = udp.read(rx_buf, sizeof(rx_buf));
+    handlePacket(n);
+  }
+  retransmit();
+  flushControls();
+}
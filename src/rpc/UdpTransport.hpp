@@ -0,0 +1,107 @@
+#pragma once
+#include <WiFiUdp.h>
+#include "RPCTransport.hpp"
+#include "TopicRouter.hpp"
+
+// RPCTransport over UDP datagrams to a gateway on the LAN, avoiding the TCP
+// and broker hops of MQTT. Every datagram is
+//
+//   type (1 byte) | seq (4 bytes, little endian) | topic | 0 | payload
+//
+// HELLO (topic = client id), SUB, UNSUB and DATA are acknowledged with an
+// ACK carrying the same seq and no topic. Unacknowledged datagrams are sent
+// again with a doubling interval; a peer that stays silent through every
+// retry drops the connection. Received seqs are remembered in a sliding
+// window so retransmitted duplicates are acknowledged but delivered once.
+// Each side starts its seqs at a random point when it (re)starts, as
+// connect() does here; a seq more than RESYNC_DISTANCE behind the newest one
+// cannot be a retransmit, so it is taken as a restarted gateway and starts
+// the window afresh instead of being dropped as a duplicate.
+// SUB and UNSUB that find the window full wait in a small queue of their own
+// and go out from loop() ahead of new DATA, since a session subscribes all of
+// its routes at once.
+class UdpTransport : public RPCTransport {
+public:
+    static const size_t MAX_DATAGRAM = 1400; // stays below a typical MTU
+    static const size_t WINDOW = 4;          // unacknowledged datagrams in flight
+    static const size_t URGENT_SLOTS = 1;    // of WINDOW, only for beginUrgentMessage
+    static const unsigned long RETRANSMIT_MS = 40;
+    static const uint8_t MAX_TRIES = 6;
+    static const unsigned long CONNECT_TIMEOUT_MS = 1000;
+    static const size_t MAX_CONTROLS = TopicRouter::MAX_ROUTES; // queued SUB and UNSUB
+    static const uint32_t RESYNC_DISTANCE = 1024; // far beyond the 32 seqs the window remembers
+
+    UdpTransport(const char* host, uint16_t port, uint16_t local_port = 0);
+
+    const char* name() const override { return "udp"; }
+    bool connect(const char* client_id, bool persistent = false) override; // the gateway keeps no sessions
+    void disconnect() override;
+    bool connected() override { return is_connected; }
+    void loop() override;
+
+    bool subscribe(const char* filter, uint8_t = 0) override { return queueControl(SUB, filter); } // every datagram is acked
+    bool unsubscribe(const char* filter) override { return queueControl(UNSUB, filter); }
+
+    bool beginMessage(const char* topic, size_t length) override { return beginData(topic, length, URGENT_SLOTS); }
+    bool beginUrgentMessage(const char* topic, size_t length) override { return beginData(topic, length, 0); }
+    size_t write(const uint8_t* data, size_t length) override;
+    bool endMessage() override;
+    size_t maxMessageSize() override { return MAX_DATAGRAM - HEADER - TopicRouter::MAX_TOPIC_LEN; }
+
+    // counters since boot
+    uint32_t retransmitCount() const { return retransmits; }
+    uint32_t duplicateCount() const { return duplicates; }
+    uint32_t resyncCount() const { return resyncs; } // gateway restarts seen
+
+private:
+    enum Type : uint8_t { HELLO = 1, ACK = 2, SUB = 3, UNSUB = 4, DATA = 5 };
+    static const size_t HEADER = 5;
+
+    struct Slot {
+      bool used = false;
+      uint8_t tries = 0;
+      uint32_t seq = 0;
+      size_t len = 0;
+      unsigned long sent_at = 0;
+      uint8_t data[MAX_DATAGRAM];
+    };
+
+    WiFiUDP udp;
+    const char* host;
+    uint16_t port;
+    uint16_t local_port;
+    bool is_connected = false;
+
+    struct Control {
+      Type type;
+      char filter[TopicRouter::MAX_TOPIC_LEN];
+    };
+
+    Slot window[WINDOW];
+    Slot* building = nullptr; // slot filled between beginMessage and endMessage
+    Control controls[MAX_CONTROLS]; // oldest first
+    size_t control_count = 0;
+    uint32_t next_seq = 0;
+
+    bool rx_started = false;
+    uint32_t rx_high = 0;  // highest seq received
+    uint32_t rx_seen = 0;  // bit i set: rx_high - 1 - i was received
+
+    uint8_t rx_buf[MAX_DATAGRAM];
+    uint32_t retransmits = 0;
+    uint32_t duplicates = 0;
+    uint32_t resyncs = 0;
+
+    Slot* openSlot(Type type, const char* topic, size_t payload_len, size_t keep_free = 0);
+    bool beginData(const char* topic, size_t length, size_t keep_free);
+    void transmit(Slot &s);
+    bool sendControl(Type type, const char* topic);
+    bool queueControl(Type type, const char* filter);
+    void flushControls();
+    void sendAck(uint32_t seq);
+    bool acked(uint32_t seq);     // frees the slot waiting for seq
+    bool firstSight(uint32_t seq); // false for a duplicate
+    void restartWindow(uint32_t seq);
+    void handlePacket(size_t len); // the datagram in rx_buf
+    void retransmit();
+};
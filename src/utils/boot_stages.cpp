@@ -0,0 +1,36 @@
+#include "boot_stages.h"
+#include <Arduino.h>
+
+static const char* const stage_names[BOOT_STAGE_COUNT] = {
+    "spiffs", "display", "rpc_start", "wifi", "mqtt", "session", "config", "first_screen"
+};
+
+// Aligned 32-bit stores are atomic on the ESP32, which is all the network
+// task and the main loop share here.
+static volatile unsigned long stage_ms[BOOT_STAGE_COUNT];
+
+void boot_mark(BootStage stage) {
+    if (stage >= BOOT_STAGE_COUNT || stage_ms[stage] != 0) return;
+    unsigned long now = millis();
+    stage_ms[stage] = now ? now : 1;
+    Serial.printf("[boot] %s at %lu ms\n", stage_names[stage], now);
+}
+
+unsigned long boot_stage_ms(BootStage stage) {
+    return stage < BOOT_STAGE_COUNT ? stage_ms[stage] : 0;
+}
+
+void boot_report() {
+    Serial.println("[boot] timeline:");
+    unsigned long prev = 0;
+    for (int i = 0; i < BOOT_STAGE_COUNT; i++) {
+        unsigned long t = stage_ms[i];
+        if (!t) {
+            Serial.printf("[boot]   %-12s -\n", stage_names[i]);
+            continue;
+        }
+        // stages overlap, so the delta is only to the previous stage reached
+        Serial.printf("[boot]   %-12s %6lu ms (+%lu)\n", stage_names[i], t, t > prev ? t - prev : 0);
+        if (t > prev) prev = t;
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef BOOT_STAGES_H
+#define BOOT_STAGES_H
+
+// Milestones of the boot sequence. Some are reached from the network task, so
+// stages are only ever marked once and never cleared.
+enum BootStage {
+    BOOT_SPIFFS,
+    BOOT_DISPLAY,     // LVGL up, splash drawn
+    BOOT_RPC_START,   // network task started
+    BOOT_WIFI,        // associated and got an IP
+    BOOT_MQTT,        // broker connection up
+    BOOT_SESSION,     // handshake done, RPC usable
+    BOOT_CONFIG,      // config known, from cache or server
+    BOOT_FIRST_SCREEN,
+    BOOT_STAGE_COUNT
+};
+
+// Records millis() for the stage the first time it is reached and logs it
+void boot_mark(BootStage stage);
+// 0 while the stage has not been reached
+unsigned long boot_stage_ms(BootStage stage);
+// Logs every stage reached so far in order
+void boot_report();
+
+#endif
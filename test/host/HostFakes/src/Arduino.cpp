@@ -0,0 +1,100 @@
+#include <Arduino.h>
+#include <WiFi.h>
+
+HostSerial Serial;
+WiFiClass WiFi;
+
+static bool serialEnabled() {
+  static int enabled = -1;
+  if (enabled < 0) enabled = getenv("HOST_SERIAL") != nullptr;
+  return enabled == 1;
+}
+
+size_t HostSerial::write(uint8_t c) {
+  if (serialEnabled()) fputc(c, stdout);
+  return 1;
+}
+
+size_t HostSerial::write(const uint8_t* buf, size_t n) {
+  if (serialEnabled()) fwrite(buf, 1, n, stdout);
+  return n;
+}
+
+// ---------------- clock ----------------
+
+// Starts away from zero so code that treats 0 as "never" behaves as on a
+// device that has been up for a while
+static uint64_t now_us = 1000000;
+
+uint64_t host::nowUs() {
+  return now_us;
+}
+
+void host::advanceUs(uint64_t us) {
+  now_us += us;
+}
+
+// xorshift32: the same sequence on every run
+static uint32_t rng_state = 0x2545f491;
+
+void host::seedRandom(uint32_t seed) {
+  rng_state = seed ? seed : 1;
+}
+
+uint32_t esp_random() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+// ---------------- WiFi ----------------
+
+static bool ap_available = true;
+
+void host::setWiFiAvailable(bool up) {
+  ap_available = up;
+}
+
+bool host::wifiUp() {
+  return ap_available && WiFi.started;
+}
+
+wl_status_t WiFiClass::begin(const char*, const char*, int32_t, const uint8_t*, bool) {
+  started = true;
+  begins++;
+  return status();
+}
+
+wl_status_t WiFiClass::status() {
+  if (!started) return WL_DISCONNECTED;
+  return ap_available ? WL_CONNECTED : WL_CONNECTION_LOST;
+}
+
+bool WiFiClass::disconnect(bool, bool) {
+  started = false;
+  return true;
+}
+
+bool WiFiClass::config(IPAddress, IPAddress, IPAddress, IPAddress, IPAddress) {
+  return true;
+}
+
+uint8_t* WiFiClass::BSSID() {
+  static uint8_t bssid[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+  return bssid;
+}
+
+uint8_t* WiFiClass::macAddress(uint8_t* mac) {
+  static const uint8_t own[6] = { 0x24, 0x6f, 0x28, 0x00, 0x00, 0x42 };
+  memcpy(mac, own, sizeof(own));
+  return mac;
+}
+
+String WiFiClass::macAddress() {
+  uint8_t m[6];
+  macAddress(m);
+  char buf[18];
+  snprintf(buf, sizeof(buf), "%02X:%02X:%02X:%02X:%02X:%02X", m[0], m[1], m[2], m[3], m[4], m[5]);
+  return String(buf);
+}
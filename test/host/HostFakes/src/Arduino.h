@@ -0,0 +1,270 @@
+#pragma once
+// Host stand-in for the parts of the ESP32 Arduino core that src/rpc uses.
+// Time only moves when a test advances it (or something calls delay()), so
+// deadlines, backoff and retransmits run the same way on every run.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <string>
+#include <algorithm>
+#include <functional>
+
+using std::min;
+using std::max;
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define F(x) x
+#define RTC_DATA_ATTR
+#define IRAM_ATTR
+
+// ---------------- String ----------------
+
+class String {
+public:
+    String(const char* s = "") : s(s ? s : "") {}
+    String(const String &o) = default;
+    String(String &&o) = default;
+    explicit String(char c) : s(1, c) {}
+    String(int v, unsigned char base = 10) : s(number((long long)v, base)) {}
+    String(unsigned int v, unsigned char base = 10) : s(number((unsigned long long)v, base)) {}
+    String(long v, unsigned char base = 10) : s(number((long long)v, base)) {}
+    String(unsigned long v, unsigned char base = 10) : s(number((unsigned long long)v, base)) {}
+    String(double v, unsigned int decimals = 2) { char b[48]; snprintf(b, sizeof(b), "%.*f", (int)decimals, v); s = b; }
+
+    String& operator=(const String &o) = default;
+    String& operator=(String &&o) = default;
+    String& operator=(const char* o) { s = o ? o : ""; return *this; }
+
+    const char* c_str() const { return s.c_str(); }
+    unsigned int length() const { return (unsigned int)s.size(); }
+    bool isEmpty() const { return s.empty(); }
+    bool reserve(unsigned int n) { s.reserve(n); return true; }
+    char operator[](unsigned int i) const { return i < s.size() ? s[i] : 0; }
+    char& operator[](unsigned int i) { return s[i]; }
+    char charAt(unsigned int i) const { return (*this)[i]; }
+
+    bool concat(const String &o) { s += o.s; return true; }
+    bool concat(const char* o) { if (!o) return false; s += o; return true; }
+    bool concat(const char* o, unsigned int n) { if (!o) return false; s.append(o, n); return true; }
+    bool concat(char c) { s += c; return true; }
+    bool concat(int v) { return concat(String(v)); }
+    bool concat(unsigned int v) { return concat(String(v)); }
+    bool concat(long v) { return concat(String(v)); }
+    bool concat(unsigned long v) { return concat(String(v)); }
+
+    template <typename T> String& operator+=(const T &v) { concat(v); return *this; }
+
+    bool equals(const String &o) const { return s == o.s; }
+    bool equals(const char* o) const { return s == (o ? o : ""); }
+    bool operator==(const String &o) const { return equals(o); }
+    bool operator==(const char* o) const { return equals(o); }
+    bool operator!=(const String &o) const { return !equals(o); }
+    bool operator!=(const char* o) const { return !equals(o); }
+    bool operator<(const String &o) const { return s < o.s; }
+
+    bool startsWith(const String &p) const { return s.compare(0, p.s.size(), p.s) == 0; }
+    bool endsWith(const String &p) const { return s.size() >= p.s.size() && s.compare(s.size() - p.s.size(), p.s.size(), p.s) == 0; }
+    int indexOf(char c, unsigned int from = 0) const { size_t i = s.find(c, from); return i == std::string::npos ? -1 : (int)i; }
+    int indexOf(const String &p, unsigned int from = 0) const { size_t i = s.find(p.s, from); return i == std::string::npos ? -1 : (int)i; }
+    int lastIndexOf(char c) const { size_t i = s.rfind(c); return i == std::string::npos ? -1 : (int)i; }
+    String substring(unsigned int from) const { return from < s.size() ? String(s.substr(from).c_str()) : String(); }
+    String substring(unsigned int from, unsigned int to) const {
+        if (from > to) std::swap(from, to);
+        if (from >= s.size()) return String();
+        return String(s.substr(from, to - from).c_str());
+    }
+    void replace(const String &from, const String &to) {
+        if (from.s.empty()) return;
+        for (size_t i = s.find(from.s); i != std::string::npos; i = s.find(from.s, i + to.s.size())) s.replace(i, from.s.size(), to.s);
+    }
+    void remove(unsigned int index, unsigned int count = (unsigned int)-1) { if (index < s.size()) s.erase(index, count); }
+    void trim() {
+        size_t b = s.find_first_not_of(" \t\r\n");
+        size_t e = s.find_last_not_of(" \t\r\n");
+        s = b == std::string::npos ? std::string() : s.substr(b, e - b + 1);
+    }
+    void toLowerCase() { for (char &c : s) c = (char)tolower((unsigned char)c); }
+    void toUpperCase() { for (char &c : s) c = (char)toupper((unsigned char)c); }
+    long toInt() const { return strtol(s.c_str(), nullptr, 10); }
+    float toFloat() const { return strtof(s.c_str(), nullptr); }
+
+private:
+    std::string s;
+
+    static std::string number(long long v, unsigned char base) {
+        if (v < 0) return "-" + number((unsigned long long)-v, base);
+        return number((unsigned long long)v, base);
+    }
+    static std::string number(unsigned long long v, unsigned char base) {
+        if (base < 2 || base > 36) base = 10;
+        std::string out;
+        do { out.insert(out.begin(), "0123456789abcdefghijklmnopqrstuvwxyz"[v % base]); v /= base; } while (v);
+        return out;
+    }
+};
+
+// ArduinoJson adapts this type as well as String
+class StringSumHelper : public String {
+public:
+    using String::String;
+    StringSumHelper(const String &s) : String(s) {}
+};
+
+inline StringSumHelper operator+(const String &a, const String &b) { StringSumHelper r(a); r.concat(b); return r; }
+inline StringSumHelper operator+(const String &a, const char* b) { StringSumHelper r(a); r.concat(b); return r; }
+inline StringSumHelper operator+(const char* a, const String &b) { StringSumHelper r(a); r.concat(b); return r; }
+inline StringSumHelper operator+(const String &a, char b) { StringSumHelper r(a); r.concat(b); return r; }
+inline StringSumHelper operator+(const String &a, int b) { StringSumHelper r(a); r.concat(b); return r; }
+inline StringSumHelper operator+(const String &a, unsigned int b) { StringSumHelper r(a); r.concat(b); return r; }
+inline StringSumHelper operator+(const String &a, long b) { StringSumHelper r(a); r.concat(b); return r; }
+inline StringSumHelper operator+(const String &a, unsigned long b) { StringSumHelper r(a); r.concat(b); return r; }
+inline bool operator==(const char* a, const String &b) { return b == a; }
+
+// ---------------- IPAddress ----------------
+
+class IPAddress {
+public:
+    IPAddress() : addr(0) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+      : addr((uint32_t)a | ((uint32_t)b << 8) | ((uint32_t)c << 16) | ((uint32_t)d << 24)) {}
+    IPAddress(uint32_t a) : addr(a) {}
+    operator uint32_t() const { return addr; }
+    uint8_t operator[](int i) const { return (addr >> (8 * i)) & 0xff; }
+    String toString() const {
+        char b[16];
+        snprintf(b, sizeof(b), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+        return String(b);
+    }
+    bool fromString(const char* s) {
+        unsigned a, b, c, d;
+        if (sscanf(s, "%u.%u.%u.%u", &a, &b, &c, &d) != 4) return false;
+        *this = IPAddress(a, b, c, d);
+        return true;
+    }
+
+private:
+    uint32_t addr;
+};
+
+// ---------------- Print and Stream ----------------
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buf, size_t n) {
+        size_t i = 0;
+        while (i < n && write(buf[i])) i++;
+        return i;
+    }
+    size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+    virtual void flush() {}
+
+    size_t print(const char* s) { return write(s); }
+    size_t print(const String &s) { return write((const uint8_t*)s.c_str(), s.length()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int v) { return print(String(v)); }
+    size_t print(unsigned int v) { return print(String(v)); }
+    size_t print(long v) { return print(String(v)); }
+    size_t print(unsigned long v) { return print(String(v)); }
+    size_t print(double v, int decimals = 2) { return print(String(v, decimals)); }
+    size_t print(const IPAddress &ip) { return print(ip.toString()); }
+
+    size_t println() { return write("\r\n"); }
+    template <typename T> size_t println(const T &v) { size_t n = print(v); return n + println(); }
+
+    __attribute__((format(printf, 2, 3))) size_t printf(const char* fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        char small[128];
+        int len = vsnprintf(small, sizeof(small), fmt, args);
+        va_end(args);
+        if (len < 0) return 0;
+        if ((size_t)len < sizeof(small)) return write((const uint8_t*)small, len);
+        std::string big(len + 1, '\0');
+        va_start(args, fmt);
+        vsnprintf(&big[0], big.size(), fmt, args);
+        va_end(args);
+        return write((const uint8_t*)big.data(), len);
+    }
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    // No timeout on the host: whatever is there is all there is
+    void setTimeout(unsigned long) {}
+    size_t readBytes(char* buf, size_t n) {
+        size_t i = 0;
+        for (int c; i < n && (c = read()) >= 0; i++) buf[i] = (char)c;
+        return i;
+    }
+    size_t readBytes(uint8_t* buf, size_t n) { return readBytes((char*)buf, n); }
+    String readStringUntil(char terminator) {
+        std::string out;
+        for (int c; (c = read()) >= 0 && c != terminator;) out += (char)c;
+        return String(out.c_str());
+    }
+    String readString() {
+        std::string out;
+        for (int c; (c = read()) >= 0;) out += (char)c;
+        return String(out.c_str());
+    }
+};
+
+// Serial goes to stdout when HOST_SERIAL is set in the environment, so test
+// output stays readable unless a log is wanted.
+class HostSerial : public Stream {
+public:
+    void begin(unsigned long) {}
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t* buf, size_t n) override;
+    using Print::write;
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    operator bool() const { return true; }
+};
+extern HostSerial Serial;
+
+// ---------------- time and randomness ----------------
+
+namespace host {
+    uint64_t nowUs();
+    void advanceUs(uint64_t us);
+    inline void advanceMs(unsigned long ms) { advanceUs((uint64_t)ms * 1000); }
+    void seedRandom(uint32_t seed);
+}
+
+inline unsigned long millis() { return (unsigned long)(host::nowUs() / 1000); }
+inline unsigned long micros() { return (unsigned long)host::nowUs(); }
+inline void delay(unsigned long ms) { host::advanceMs(ms); }
+inline void delayMicroseconds(unsigned int us) { host::advanceUs(us); }
+inline void yield() {}
+uint32_t esp_random();
+inline long random(long hi) { return hi > 0 ? (long)(esp_random() % (uint32_t)hi) : 0; }
+inline long random(long lo, long hi) { return hi > lo ? lo + random(hi - lo) : lo; }
+
+// ---------------- FreeRTOS ----------------
+
+// No second core on the host: task creation fails and callers fall back to
+// doing the work from loop().
+typedef void* TaskHandle_t;
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+typedef void (*TaskFunction_t)(void*);
+#define pdPASS 1
+#define pdFAIL 0
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char*, uint32_t, void*, unsigned, TaskHandle_t*, int) {
+    return pdFAIL;
+}
+inline void vTaskDelay(TickType_t ticks) { delay(ticks); }
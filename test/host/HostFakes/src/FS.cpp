@@ -0,0 +1,65 @@
+#include <FS.h>
+#include <SPIFFS.h>
+#include <map>
+
+SPIFFSFS SPIFFS;
+
+static std::map<std::string, std::shared_ptr<std::string>> files;
+static size_t write_count = 0;
+
+void host::resetFs() {
+  files.clear();
+  write_count = 0;
+}
+
+size_t host::fsWriteCount() {
+  return write_count;
+}
+
+size_t File::write(const uint8_t* buf, size_t n) {
+  if (!data || !writable) return 0;
+  write_count++;
+  if (append) pos = data->size();
+  if (pos > data->size()) pos = data->size();
+  data->replace(pos, std::min(n, data->size() - pos), (const char*)buf, n);
+  pos += n;
+  return n;
+}
+
+File FS::open(const char* path, const char* mode, bool create) {
+  auto it = files.find(path);
+  if (mode[0] == 'r') {
+    if (it == files.end()) {
+      if (!create) return File();
+      it = files.emplace(path, std::make_shared<std::string>()).first;
+    }
+    return File(it->second, mode[1] == '+', false);
+  }
+  // "w" and "a" create the file, "w" truncates it
+  if (it == files.end()) it = files.emplace(path, std::make_shared<std::string>()).first;
+  if (mode[0] == 'w') it->second->clear();
+  return File(it->second, true, mode[0] == 'a');
+}
+
+bool FS::exists(const char* path) {
+  return files.count(path) != 0;
+}
+
+bool FS::remove(const char* path) {
+  return files.erase(path) != 0;
+}
+
+bool FS::rename(const char* from, const char* to) {
+  auto it = files.find(from);
+  if (it == files.end()) return false;
+  std::shared_ptr<std::string> data = it->second;
+  files.erase(it);
+  files[to] = data;
+  return true;
+}
+
+size_t SPIFFSFS::usedBytes() {
+  size_t used = 0;
+  for (auto &f : files) used += f.second->size();
+  return used;
+}
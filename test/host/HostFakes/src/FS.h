@@ -0,0 +1,60 @@
+#pragma once
+#include <Arduino.h>
+#include <memory>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+// An in-memory flash file system. Open files share their contents with the
+// file system, so a write is visible to the next open like on SPIFFS.
+namespace host {
+    void resetFs(); // removes every file
+    size_t fsWriteCount(); // write calls since reset, to see how often flash would be touched
+}
+
+class File : public Stream {
+public:
+    File() = default;
+    File(std::shared_ptr<std::string> data, bool writable, bool append)
+      : data(data), writable(writable), append(append), pos(append ? data->size() : 0) {}
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* buf, size_t n) override;
+    using Print::write;
+    int available() override { return data ? (int)(data->size() - std::min(pos, data->size())) : 0; }
+    int read() override { return available() > 0 ? (uint8_t)(*data)[pos++] : -1; }
+    int peek() override { return available() > 0 ? (uint8_t)(*data)[pos] : -1; }
+    size_t read(uint8_t* buf, size_t n) { return readBytes((char*)buf, n); }
+    void flush() override {}
+    void close() { data.reset(); }
+    operator bool() const { return data != nullptr; }
+    bool isDirectory() { return false; }
+    size_t size() { return data ? data->size() : 0; }
+    size_t position() { return pos; }
+    bool seek(uint32_t p) {
+        if (!data || p > data->size()) return false;
+        pos = p;
+        return true;
+    }
+
+private:
+    std::shared_ptr<std::string> data;
+    bool writable = false;
+    bool append = false;
+    size_t pos = 0;
+};
+
+class FS {
+public:
+    File open(const char* path, const char* mode = FILE_READ, bool create = false);
+    File open(const String &path, const char* mode = FILE_READ, bool create = false) {
+        return open(path.c_str(), mode, create);
+    }
+    bool exists(const char* path);
+    bool exists(const String &path) { return exists(path.c_str()); }
+    bool remove(const char* path);
+    bool remove(const String &path) { return remove(path.c_str()); }
+    bool rename(const char* from, const char* to);
+    bool rename(const String &from, const String &to) { return rename(from.c_str(), to.c_str()); }
+};
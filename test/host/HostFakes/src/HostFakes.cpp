@@ -0,0 +1,9 @@
+#include "HostFakes.h"
+
+void host::reset() {
+  resetFs();
+  setWiFiAvailable(true);
+  WiFi.disconnect();
+  broker().reset();
+  setUdpDropFilter(nullptr);
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <Arduino.h>
+#include <FS.h>
+#include <SPIFFS.h>
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <PubSubClient.h>
+
+namespace host {
+    // Back to a fresh device: empty flash, AP up, broker up with no sessions,
+    // no UDP loss. The clock keeps running forward.
+    void reset();
+}
@@ -0,0 +1,293 @@
+#include <PubSubClient.h>
+
+// ---------------- broker ----------------
+
+bool host::topicMatches(const char* filter, const char* topic) {
+  while (*filter) {
+    if (*filter == '#') return true;
+    if (*filter == '+') {
+      while (*topic && *topic != '/') topic++;
+      filter++;
+    } else {
+      if (*filter != *topic) return false;
+      filter++;
+      topic++;
+    }
+  }
+  return *topic == 0;
+}
+
+host::Broker& host::broker() {
+  static Broker* b = new Broker(); // never destroyed: clients in static storage outlive it otherwise
+  return *b;
+}
+
+void host::Broker::reset() {
+  for (auto &s : sessions) {
+    if (s->client) s->client->attached = false;
+  }
+  sessions.clear();
+  listeners.clear();
+  retained.clear();
+  is_online = true;
+  connects = persistent_resumes = subscribes = publishes = 0;
+  connect_log.clear();
+}
+
+void host::Broker::setOnline(bool up) {
+  is_online = up;
+  if (up) return;
+  for (size_t i = 0; i < sessions.size();) {
+    Session &s = *sessions[i];
+    if (s.client) {
+      detach(s); // may erase it
+      continue;
+    }
+    i++;
+  }
+}
+
+void host::Broker::forgetSessions() {
+  for (auto &s : sessions) {
+    if (s->client) s->client->attached = false;
+  }
+  sessions.clear();
+}
+
+host::Broker::Session* host::Broker::find(const std::string &client_id) {
+  for (auto &s : sessions) {
+    if (s->client_id == client_id) return s.get();
+  }
+  return nullptr;
+}
+
+host::Broker::Session& host::Broker::attach(PubSubClient* c, const std::string &client_id, bool clean, bool &present) {
+  connects++;
+  connect_log.push_back({ client_id, clean });
+  Session* s = find(client_id);
+  if (s && s->client && s->client != c) s->client->attached = false; // taken over
+  if (s && clean) {
+    *s = Session();
+    s->client_id = client_id;
+  }
+  present = s && !clean;
+  if (present) persistent_resumes++;
+  if (!s) {
+    sessions.emplace_back(new Session());
+    s = sessions.back().get();
+    s->client_id = client_id;
+  }
+  s->clean = clean;
+  s->client = c;
+  return *s;
+}
+
+void host::Broker::detach(Session &s) {
+  if (s.client) s.client->attached = false;
+  s.client = nullptr;
+  if (s.clean) {
+    for (size_t i = 0; i < sessions.size(); i++) {
+      if (sessions[i].get() == &s) {
+        sessions.erase(sessions.begin() + i);
+        return;
+      }
+    }
+    return;
+  }
+  // Unacknowledged QoS 1 is sent again on reconnect; QoS 0 in flight is lost
+  for (size_t i = 0; i < s.queue.size();) {
+    if (s.queue[i].qos == 0) s.queue.erase(s.queue.begin() + i);
+    else i++;
+  }
+}
+
+void host::Broker::subscribe(Session &s, const char* filter, uint8_t qos) {
+  subscribes++;
+  unsubscribe(s, filter);
+  s.subs.emplace_back(filter, qos > 1 ? 1 : qos);
+  for (const Message &m : retained) {
+    if (!topicMatches(filter, m.topic.c_str())) continue;
+    Message copy = m;
+    copy.qos = std::min(m.qos, qos);
+    s.queue.push_back(copy);
+  }
+}
+
+void host::Broker::unsubscribe(Session &s, const char* filter) {
+  for (size_t i = 0; i < s.subs.size(); i++) {
+    if (s.subs[i].first == filter) {
+      s.subs.erase(s.subs.begin() + i);
+      return;
+    }
+  }
+}
+
+void host::Broker::listen(const char* filter, Listener l) {
+  listeners.emplace_back(filter, l);
+}
+
+void host::Broker::publish(const char* topic, const uint8_t* payload, size_t length, uint8_t qos, bool retain) {
+  publishes++;
+  if (retain) {
+    for (size_t i = 0; i < retained.size(); i++) {
+      if (retained[i].topic == topic) {
+        retained.erase(retained.begin() + i);
+        break;
+      }
+    }
+    if (length > 0) {
+      Message m;
+      m.topic = topic;
+      m.payload.assign(payload, payload + length);
+      m.qos = qos;
+      retained.push_back(m);
+    }
+  }
+
+  for (auto &sp : sessions) {
+    Session &s = *sp;
+    // One copy per session, at the highest QoS among its matching filters
+    int granted = -1;
+    for (auto &sub : s.subs) {
+      if (topicMatches(sub.first.c_str(), topic)) granted = std::max(granted, (int)sub.second);
+    }
+    if (granted < 0) continue;
+    uint8_t q = std::min((uint8_t)granted, qos);
+    if (!s.client && q == 0) continue; // an absent client only gets QoS 1
+    Message m;
+    m.topic = topic;
+    m.payload.assign(payload, payload + length);
+    m.qos = q;
+    s.queue.push_back(std::move(m));
+  }
+
+  // By index: a listener may publish, and even add listeners
+  for (size_t i = 0; i < listeners.size(); i++) {
+    if (!topicMatches(listeners[i].first.c_str(), topic)) continue;
+    Listener l = listeners[i].second;
+    l(topic, payload, length);
+  }
+}
+
+size_t host::Broker::queued(const char* client_id) {
+  Session* s = find(client_id);
+  return s ? s->queue.size() : 0;
+}
+
+bool host::Broker::subscribed(const char* client_id, const char* filter, uint8_t* qos) {
+  Session* s = find(client_id);
+  if (!s) return false;
+  for (auto &sub : s->subs) {
+    if (sub.first != filter) continue;
+    if (qos) *qos = sub.second;
+    return true;
+  }
+  return false;
+}
+
+// ---------------- client ----------------
+
+host::Broker::Session* PubSubClient::session() {
+  if (!attached) return nullptr;
+  host::Broker::Session* s = host::broker().find(client_id);
+  return s && s->client == this ? s : nullptr;
+}
+
+boolean PubSubClient::connect(const char* id, const char* user, const char* pass, const char* willTopic,
+                              uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
+  (void)user; (void)pass; (void)willTopic; (void)willQos; (void)willRetain; (void)willMessage;
+  disconnect();
+  if (!host::wifiUp() || !host::broker().online()) {
+    rc = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  client_id = id;
+  host::broker().attach(this, client_id, cleanSession, session_present);
+  attached = true;
+  rc = MQTT_CONNECTED;
+  return true;
+}
+
+void PubSubClient::disconnect() {
+  host::Broker::Session* s = session();
+  if (s) host::broker().detach(*s);
+  attached = false;
+  publishing = false;
+  rc = MQTT_DISCONNECTED;
+}
+
+boolean PubSubClient::connected() {
+  host::Broker::Session* s = session();
+  if (!s) {
+    attached = false;
+    return false;
+  }
+  if (!host::wifiUp() || !host::broker().online()) {
+    host::broker().detach(*s);
+    rc = MQTT_CONNECTION_LOST;
+    return false;
+  }
+  return true;
+}
+
+boolean PubSubClient::loop() {
+  if (!connected()) return false;
+  host::Broker::Session* s = session();
+  // What arrived before this call; anything published from the callback waits
+  size_t n = s->queue.size();
+  while (n-- > 0 && (s = session()) && !s->queue.empty()) {
+    host::Broker::Message m = std::move(s->queue.front());
+    s->queue.pop_front();
+    // PubSubClient reads the whole packet into its buffer, or drops it
+    if (m.topic.size() + m.payload.size() + 7 > buffer_size) {
+      dropped++;
+      continue;
+    }
+    std::string topic = m.topic;
+    if (callback) callback(&topic[0], m.payload.data(), (unsigned int)m.payload.size());
+  }
+  return true;
+}
+
+boolean PubSubClient::subscribe(const char* topic, uint8_t qos) {
+  if (!connected() || qos > 1) return false;
+  host::broker().subscribe(*session(), topic, qos);
+  return true;
+}
+
+boolean PubSubClient::unsubscribe(const char* topic) {
+  if (!connected()) return false;
+  host::broker().unsubscribe(*session(), topic);
+  return true;
+}
+
+boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int length, boolean retained) {
+  if (!connected()) return false;
+  if (strlen(topic) + length + 7 > buffer_size) return false; // publish() goes through the buffer
+  host::broker().publish(topic, payload, length, 0, retained);
+  return true;
+}
+
+boolean PubSubClient::beginPublish(const char* topic, unsigned int length, boolean retained) {
+  if (!connected()) return false;
+  publishing = true;
+  pub_topic = topic;
+  pub_data.clear();
+  pub_data.reserve(length);
+  pub_retain = retained;
+  return true;
+}
+
+size_t PubSubClient::write(const uint8_t* buf, size_t size) {
+  if (!publishing) return 0;
+  pub_data.insert(pub_data.end(), buf, buf + size);
+  return size;
+}
+
+int PubSubClient::endPublish() {
+  if (!publishing) return 0;
+  publishing = false;
+  if (!connected()) return 0;
+  host::broker().publish(pub_topic.c_str(), pub_data.data(), pub_data.size(), 0, pub_retain);
+  return 1;
+}
@@ -0,0 +1,148 @@
+#pragma once
+#include <Arduino.h>
+#include <Client.h>
+#include <WiFi.h>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#define MQTT_CONNECTED 0
+#define MQTT_CONNECTION_LOST -3
+#define MQTT_CONNECT_FAILED -2
+#define MQTT_DISCONNECTED -1
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+
+class PubSubClient;
+
+// An MQTT broker in memory, shared by every PubSubClient in the process. It
+// keeps sessions by client id: a persistent one (clean session off) keeps its
+// subscriptions while the client is away and queues QoS 1 messages for it.
+// Messages reach a connected client from its next loop(), like over a socket.
+// Tests take the broker down and up again with setOnline, and can listen and
+// publish on it directly as a stand-in for the server.
+namespace host {
+    bool topicMatches(const char* filter, const char* topic); // MQTT + and # wildcards
+
+    class Broker {
+    public:
+        typedef std::function<void(const char* topic, const uint8_t* payload, size_t length)> Listener;
+
+        struct Message {
+            std::string topic;
+            std::vector<uint8_t> payload;
+            uint8_t qos = 0;
+        };
+
+        struct Session {
+            std::string client_id;
+            bool clean = true;
+            PubSubClient* client = nullptr; // nullptr while the client is away
+            std::vector<std::pair<std::string, uint8_t>> subs; // filter, granted QoS
+            std::deque<Message> queue;
+        };
+
+        struct Connect {
+            std::string client_id;
+            bool clean;
+        };
+        void reset();
+        void setOnline(bool up); // going down drops every connection, sessions survive
+        void forgetSessions(); // a restart that lost its state; call while offline
+        bool online() const { return is_online; }
+
+        void listen(const char* filter, Listener l);
+        void publish(const char* topic, const uint8_t* payload, size_t length, uint8_t qos = 0, bool retain = false);
+        void publish(const char* topic, const char* text, uint8_t qos = 0, bool retain = false) {
+            publish(topic, (const uint8_t*)text, strlen(text), qos, retain);
+        }
+
+        Session* find(const std::string &client_id);
+        Session& attach(PubSubClient* c, const std::string &client_id, bool clean, bool &present);
+        void detach(Session &s); // the connection is gone; queued QoS 0 went with it
+        void subscribe(Session &s, const char* filter, uint8_t qos);
+        void unsubscribe(Session &s, const char* filter);
+
+        size_t queued(const char* client_id); // messages waiting for the client
+        bool subscribed(const char* client_id, const char* filter, uint8_t* qos = nullptr);
+
+        // counters since reset
+        uint32_t connects = 0;
+        uint32_t persistent_resumes = 0; // connects that found a session
+        uint32_t subscribes = 0;
+        uint32_t publishes = 0;
+        std::vector<Connect> connect_log; // every connect, in order
+
+    private:
+        bool is_online = true;
+        std::vector<std::unique_ptr<Session>> sessions;
+        std::vector<std::pair<std::string, Listener>> listeners;
+        std::vector<Message> retained;
+    };
+
+    Broker& broker();
+}
+
+class PubSubClient : public Print {
+public:
+    PubSubClient() = default;
+    PubSubClient(Client &client) { (void)client; }
+    ~PubSubClient() { disconnect(); }
+
+    PubSubClient& setServer(const char*, uint16_t) { return *this; }
+    PubSubClient& setServer(IPAddress, uint16_t) { return *this; }
+    PubSubClient& setClient(Client &) { return *this; }
+    PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE) { this->callback = callback; return *this; }
+    PubSubClient& setKeepAlive(uint16_t) { return *this; }
+    PubSubClient& setSocketTimeout(uint16_t) { return *this; }
+    bool setBufferSize(uint16_t size) { buffer_size = size; return true; }
+    uint16_t getBufferSize() { return buffer_size; }
+
+    boolean connect(const char* id) { return connect(id, nullptr, nullptr, nullptr, 0, false, nullptr, true); }
+    boolean connect(const char* id, const char* user, const char* pass) {
+        return connect(id, user, pass, nullptr, 0, false, nullptr, true);
+    }
+    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic,
+                    uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
+    void disconnect();
+    boolean connected();
+    int state() { return rc; }
+    boolean loop();
+
+    boolean subscribe(const char* topic) { return subscribe(topic, 0); }
+    boolean subscribe(const char* topic, uint8_t qos);
+    boolean unsubscribe(const char* topic);
+
+    boolean publish(const char* topic, const char* payload) { return publish(topic, payload, false); }
+    boolean publish(const char* topic, const char* payload, boolean retained) {
+        return publish(topic, (const uint8_t*)payload, strlen(payload), retained);
+    }
+    boolean publish(const char* topic, const uint8_t* payload, unsigned int length) {
+        return publish(topic, payload, length, false);
+    }
+    boolean publish(const char* topic, const uint8_t* payload, unsigned int length, boolean retained);
+
+    boolean beginPublish(const char* topic, unsigned int length, boolean retained);
+    int endPublish();
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* buf, size_t size) override;
+    using Print::write;
+
+    bool sessionPresent() const { return session_present; } // set by the last connect
+    uint32_t droppedCount() const { return dropped; } // inbound messages larger than the buffer
+
+private:
+    friend class host::Broker;
+    std::function<void(char*, uint8_t*, unsigned int)> callback;
+    uint16_t buffer_size = 256;
+    std::string client_id;
+    host::Broker::Session* session();
+    bool attached = false;
+    bool session_present = false;
+    int rc = MQTT_DISCONNECTED;
+    uint32_t dropped = 0;
+
+    bool publishing = false;
+    std::string pub_topic;
+    std::vector<uint8_t> pub_data;
+    bool pub_retain = false;
+};
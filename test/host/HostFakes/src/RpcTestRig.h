@@ -0,0 +1,244 @@
+#pragma once
+#include <ArduinoJson.h>
+#include <map>
+#include <vector>
+#include "HostFakes.h"
+#include "rpc/RPCSystem.hpp"
+#include "rpc/LoopbackTransport.hpp"
+
+// The server end of the JSON-RPC protocol, on any RPCTransport: answers the
+// subscribe handshake, runs registered methods for the device's requests and
+// counts what arrives. Replies leave from loop(), one message per inbound
+// message (an array for a batch), unless the test holds them back.
+class TestServer {
+public:
+    typedef std::function<bool(JsonVariantConst params, JsonVariant result)> Handler;
+
+    explicit TestServer(RPCTransport &transport, int uuid = 7) : transport(transport), uuid(uuid) {
+        snprintf(topic_server, sizeof(topic_server), "espdisplay/%d/server", uuid);
+        snprintf(topic_client, sizeof(topic_client), "espdisplay/%d/client", uuid);
+    }
+
+    void begin() {
+        transport.setReceiver(&TestServer::onMessage, this);
+        transport.subscribe("espdisplay/subscribe");
+        transport.subscribe(topic_client);
+    }
+
+    void on(const char* method, Handler h) { handlers[method] = h; }
+
+    void loop() {
+        transport.loop();
+        if (holding) return;
+        for (JsonDocument &reply : outgoing) send(reply);
+        outgoing.clear();
+    }
+
+    void hold(bool h) { holding = h; }
+    void drop(const char* method, size_t n) { drops[method] = n; } // the next n calls go unanswered, as if lost
+    void answerSubscribes(bool a) { answering_subscribes = a; } // off: the test answers handshakes itself
+    size_t heldReplies() const { return outgoing.size(); }
+
+    // A request (id != 0) or notification (id == 0) from the server to the device
+    void request(const char* method, JsonVariantConst params, uint32_t id) {
+        JsonDocument doc;
+        doc["jsonrpc"] = "2.0";
+        doc["method"] = method;
+        if (!params.isNull()) doc["params"] = params;
+        if (id) doc["id"] = id;
+        send(doc);
+    }
+
+    // Several requests as one batch array
+    void batch(JsonArrayConst requests) {
+        JsonDocument doc;
+        doc.set(requests);
+        send(doc);
+    }
+
+    void send(JsonDocument &doc) {
+        String out;
+        serializeJson(doc, out);
+        transport.publish(topic_server, (const uint8_t*)out.c_str(), out.length());
+    }
+
+    const char* serverTopic() const { return topic_server; }
+
+    // counters
+    size_t messages = 0;      // publishes on the client topic
+    size_t batches = 0;       // of which arrays
+    size_t largest_batch = 0;
+    size_t mixed_batches = 0; // arrays holding both requests and responses
+    size_t calls = 0;         // requests with an id
+    size_t notifications = 0;
+    size_t dropped = 0;       // calls left unanswered by drop()
+    std::map<String, size_t> per_method;
+    std::vector<JsonDocument> responses; // the device's answers to request()
+    uint32_t subscribe_request_id = 0;   // request_id of the newest handshake
+
+private:
+    RPCTransport &transport;
+    int uuid;
+    char topic_server[TopicRouter::MAX_TOPIC_LEN];
+    char topic_client[TopicRouter::MAX_TOPIC_LEN];
+    std::map<String, Handler> handlers;
+    std::map<String, size_t> drops;
+    std::vector<JsonDocument> outgoing;
+    bool holding = false;
+    bool answering_subscribes = true;
+
+    static void onMessage(const char* topic, const uint8_t* payload, size_t length, void* ctx) {
+        TestServer* self = (TestServer*)ctx;
+        JsonDocument doc;
+        if (deserializeJson(doc, payload, length)) return;
+        if (strcmp(topic, "espdisplay/subscribe") == 0) {
+            self->subscribe_request_id = doc["request_id"] | 0u;
+            if (self->answering_subscribes) self->answerSubscribe(doc);
+            return;
+        }
+        if (strcmp(topic, self->topic_client) != 0) return;
+        self->messages++;
+
+        JsonDocument reply;
+        if (doc.is<JsonArrayConst>()) {
+            JsonArrayConst arr = doc.as<JsonArrayConst>();
+            self->batches++;
+            if (arr.size() > self->largest_batch) self->largest_batch = arr.size();
+            bool has_request = false, has_response = false;
+            JsonArray out = reply.to<JsonArray>();
+            for (JsonVariantConst msg : arr) {
+                if (msg["method"].is<const char*>()) has_request = true;
+                else has_response = true;
+                self->handle(msg, out);
+            }
+            if (has_request && has_response) self->mixed_batches++;
+            if (out.size() == 0) return;
+        } else {
+            JsonArray out = reply.to<JsonArray>();
+            self->handle(doc.as<JsonVariantConst>(), out);
+            if (out.size() == 0) return;
+            JsonDocument single;
+            single.set(out[0]);
+            reply = std::move(single);
+        }
+        self->outgoing.push_back(std::move(reply));
+    }
+
+    void answerSubscribe(JsonDocument &req) {
+        JsonDocument doc;
+        doc["request_type"] = "subscribe_reply";
+        doc["request_id"] = req["request_id"];
+        doc["uuid"] = uuid;
+        doc["encoding"] = "json";
+        String out;
+        serializeJson(doc, out);
+        transport.publish("espdisplay/broadcast", (const uint8_t*)out.c_str(), out.length());
+    }
+
+    void handle(JsonVariantConst msg, JsonArray out) {
+        if (!msg["method"].is<const char*>()) {
+            responses.emplace_back();
+            responses.back().set(msg);
+            return;
+        }
+        String method = msg["method"].as<const char*>();
+        per_method[method]++;
+        if (!msg["id"].is<JsonVariantConst>()) {
+            notifications++;
+            JsonDocument scratch;
+            auto h = handlers.find(method);
+            if (h != handlers.end()) h->second(msg["params"], scratch.to<JsonVariant>());
+            return;
+        }
+        calls++;
+        auto d = drops.find(method);
+        if (d != drops.end() && d->second > 0) {
+            d->second--;
+            dropped++;
+            return;
+        }
+        JsonObject reply = out.add<JsonObject>();
+        reply["jsonrpc"] = "2.0";
+        auto h = handlers.find(method);
+        if (h == handlers.end()) {
+            reply["error"]["code"] = -32601;
+            reply["error"]["message"] = "Unknown method";
+        } else if (!h->second(msg["params"], reply["result"].to<JsonVariant>())) {
+            reply.remove("result");
+            reply["error"]["code"] = -32603;
+            reply["error"]["message"] = "Internal error";
+        }
+        reply["id"] = msg["id"];
+    }
+};
+
+// Swallows what the device sends; messages for it are handed in with inject()
+class InjectTransport : public RPCTransport {
+public:
+    InjectTransport() { last.reserve(4096); } // recording a batch stays out of the allocation counts
+
+    const char* name() const override { return "inject"; }
+    bool connect(const char*, bool) override { return true; }
+    void disconnect() override {}
+    bool connected() override { return true; }
+    void loop() override {}
+    bool subscribe(const char*, uint8_t) override { return true; }
+    bool unsubscribe(const char*) override { return true; }
+    bool beginMessage(const char*, size_t) override { sent++; last.clear(); return true; }
+    size_t write(const uint8_t* data, size_t length) override { last.append((const char*)data, length); return length; }
+    bool endMessage() override { return true; }
+    size_t maxMessageSize() override { return LoopbackTransport::MAX_MESSAGE; }
+
+    void inject(const char* topic, const uint8_t* payload, size_t length) { deliver(topic, payload, length); }
+    void inject(const char* topic, const char* payload) { inject(topic, (const uint8_t*)payload, strlen(payload)); }
+
+    size_t sent = 0;  // messages published by the device
+    std::string last; // the newest of them
+};
+
+// Opens a session without the handshake, from a stored UUID (7, JSON)
+inline void openStored(ESP32RPC &rpc) {
+    File f = SPIFFS.open("/uuid.txt", "w");
+    f.print("7\njson\n");
+    f.close();
+    rpc.begin();
+    rpc.startSession();
+}
+
+// A device ESP32RPC and a TestServer on two paired LoopbackTransports.
+struct LoopbackRig {
+    LoopbackTransport device_link;
+    LoopbackTransport server_link;
+    TestServer server;
+    ESP32RPC rpc;
+
+    LoopbackRig() : server(server_link), rpc(device_link) {}
+
+    // Handshake and subscribe, as after a fresh connect
+    bool open() {
+        LoopbackTransport::pair(device_link, server_link);
+        server_link.connect("server");
+        device_link.connect("device");
+        server.begin();
+        rpc.begin();
+        rpc.startSession();
+        return runUntil([this] { return rpc.sessionState() == ESP32RPC::Session::Ready; }, 1000);
+    }
+
+    // One pass of the main loop, then ms of time
+    void tick(unsigned long ms = 1) {
+        rpc.loop();
+        server.loop();
+        host::advanceMs(ms);
+    }
+
+    template <typename Done>
+    bool runUntil(Done done, unsigned long timeout_ms) {
+        unsigned long start = millis();
+        while (!done()) {
+            if (millis() - start > timeout_ms) return false;
+            tick();
+        }
+        return true;
+    }
+};
@@ -0,0 +1,10 @@
+#pragma once
+#include <FS.h>
+
+class SPIFFSFS : public FS {
+public:
+    bool begin(bool formatOnFail = false) { (void)formatOnFail; return true; }
+    size_t totalBytes() { return 1 << 20; }
+    size_t usedBytes();
+};
+extern SPIFFSFS SPIFFS;
@@ -0,0 +1,75 @@
+#pragma once
+#include <Arduino.h>
+#include <Client.h>
+
+// Association succeeds at once while the test-controlled access point is up
+// (host::setWiFiAvailable); taking it down drops the link like a lost AP.
+typedef enum {
+    WL_IDLE_STATUS = 0,
+    WL_NO_SSID_AVAIL,
+    WL_SCAN_COMPLETED,
+    WL_CONNECTED,
+    WL_CONNECT_FAILED,
+    WL_CONNECTION_LOST,
+    WL_DISCONNECTED
+} wl_status_t;
+
+#define WIFI_STA 1
+
+namespace host {
+    void setWiFiAvailable(bool up);
+    bool wifiUp(); // associated and the AP is available
+}
+
+class WiFiClass {
+public:
+    wl_status_t begin(const char* ssid, const char* pass = nullptr, int32_t channel = 0,
+                      const uint8_t* bssid = nullptr, bool connect = true);
+    wl_status_t status();
+    bool disconnect(bool wifioff = false, bool eraseap = false);
+    bool reconnect() { begin(nullptr); return true; }
+    bool config(IPAddress local, IPAddress gateway, IPAddress subnet,
+                IPAddress dns1 = IPAddress(), IPAddress dns2 = IPAddress());
+    bool mode(int) { return true; }
+    bool setAutoReconnect(bool) { return true; }
+    bool persistent(bool) { return true; }
+    bool setSleep(bool) { return true; }
+
+    IPAddress localIP() { return IPAddress(192, 168, 1, 80); }
+    IPAddress gatewayIP() { return IPAddress(192, 168, 1, 1); }
+    IPAddress subnetMask() { return IPAddress(255, 255, 255, 0); }
+    IPAddress dnsIP(uint8_t = 0) { return IPAddress(192, 168, 1, 1); }
+    uint8_t* BSSID();
+    int32_t channel() { return 6; }
+    int8_t RSSI() { return -50; }
+    uint8_t* macAddress(uint8_t* mac);
+    String macAddress();
+
+    uint32_t beginCount() const { return begins; } // association attempts since reset
+
+private:
+    friend void host::setWiFiAvailable(bool);
+    friend bool host::wifiUp();
+    bool started = false;
+    uint32_t begins = 0;
+};
+extern WiFiClass WiFi;
+
+// The fakes never open sockets; PubSubClient talks to the in-memory broker.
+class WiFiClient : public Client {
+public:
+    int connect(IPAddress, uint16_t) override { return 0; }
+    int connect(const char*, uint16_t) override { return 0; }
+    size_t write(uint8_t) override { return 0; }
+    size_t write(const uint8_t*, size_t) override { return 0; }
+    using Print::write;
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int read(uint8_t*, size_t) override { return -1; }
+    int peek() override { return -1; }
+    void flush() override {}
+    void stop() override {}
+    uint8_t connected() override { return 0; }
+    operator bool() override { return false; }
+    int setNoDelay(bool) { return 0; }
+};
@@ -0,0 +1,68 @@
+#include <WiFiUdp.h>
+#include <map>
+
+static std::map<uint16_t, WiFiUDP*> sockets; // bound port -> socket
+static host::UdpDropFilter drop_filter;
+static uint32_t datagrams = 0;
+
+void host::setUdpDropFilter(UdpDropFilter filter) {
+  drop_filter = filter;
+}
+
+uint32_t host::udpDatagramCount() {
+  return datagrams;
+}
+
+uint8_t WiFiUDP::begin(uint16_t port) {
+  stop();
+  if (sockets.count(port)) return 0; // address in use
+  sockets[port] = this;
+  bound = port;
+  return 1;
+}
+
+void WiFiUDP::stop() {
+  if (bound) sockets.erase(bound);
+  bound = 0;
+  inbox.clear();
+  current.clear();
+  pos = 0;
+}
+
+int WiFiUDP::beginPacket(const char*, uint16_t port) {
+  dest = port;
+  out.clear();
+  return 1;
+}
+
+int WiFiUDP::endPacket() {
+  datagrams++;
+  auto it = sockets.find(dest);
+  bool dropped = drop_filter && drop_filter(bound, dest, out.data(), out.size());
+  // Like real UDP, a datagram nobody receives is not an error for the sender
+  if (it != sockets.end() && !dropped) {
+    Datagram d;
+    d.from = bound;
+    d.data = out;
+    it->second->inbox.push_back(std::move(d));
+  }
+  out.clear();
+  return 1;
+}
+
+int WiFiUDP::parsePacket() {
+  if (inbox.empty()) return 0;
+  current = std::move(inbox.front().data);
+  current_from = inbox.front().from;
+  inbox.pop_front();
+  pos = 0;
+  return (int)current.size();
+}
+
+int WiFiUDP::read(unsigned char* buf, size_t n) {
+  size_t left = current.size() - pos;
+  if (n > left) n = left;
+  memcpy(buf, current.data() + pos, n);
+  pos += n;
+  return (int)n;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <WiFi.h>
+#include <deque>
+#include <vector>
+
+// Datagrams between WiFiUDP instances in the same process, addressed by port
+// only. A test can drop datagrams with host::setUdpDropFilter to simulate loss.
+namespace host {
+    // Returns true to drop the datagram
+    typedef std::function<bool(uint16_t from_port, uint16_t to_port, const uint8_t* data, size_t length)> UdpDropFilter;
+    void setUdpDropFilter(UdpDropFilter filter);
+    uint32_t udpDatagramCount(); // sent since reset, dropped or not
+}
+
+class WiFiUDP : public Stream {
+public:
+    ~WiFiUDP() { stop(); }
+
+    uint8_t begin(uint16_t port);
+    void stop();
+    uint16_t localPort() const { return bound; }
+
+    int beginPacket(IPAddress ip, uint16_t port) { (void)ip; return beginPacket("", port); }
+    int beginPacket(const char* host, uint16_t port);
+    int endPacket();
+    size_t write(uint8_t c) override { out.push_back(c); return 1; }
+    size_t write(const uint8_t* buf, size_t n) override { out.insert(out.end(), buf, buf + n); return n; }
+    using Print::write;
+
+    int parsePacket();
+    int available() override { return (int)(current.size() - pos); }
+    int read() override { return pos < current.size() ? current[pos++] : -1; }
+    int read(unsigned char* buf, size_t n);
+    int read(char* buf, size_t n) { return read((unsigned char*)buf, n); }
+    int peek() override { return pos < current.size() ? current[pos] : -1; }
+    IPAddress remoteIP() { return IPAddress(127, 0, 0, 1); }
+    uint16_t remotePort() { return current_from; }
+
+    struct Datagram {
+        uint16_t from = 0;
+        std::vector<uint8_t> data;
+    };
+    std::deque<Datagram> inbox; // filled by the sender's endPacket()
+
+private:
+    uint16_t bound = 0;
+    uint16_t dest = 0;
+    std::vector<uint8_t> out;
+    std::vector<uint8_t> current;
+    uint16_t current_from = 0;
+    size_t pos = 0;
+};
@@ -0,0 +1,163 @@
+// ComponentUpdateQueue under a component_update storm: 200 updates a second,
+// published in bursts, against a 60 fps frame loop. Each frame applies at most
+// one batch, updates collapse to the newest per component, obsolete ones are
+// dropped, nothing is refused as busy, and a tap still gets its answer.
+#include <unity.h>
+#include <map>
+#include "RpcTestRig.h"
+#include "renderer/ComponentUpdateQueue.hpp"
+
+static const size_t COMPONENTS = 4;
+static const unsigned long STORM_MS = 5000;
+static const size_t PER_SECOND = 200;
+static const unsigned long BURST_MS = 100; // the server flushes its updates ten times a second
+static const size_t PER_BURST = PER_SECOND * BURST_MS / 1000;
+static const unsigned long FRAME_MS = 16;
+
+// The renderer's side: the newest state shown per component
+struct RecordingSink : StateSink {
+  std::map<String, JsonDocument> shown;
+
+  bool applyState(const String &comp_id, JsonVariantConst state) override {
+    shown[comp_id].set(state);
+    return true;
+  }
+};
+
+static String compId(size_t c) {
+  return "comp-" + String((unsigned)c);
+}
+
+struct Storm {
+  LoopbackRig rig;
+  ComponentUpdateQueue updates;
+  RecordingSink sink;
+  uint32_t seq[COMPONENTS] = {};
+  size_t sent = 0;
+  size_t stale = 0; // sent with a seq already superseded
+  uint32_t next_id = 1;
+  size_t frames = 0;
+  size_t largest_frame = 0;
+
+  void open(ESP32RPC::Dispatch dispatch) {
+    TEST_ASSERT_TRUE(rig.open());
+    TEST_ASSERT_TRUE(rig.rpc.registerMethod("component_update", &ComponentUpdateQueue::onComponentUpdate, &updates,
+                                            dispatch));
+  }
+
+  // PER_BURST updates, one message each, round-robin over the components;
+  // every fifth repeats an older seq, as a server retry overtaken by newer state would
+  void burst(bool with_ids) {
+    for (size_t i = 0; i < PER_BURST; i++) {
+      size_t c = sent % COMPONENTS;
+      bool old = i % 5 == 4 && seq[c] > 1;
+      uint32_t s = old ? seq[c] - 1 : ++seq[c];
+      JsonDocument params;
+      params["component"] = compId(c);
+      params["seq"] = s;
+      params["data"]["level"] = s;
+      rig.server.request("component_update", params.as<JsonVariantConst>(), with_ids ? next_id++ : 0);
+      sent++;
+      stale += old;
+    }
+  }
+
+  // main.cpp's loop(): the RPC layer every pass, the UI once per frame
+  void run(unsigned long ms, bool with_ids) {
+    for (unsigned long t = 0; t < ms; t++) {
+      if (t % BURST_MS == 0) burst(with_ids);
+      rig.tick();
+      if (t % FRAME_MS == 0) frame();
+    }
+    rig.tick();
+    frame();
+  }
+
+  void frame() {
+    size_t n = updates.apply(sink);
+    frames++;
+    if (n > largest_frame) largest_frame = n;
+  }
+};
+
+void setUp() {
+  host::reset();
+}
+
+void tearDown() {}
+
+void test_storm_is_coalesced_and_applied_once_per_frame() {
+  Storm s;
+  s.open(ESP32RPC::Dispatch::OnArrival);
+  size_t device_messages = s.rig.server.messages;
+  s.run(STORM_MS, false);
+
+  TEST_ASSERT_EQUAL(STORM_MS / BURST_MS * PER_BURST, s.sent);
+  TEST_ASSERT_EQUAL(s.sent, s.updates.receivedCount());
+  // One batch per frame, never more than one update per component
+  TEST_ASSERT_LESS_OR_EQUAL(COMPONENTS, s.largest_frame);
+  TEST_ASSERT_EQUAL(0, s.updates.pendingCount());
+  // Every update is accounted for: applied, replaced before its frame, or obsolete
+  TEST_ASSERT_EQUAL(s.stale, s.updates.droppedCount());
+  TEST_ASSERT_GREATER_THAN(0, s.updates.coalescedCount());
+  TEST_ASSERT_EQUAL(s.sent, s.updates.appliedCount() + s.updates.coalescedCount() + s.updates.droppedCount());
+  TEST_ASSERT_LESS_THAN(s.sent / 2, s.updates.appliedCount());
+  // The newest state is the one on screen
+  for (size_t c = 0; c < COMPONENTS; c++) TEST_ASSERT_EQUAL(s.seq[c], s.sink.shown[compId(c)]["level"].as<uint32_t>());
+
+  // Notifications: none refused, none answered
+  TEST_ASSERT_EQUAL(0, s.rig.rpc.busyRejects());
+  TEST_ASSERT_EQUAL(device_messages, s.rig.server.messages);
+}
+
+void test_device_stays_responsive_during_a_storm() {
+  Storm s;
+  s.open(ESP32RPC::Dispatch::OnArrival);
+  s.rig.server.on("tap", [](JsonVariantConst, JsonVariant result) { return result.set(true); });
+  s.run(STORM_MS / 2, false);
+
+  // A tap in the middle of a burst: answered within a round trip's ticks
+  s.burst(false);
+  bool done = false;
+  JsonDocument params;
+  TEST_ASSERT_NOT_EQUAL(0, s.rig.rpc.callAsync("tap", params.as<JsonVariantConst>(),
+                                               [&done](bool ok, JsonVariantConst) { done = ok; }, 0,
+                                               ESP32RPC::Priority::Interactive));
+  s.rig.tick();
+  s.rig.tick();
+  TEST_ASSERT_TRUE(done);
+  s.run(STORM_MS / 2, false);
+  TEST_ASSERT_EQUAL(0, s.rig.rpc.busyRejects());
+}
+
+void test_acks_leave_one_batch_per_tick() {
+  Storm s;
+  s.open(ESP32RPC::Dispatch::OnArrival);
+  size_t device_messages = s.rig.server.messages;
+  s.run(STORM_MS, true);
+
+  // Updates sent as requests are each acknowledged, a burst's acks in one message
+  TEST_ASSERT_EQUAL(s.sent, s.rig.server.responses.size());
+  TEST_ASSERT_EQUAL(STORM_MS / BURST_MS, s.rig.server.messages - device_messages);
+  TEST_ASSERT_EQUAL(PER_BURST, s.rig.server.largest_batch);
+  TEST_ASSERT_EQUAL(s.sent, s.updates.receivedCount());
+}
+
+void test_queued_dispatch_would_refuse_the_storm() {
+  Storm s;
+  s.open(ESP32RPC::Dispatch::Queued);
+  s.run(BURST_MS, false);
+
+  // A burst larger than the request queue: the excess never reaches the queue to be coalesced
+  TEST_ASSERT_EQUAL(PER_BURST - ESP32RPC::MAX_QUEUED_REQUESTS, s.rig.rpc.busyRejects());
+  TEST_ASSERT_EQUAL(ESP32RPC::MAX_QUEUED_REQUESTS, s.updates.receivedCount());
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_storm_is_coalesced_and_applied_once_per_frame);
+  RUN_TEST(test_device_stays_responsive_during_a_storm);
+  RUN_TEST(test_acks_leave_one_batch_per_tick);
+  RUN_TEST(test_queued_dispatch_would_refuse_the_storm);
+  return UNITY_END();
+}
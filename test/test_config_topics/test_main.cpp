@@ -0,0 +1,261 @@
+// ConfigTopics on a device connected to the in-memory broker: a config
+// subscribes the retained state topic of each of its components, falls back
+// to one wildcard subscription when the router is full, joins the groups it
+// lists, and a new config unsubscribes whatever the old one had that it does not.
+#include <unity.h>
+#include <map>
+#include <vector>
+#include "RpcTestRig.h"
+#include "rpc/MqttTransport.hpp"
+#include "rpc/ConfigTopics.hpp"
+#include "renderer/ComponentUpdateQueue.hpp"
+
+static const char* DEVICE = "espdisplay-7";
+static const unsigned long TICK_MS = 10;
+
+// What the renderer would be handed
+struct RecordingSink : ConfigSink, StateSink {
+  size_t begins = 0;
+  size_t screens = 0;
+  std::map<String, int> shown; // comp_id -> state["level"]
+
+  void beginConfig(JsonVariantConst) override { begins++; }
+  void addScreen(JsonVariantConst) override { screens++; }
+  void endConfig() override {}
+  bool applyState(const String &comp_id, JsonVariantConst state) override {
+    shown[comp_id] = state["level"] | -1;
+    return true;
+  }
+};
+
+// main.cpp's wiring: the config passes through ConfigTopics on its way to
+// the renderer, and state messages land in the update queue
+struct TopicsRig {
+  RPCSystem sys;
+  PubSubClient server_mqtt;
+  MqttTransport server_link;
+  TestServer server;
+  RecordingSink sink;
+  ComponentUpdateQueue updates;
+  ConfigTopics topics;
+
+  TopicsRig()
+    : sys("ssid", "password", "broker"), server_link(server_mqtt), server(server_link),
+      topics(sys.getRPC(), sink, updates) {
+    server_mqtt.setBufferSize(RPCSystem::MQTT_BUFFER_SIZE);
+  }
+
+  void tick() {
+    sys.loop();
+    if (!server_link.connected() && server_link.connect("test-server")) server.begin();
+    server.loop();
+    host::advanceMs(TICK_MS);
+  }
+
+  bool ready() {
+    TEST_ASSERT_TRUE(sys.begin(true));
+    for (unsigned long t = 0; t < 5000 && !sys.isReady(); t += TICK_MS) tick();
+    return sys.isReady();
+  }
+
+  // One screen holding comp_ids, in a config that joins groups
+  void load(const std::vector<String> &comp_ids, std::vector<const char*> groups = {}) {
+    JsonDocument header;
+    header["version"] = 1;
+    JsonArray g = header["groups"].to<JsonArray>();
+    for (const char* name : groups) g.add(name);
+    topics.beginConfig(header.as<JsonVariantConst>());
+    JsonDocument screen;
+    screen["id"] = "main";
+    JsonArray comps = screen["components"].to<JsonArray>();
+    for (const String &id : comp_ids) comps.add<JsonObject>()["comp_id"] = id;
+    topics.addScreen(screen.as<JsonVariantConst>());
+    topics.endConfig();
+  }
+
+  // A few loop()s for the broker's answers, then one frame
+  size_t settle() {
+    for (int i = 0; i < 5; i++) tick();
+    return updates.apply(sink);
+  }
+};
+
+static std::vector<String> compIds(const char* prefix, size_t n) {
+  std::vector<String> ids;
+  for (size_t i = 0; i < n; i++) ids.push_back(String(prefix) + String((unsigned)i));
+  return ids;
+}
+
+static void retain(const String &comp_id, int level) {
+  String topic = String(ConfigTopics::PREFIX) + comp_id;
+  String payload = "{\"level\":" + String(level) + "}";
+  host::broker().publish(topic.c_str(), payload.c_str(), 0, true);
+}
+
+static bool stateSubscribed(const String &filter) {
+  return host::broker().subscribed(DEVICE, filter.c_str());
+}
+
+static bool groupSubscribed(const char* name, uint8_t* qos = nullptr) {
+  String filter = String("espdisplay/group/") + name;
+  return host::broker().subscribed(DEVICE, filter.c_str(), qos);
+}
+
+// A state delta published once for the whole group, as the server fans out
+static void groupUpdate(const char* name, const char* comp_id, int level) {
+  String topic = String("espdisplay/group/") + name;
+  String payload = String("{\"jsonrpc\":\"2.0\",\"method\":\"component_update\",\"params\":{\"component\":\"") +
+                   comp_id + "\",\"data\":{\"level\":" + String(level) + "}}}";
+  host::broker().publish(topic.c_str(), payload.c_str(), 1);
+}
+
+void setUp() {
+  host::reset();
+}
+
+void tearDown() {}
+
+void test_each_component_gets_its_retained_state() {
+  TopicsRig rig;
+  TEST_ASSERT_TRUE(rig.ready());
+  std::vector<String> ids = compIds("lamp-", 4);
+  for (size_t i = 0; i < ids.size(); i++) retain(ids[i], (int)i + 10);
+  retain("elsewhere", 99); // another display's component
+
+  rig.load(ids);
+  TEST_ASSERT_EQUAL(1, rig.sink.begins);
+  TEST_ASSERT_EQUAL(1, rig.sink.screens);
+  TEST_ASSERT_EQUAL(ids.size(), rig.topics.subscribedCount());
+  for (const String &id : ids) TEST_ASSERT_TRUE(stateSubscribed(String(ConfigTopics::PREFIX) + id));
+  TEST_ASSERT_FALSE(stateSubscribed("espdisplay/state/+"));
+
+  // The subscribes alone bring every component's state, in one frame
+  TEST_ASSERT_EQUAL(ids.size(), rig.settle());
+  TEST_ASSERT_EQUAL(ids.size(), rig.sink.shown.size());
+  for (size_t i = 0; i < ids.size(); i++) TEST_ASSERT_EQUAL((int)i + 10, rig.sink.shown[ids[i]]);
+
+  // Later state arrives the same way
+  retain(ids[2], 42);
+  TEST_ASSERT_EQUAL(1, rig.settle());
+  TEST_ASSERT_EQUAL(42, rig.sink.shown[ids[2]]);
+}
+
+void test_too_many_components_fall_back_to_the_wildcard() {
+  TopicsRig rig;
+  TEST_ASSERT_TRUE(rig.ready());
+  // More than the router can take next to the RPC topics
+  std::vector<String> ids = compIds("sensor-", TopicRouter::MAX_ROUTES + 4);
+  retain(ids.front(), 1);
+  retain(ids.back(), 2);
+  retain("elsewhere", 99);
+
+  rig.load(ids);
+  TEST_ASSERT_EQUAL(1, rig.topics.subscribedCount());
+  TEST_ASSERT_TRUE(stateSubscribed("espdisplay/state/+"));
+  for (const String &id : ids) TEST_ASSERT_FALSE(stateSubscribed(String(ConfigTopics::PREFIX) + id));
+
+  // Everyone's retained state comes in; only this config's reaches the queue
+  TEST_ASSERT_EQUAL(2, rig.settle());
+  TEST_ASSERT_EQUAL(2, rig.sink.shown.size());
+  TEST_ASSERT_EQUAL(1, rig.sink.shown[ids.front()]);
+  TEST_ASSERT_EQUAL(2, rig.sink.shown[ids.back()]);
+  TEST_ASSERT_EQUAL(0, rig.sink.shown.count("elsewhere"));
+
+  // A config that fits again goes back to exact topics
+  std::vector<String> few = compIds("lamp-", 2);
+  rig.load(few);
+  TEST_ASSERT_EQUAL(few.size(), rig.topics.subscribedCount());
+  TEST_ASSERT_FALSE(stateSubscribed("espdisplay/state/+"));
+  for (const String &id : few) TEST_ASSERT_TRUE(stateSubscribed(String(ConfigTopics::PREFIX) + id));
+}
+
+void test_a_new_config_unsubscribes_the_old_components() {
+  TopicsRig rig;
+  TEST_ASSERT_TRUE(rig.ready());
+  rig.load({ "lamp", "fan", "door" });
+  rig.settle();
+
+  rig.load({ "lamp", "heater" });
+  TEST_ASSERT_EQUAL(2, rig.sink.begins);
+  TEST_ASSERT_EQUAL(2, rig.topics.subscribedCount());
+  TEST_ASSERT_TRUE(stateSubscribed("espdisplay/state/lamp"));
+  TEST_ASSERT_TRUE(stateSubscribed("espdisplay/state/heater"));
+  TEST_ASSERT_FALSE(stateSubscribed("espdisplay/state/fan"));
+  TEST_ASSERT_FALSE(stateSubscribed("espdisplay/state/door"));
+
+  // State for a component no longer shown does not reach the queue
+  retain("fan", 5);
+  retain("heater", 6);
+  TEST_ASSERT_EQUAL(1, rig.settle());
+  TEST_ASSERT_EQUAL(0, rig.sink.shown.count("fan"));
+  TEST_ASSERT_EQUAL(6, rig.sink.shown["heater"]);
+}
+
+void test_subscriptions_survive_a_reconnect() {
+  TopicsRig rig;
+  TEST_ASSERT_TRUE(rig.ready());
+  rig.load({ "lamp" });
+  retain("lamp", 1);
+  rig.settle();
+
+  // Routes kept while offline are subscribed again with the new session,
+  // and the broker sends the retained state once more
+  host::broker().setOnline(false);
+  for (int i = 0; i < 5; i++) rig.tick();
+  retain("lamp", 2);
+  host::broker().setOnline(true);
+  for (unsigned long t = 0; t < RPCSystem::BACKOFF_MAX_MS + 1000 && !rig.sys.isReady(); t += TICK_MS) rig.tick();
+  TEST_ASSERT_TRUE(rig.sys.isReady());
+  rig.settle();
+  TEST_ASSERT_TRUE(stateSubscribed("espdisplay/state/lamp"));
+  TEST_ASSERT_EQUAL(2, rig.sink.shown["lamp"]);
+}
+
+void test_config_groups_are_joined_and_left() {
+  TopicsRig rig;
+  TEST_ASSERT_TRUE(rig.ready());
+  TEST_ASSERT_TRUE(rig.sys.getRPC().registerMethod("component_update", &ComponentUpdateQueue::onComponentUpdate,
+                                                   &rig.updates, ESP32RPC::Dispatch::OnArrival));
+
+  // Names that are not one plain topic level are skipped
+  rig.load({ "lamp" }, { "kitchen", "all", "bad/name", "wild+", "" });
+  uint8_t qos = 0;
+  TEST_ASSERT_TRUE(groupSubscribed("kitchen", &qos));
+  TEST_ASSERT_EQUAL(1, qos); // like the server topic
+  TEST_ASSERT_TRUE(groupSubscribed("all"));
+  TEST_ASSERT_FALSE(groupSubscribed("bad/name"));
+  TEST_ASSERT_FALSE(host::broker().subscribed(DEVICE, "espdisplay/group/wild+"));
+
+  // A delta sent once to the group is dispatched like a unicast request
+  groupUpdate("kitchen", "lamp", 7);
+  TEST_ASSERT_EQUAL(1, rig.settle());
+  TEST_ASSERT_EQUAL(7, rig.sink.shown["lamp"]);
+
+  // The next config leaves the groups it no longer lists
+  rig.load({ "lamp" }, { "kitchen" });
+  TEST_ASSERT_TRUE(groupSubscribed("kitchen"));
+  TEST_ASSERT_FALSE(groupSubscribed("all"));
+  groupUpdate("all", "lamp", 8);
+  TEST_ASSERT_EQUAL(0, rig.settle());
+  TEST_ASSERT_EQUAL(7, rig.sink.shown["lamp"]);
+
+  // At most MAX_GROUPS, and a config without groups leaves them all
+  std::vector<String> names = compIds("room", ESP32RPC::MAX_GROUPS + 2);
+  std::vector<const char*> many;
+  for (const String &n : names) many.push_back(n.c_str());
+  rig.load({ "lamp" }, many);
+  for (size_t i = 0; i < names.size(); i++) TEST_ASSERT_EQUAL(i < ESP32RPC::MAX_GROUPS, groupSubscribed(names[i].c_str()));
+  TEST_ASSERT_FALSE(groupSubscribed("kitchen"));
+  rig.load({ "lamp" });
+  for (const String &n : names) TEST_ASSERT_FALSE(groupSubscribed(n.c_str()));
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_each_component_gets_its_retained_state);
+  RUN_TEST(test_too_many_components_fall_back_to_the_wildcard);
+  RUN_TEST(test_a_new_config_unsubscribes_the_old_components);
+  RUN_TEST(test_subscriptions_survive_a_reconnect);
+  RUN_TEST(test_config_groups_are_joined_and_left);
+  return UNITY_END();
+}
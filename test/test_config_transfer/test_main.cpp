@@ -0,0 +1,252 @@
+// ConfigTransfer against a TestServer serving a chunked config: chunks must
+// arrive once each and in order whatever the server or link does to them,
+// with failures backing off and old servers getting a plain get_config.
+#include <unity.h>
+#include <vector>
+#include "RpcTestRig.h"
+#include "rpc/ConfigTransfer.hpp"
+
+static const uint32_t CHUNKS = 5;
+static const size_t SCREENS_PER_CHUNK = 2;
+
+// What the renderer would be handed
+struct RecordingSink : ConfigSink {
+  size_t begins = 0;
+  size_t ends = 0;
+  int version = 0;
+  std::vector<String> screens;
+
+  void beginConfig(JsonVariantConst header) override {
+    begins++;
+    version = header["version"] | 0;
+  }
+  void addScreen(JsonVariantConst screen) override { screens.push_back(screen["id"].as<const char*>()); }
+  void endConfig() override { ends++; }
+};
+
+static String screenId(uint32_t seq, size_t i) {
+  return "screen-" + String(seq) + "-" + String((unsigned)i);
+}
+
+// The device side as main.cpp drives it, and a server answering get_config_chunk
+struct Transfer {
+  LoopbackRig rig;
+  RecordingSink sink;
+  ConfigTransfer transfer;
+
+  std::vector<uint32_t> requested; // seq of every chunk request, in order
+  std::vector<unsigned long> requested_at;
+  std::vector<long> acks;          // ack carried by each request, -1 for none
+  long final_ack = -1;             // from the closing notification
+  long stale_for = -1;             // answer this seq once with the previous chunk
+  long failing = -1;               // answer this seq with an error while set
+
+  Transfer() : transfer(rig.rpc, sink) {}
+
+  void serveChunks() {
+    rig.server.on("get_config_chunk", [this](JsonVariantConst params, JsonVariant result) {
+      if (!params["seq"].is<uint32_t>()) {
+        final_ack = params["ack"] | -1L;
+        return true;
+      }
+      uint32_t seq = params["seq"];
+      requested.push_back(seq);
+      requested_at.push_back(millis());
+      acks.push_back(params["ack"] | -1L);
+      if ((long)seq == failing) return false;
+      if ((long)seq == stale_for) {
+        stale_for = -1;
+        seq--; // an older chunk overtakes the one asked for
+      }
+      result["seq"] = seq;
+      result["total"] = CHUNKS;
+      if (seq == 0) result["version"] = 3;
+      JsonArray screens = result["screens"].to<JsonArray>();
+      for (size_t i = 0; i < SCREENS_PER_CHUNK; i++) screens.add<JsonObject>()["id"] = screenId(seq, i);
+      return true;
+    });
+  }
+
+  // request_config() in main.cpp: resume whenever nothing is in flight
+  void tick(unsigned long ms = 1) {
+    if (rig.rpc.sessionState() == ESP32RPC::Session::Ready && transfer.isStarted() &&
+        !transfer.isActive() && !transfer.isDone()) {
+      transfer.resume();
+    }
+    rig.tick(ms);
+  }
+
+  bool runUntilDone(unsigned long timeout_ms = 60000) {
+    unsigned long start = millis();
+    while (!transfer.isDone()) {
+      if (millis() - start > timeout_ms) return false;
+      tick();
+    }
+    rig.tick(); // the closing ack goes out
+    rig.tick();
+    return true;
+  }
+
+  size_t requestsFor(uint32_t seq) const {
+    size_t n = 0;
+    for (uint32_t s : requested) n += s == seq;
+    return n;
+  }
+
+  // Every screen exactly once, in order, inside one begin/end
+  void assertComplete(bool chunked = true) {
+    TEST_ASSERT_EQUAL(1, sink.begins);
+    TEST_ASSERT_EQUAL(1, sink.ends);
+    TEST_ASSERT_EQUAL(3, sink.version);
+    TEST_ASSERT_EQUAL(CHUNKS * SCREENS_PER_CHUNK, sink.screens.size());
+    for (uint32_t seq = 0; seq < CHUNKS; seq++) {
+      for (size_t i = 0; i < SCREENS_PER_CHUNK; i++) {
+        TEST_ASSERT_EQUAL_STRING(screenId(seq, i).c_str(), sink.screens[seq * SCREENS_PER_CHUNK + i].c_str());
+      }
+    }
+    if (chunked) TEST_ASSERT_EQUAL(CHUNKS - 1, final_ack);
+  }
+};
+
+void setUp() {
+  host::reset();
+}
+
+void tearDown() {}
+
+void test_each_request_acknowledges_the_previous_chunk() {
+  Transfer t;
+  TEST_ASSERT_TRUE(t.rig.open());
+  t.serveChunks();
+  t.transfer.start();
+  TEST_ASSERT_TRUE(t.runUntilDone());
+
+  t.assertComplete();
+  TEST_ASSERT_EQUAL(CHUNKS, t.requested.size());
+  for (uint32_t seq = 0; seq < CHUNKS; seq++) {
+    TEST_ASSERT_EQUAL(seq, t.requested[seq]);
+    TEST_ASSERT_EQUAL((long)seq - 1, t.acks[seq]);
+  }
+}
+
+void test_resumes_after_the_link_drops() {
+  Transfer t;
+  TEST_ASSERT_TRUE(t.rig.open());
+  t.serveChunks();
+  t.transfer.start();
+
+  // Three chunks in, the link drops with the fourth request unanswered
+  TEST_ASSERT_TRUE(t.rig.runUntil([&t] { return t.requested.size() == 3; }, 1000));
+  t.rig.server.hold(true);
+  TEST_ASSERT_TRUE(t.rig.runUntil([&t] { return t.requested.size() == 4; }, 1000));
+  t.rig.device_link.disconnect();
+  t.rig.rpc.endSession();
+  for (int i = 0; i < 10; i++) t.tick();
+  TEST_ASSERT_FALSE(t.transfer.isActive());
+  TEST_ASSERT_EQUAL(3 * SCREENS_PER_CHUNK, t.sink.screens.size());
+
+  // Back up: the transfer carries on from chunk 3, not from the start
+  t.rig.server.hold(false);
+  t.rig.device_link.connect("device");
+  t.rig.rpc.startSession();
+  TEST_ASSERT_TRUE(t.runUntilDone());
+  t.assertComplete();
+  TEST_ASSERT_EQUAL(1, t.requestsFor(0));
+  TEST_ASSERT_EQUAL(1, t.requestsFor(2));
+  TEST_ASSERT_EQUAL(2, t.requestsFor(3));
+}
+
+void test_dropped_chunk_is_requested_again() {
+  Transfer t;
+  TEST_ASSERT_TRUE(t.rig.open());
+  t.serveChunks();
+  t.transfer.start();
+  TEST_ASSERT_TRUE(t.rig.runUntil([&t] { return t.requested.size() == 2; }, 1000));
+  t.rig.server.drop("get_config_chunk", 1); // chunk 2's request is lost
+
+  TEST_ASSERT_TRUE(t.runUntilDone());
+  t.assertComplete();
+  TEST_ASSERT_EQUAL(1, t.rig.server.dropped);
+  // Asked for twice (the lost request never reached the handler), and the
+  // repeat still acknowledges chunk 1
+  TEST_ASSERT_EQUAL(1, t.requestsFor(2));
+  TEST_ASSERT_EQUAL(CHUNKS + 2, t.rig.server.per_method["get_config_chunk"]); // with the closing ack
+  TEST_ASSERT_EQUAL(1, t.acks[2]);
+}
+
+void test_out_of_order_chunk_is_requested_again() {
+  Transfer t;
+  TEST_ASSERT_TRUE(t.rig.open());
+  t.serveChunks();
+  t.stale_for = 2; // chunk 1 arrives again when chunk 2 is asked for
+  t.transfer.start();
+  TEST_ASSERT_TRUE(t.runUntilDone());
+
+  t.assertComplete();
+  TEST_ASSERT_EQUAL(CHUNKS + 1, t.requested.size());
+  TEST_ASSERT_EQUAL(2, t.requestsFor(2));
+}
+
+void test_failing_chunk_backs_off() {
+  Transfer t;
+  TEST_ASSERT_TRUE(t.rig.open());
+  t.serveChunks();
+  t.failing = 1;
+  t.transfer.start();
+
+  // Enough failures for the wait to reach its cap
+  const size_t ROUND = ConfigTransfer::MAX_RETRIES + 1;
+  while (t.requestsFor(1) < ROUND * 10 + 1) t.tick(5);
+  unsigned long rto = t.rig.rpc.timeoutFor("get_config_chunk");
+
+  std::vector<unsigned long> gaps;
+  for (size_t i = 2; i < t.requested_at.size(); i++) gaps.push_back(t.requested_at[i] - t.requested_at[i - 1]);
+  for (size_t i = 0; i < gaps.size(); i++) {
+    // Within a round an error waits one RTO; after each round the wait doubles
+    unsigned long expected = rto;
+    size_t round = (i + 1) / ROUND;
+    if ((i + 1) % ROUND == 0) {
+      expected = rto << (round < 8 ? round : 8);
+      if (expected > ConfigTransfer::MAX_BACKOFF_MS) expected = ConfigTransfer::MAX_BACKOFF_MS;
+    }
+    TEST_ASSERT_GREATER_OR_EQUAL(expected, gaps[i]);
+    TEST_ASSERT_LESS_OR_EQUAL(expected + 10, gaps[i]);
+  }
+  TEST_ASSERT_GREATER_OR_EQUAL(ConfigTransfer::MAX_BACKOFF_MS, gaps.back());
+
+  // The server recovers: the transfer finishes without starting over
+  t.failing = -1;
+  TEST_ASSERT_TRUE(t.runUntilDone(2 * ConfigTransfer::MAX_BACKOFF_MS));
+  t.assertComplete();
+  TEST_ASSERT_EQUAL(1, t.requestsFor(0));
+}
+
+void test_server_without_chunks_gets_get_config() {
+  Transfer t;
+  TEST_ASSERT_TRUE(t.rig.open());
+  t.rig.server.on("get_config", [](JsonVariantConst params, JsonVariant result) {
+    result["version"] = 3;
+    JsonArray screens = result["screens"].to<JsonArray>();
+    for (uint32_t seq = 0; seq < CHUNKS; seq++) {
+      for (size_t i = 0; i < SCREENS_PER_CHUNK; i++) screens.add<JsonObject>()["id"] = screenId(seq, i);
+    }
+    return true;
+  });
+  t.transfer.start();
+  TEST_ASSERT_TRUE(t.runUntilDone(5000));
+
+  TEST_ASSERT_EQUAL(1, t.rig.server.per_method["get_config_chunk"]); // answered -32601
+  TEST_ASSERT_EQUAL(1, t.rig.server.per_method["get_config"]);
+  t.assertComplete(false);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_each_request_acknowledges_the_previous_chunk);
+  RUN_TEST(test_resumes_after_the_link_drops);
+  RUN_TEST(test_dropped_chunk_is_requested_again);
+  RUN_TEST(test_out_of_order_chunk_is_requested_again);
+  RUN_TEST(test_failing_chunk_backs_off);
+  RUN_TEST(test_server_without_chunks_gets_get_config);
+  return UNITY_END();
+}
@@ -0,0 +1,174 @@
+// OutboundQueue on the SPIFFS fake: records held while the link is down spill
+// to flash, and after reconnecting replay in order, newest value per key, with
+// the log rewritten rather than grown past MAX_LOG_RECORDS lines.
+#include <unity.h>
+#include <vector>
+#include "HostFakes.h"
+#include "rpc/OutboundQueue.hpp"
+
+static const char* LOG_PATH = "/test_outbox.log";
+
+// The receiving end of replay(): takes records while the link is up
+struct Link {
+  bool up = true;
+  size_t budget = SIZE_MAX; // records taken before the link drops
+  std::vector<String> got;  // "<method> <n>" in delivery order
+
+  static bool take(const char* method, JsonVariantConst params, void* ctx) {
+    Link* self = (Link*)ctx;
+    if (!self->up) return false;
+    if (self->budget == 0) {
+      self->up = false;
+      return false;
+    }
+    self->budget--;
+    self->got.push_back(String(method) + " " + String(params["n"].as<int>()));
+    return true;
+  }
+
+  // Replays until the queue is empty or the link is down, like loop() ticks
+  void drain(OutboundQueue &q) {
+    while (up && q.depth() > 0) q.replay(&Link::take, this);
+  }
+};
+
+static void pushCall(OutboundQueue &q, const char* method, int n, const char* key = nullptr) {
+  JsonDocument params;
+  params["n"] = n;
+  TEST_ASSERT_TRUE(q.push(method, params.as<JsonVariantConst>(), key));
+}
+
+static size_t logLines() {
+  File f = SPIFFS.open(LOG_PATH, FILE_READ);
+  size_t lines = 0;
+  while (f && f.available()) {
+    if (f.readStringUntil('\n').length() > 0) lines++;
+  }
+  return lines;
+}
+
+void setUp() {
+  host::reset();
+}
+
+void tearDown() {}
+
+void test_spilled_records_replay_in_order() {
+  OutboundQueue q(LOG_PATH);
+  const int N = 3 * OutboundQueue::RAM_CAPACITY;
+  for (int i = 0; i < N; i++) pushCall(q, "log_event", i);
+  TEST_ASSERT_EQUAL(N, q.depth());
+  TEST_ASSERT_GREATER_THAN(0, logLines()); // the ring overflowed into flash
+
+  Link link;
+  link.drain(q);
+  TEST_ASSERT_EQUAL(N, link.got.size());
+  for (int i = 0; i < N; i++) TEST_ASSERT_EQUAL_STRING(("log_event " + String(i)).c_str(), link.got[i].c_str());
+  TEST_ASSERT_FALSE(SPIFFS.exists(LOG_PATH));
+  TEST_ASSERT_EQUAL(0, q.droppedCount());
+}
+
+void test_only_the_newest_value_per_key_replays() {
+  OutboundQueue q(LOG_PATH);
+  // Two keys rewritten in turn, spilling several times, with unkeyed calls between
+  const int ROUND = 2 + OutboundQueue::RAM_CAPACITY;
+  int n = 0;
+  for (int round = 0; round < 4; round++) {
+    pushCall(q, "update_state", n++, "lamp");
+    pushCall(q, "update_state", n++, "fan");
+    for (size_t i = 0; i < OutboundQueue::RAM_CAPACITY; i++) pushCall(q, "log_event", n++);
+  }
+  TEST_ASSERT_TRUE(q.persist());
+
+  Link link;
+  link.drain(q);
+  std::vector<String> states;
+  for (const String &g : link.got) {
+    if (g.startsWith("update_state")) states.push_back(g);
+  }
+  // The last round's values, in the order they were queued
+  TEST_ASSERT_EQUAL(2, states.size());
+  TEST_ASSERT_EQUAL_STRING(("update_state " + String(3 * ROUND)).c_str(), states[0].c_str());
+  TEST_ASSERT_EQUAL_STRING(("update_state " + String(3 * ROUND + 1)).c_str(), states[1].c_str());
+  TEST_ASSERT_EQUAL(n - 6, link.got.size());
+}
+
+void test_replay_resumes_after_the_link_drops() {
+  OutboundQueue q(LOG_PATH);
+  int n = 0;
+  for (int i = 0; i < 40; i++) pushCall(q, "log_event", n++);
+  TEST_ASSERT_TRUE(q.persist());
+
+  // The link drops partway through the log
+  Link link;
+  link.budget = 25;
+  link.drain(q);
+  TEST_ASSERT_EQUAL(25, link.got.size());
+  TEST_ASSERT_EQUAL(15, q.depth());
+
+  // More records while it is down: the spill drops the replayed lines first
+  for (int i = 0; i < 20; i++) pushCall(q, "log_event", n++);
+  TEST_ASSERT_TRUE(q.persist());
+  TEST_ASSERT_EQUAL(35, logLines());
+
+  // Back up: nothing lost, nothing repeated, still in order
+  link.up = true;
+  link.budget = SIZE_MAX;
+  link.drain(q);
+  TEST_ASSERT_EQUAL(n, link.got.size());
+  for (int i = 0; i < n; i++) TEST_ASSERT_EQUAL_STRING(("log_event " + String(i)).c_str(), link.got[i].c_str());
+  TEST_ASSERT_EQUAL(0, q.depth());
+}
+
+void test_log_never_exceeds_its_record_limit() {
+  OutboundQueue q(LOG_PATH);
+  Link link;
+  link.up = false;
+  int n = 0;
+  // Repeated outages, each replaying part of the log before the next spill
+  for (int outage = 0; outage < 8; outage++) {
+    for (size_t i = 0; i < OutboundQueue::MAX_LOG_RECORDS / 2; i++) pushCall(q, "log_event", n++);
+    TEST_ASSERT_LESS_OR_EQUAL(OutboundQueue::MAX_LOG_RECORDS, logLines());
+    link.up = true;
+    link.budget = OutboundQueue::MAX_LOG_RECORDS / 4;
+    link.drain(q);
+  }
+  TEST_ASSERT_LESS_OR_EQUAL(OutboundQueue::MAX_LOG_RECORDS, logLines());
+
+  // Whatever was dropped for room went oldest first: the rest is still in order
+  link.up = true;
+  link.budget = SIZE_MAX;
+  link.drain(q);
+  TEST_ASSERT_EQUAL(n, link.got.size() + q.droppedCount());
+  for (size_t i = 1; i < link.got.size(); i++) {
+    TEST_ASSERT_LESS_THAN(atoi(link.got[i].c_str() + 10), atoi(link.got[i - 1].c_str() + 10));
+  }
+}
+
+void test_log_survives_a_reboot() {
+  {
+    OutboundQueue q(LOG_PATH);
+    for (int i = 0; i < 5; i++) pushCall(q, "log_event", i);
+    pushCall(q, "update_state", 5, "lamp");
+    pushCall(q, "update_state", 6, "lamp");
+    TEST_ASSERT_TRUE(q.persist());
+  }
+  OutboundQueue q(LOG_PATH);
+  q.begin();
+  TEST_ASSERT_EQUAL(6, q.depth());
+
+  Link link;
+  link.drain(q);
+  TEST_ASSERT_EQUAL(6, link.got.size());
+  TEST_ASSERT_EQUAL_STRING("update_state 6", link.got[5].c_str());
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_spilled_records_replay_in_order);
+  RUN_TEST(test_only_the_newest_value_per_key_replays);
+  RUN_TEST(test_replay_resumes_after_the_link_drops);
+  RUN_TEST(test_log_never_exceeds_its_record_limit);
+  RUN_TEST(test_log_survives_a_reboot);
+  return UNITY_END();
+}
@@ -0,0 +1,153 @@
+// ESP32RPC calls from a render loop: a scene's worth of calls in flight at
+// once must all complete (or time out). Every loop() publishes the calls
+// queued before it, as one batch, and never waits on the clock to do so.
+#include <unity.h>
+#include "RpcTestRig.h"
+
+static const unsigned long FRAME_MS = 16; // ~60 fps
+static const size_t CALLS = 50;
+
+struct RenderLoop {
+  LoopbackRig &rig;
+  size_t frames = 0;
+  size_t blocked = 0;  // loop() calls that moved the clock: delay() or a wait
+  size_t unsent = 0;   // frames whose new calls did not all reach the server
+  size_t extra = 0;    // frames that took more than one message to send them
+
+  explicit RenderLoop(LoopbackRig &rig) : rig(rig) {}
+
+  // One frame, after queueing `issued` calls. The links have no latency, so
+  // whatever rpc.loop() publishes is counted by the server in the same frame.
+  void frame(size_t issued) {
+    size_t calls = rig.server.calls;
+    size_t messages = rig.server.messages;
+    unsigned long t0 = micros();
+    rig.rpc.loop();
+    if (micros() != t0) blocked++;
+    rig.server.loop();
+    if (rig.server.calls - calls != issued) unsent++;
+    if (issued && rig.server.messages - messages != 1) extra++;
+    frames++;
+    host::advanceMs(FRAME_MS);
+  }
+};
+
+void setUp() {
+  host::reset();
+}
+
+void tearDown() {}
+
+void test_fifty_concurrent_calls_complete() {
+  LoopbackRig rig;
+  TEST_ASSERT_TRUE(rig.open());
+  rig.server.on("echo", [](JsonVariantConst params, JsonVariant result) {
+    result.set(params["n"]);
+    return true;
+  });
+  rig.server.hold(true); // no reply is back before the last call goes out
+
+  RenderLoop render(rig);
+  size_t issued = 0, completed = 0, wrong = 0, peak = 0;
+  while (completed < CALLS && render.frames < 200) {
+    // Like a screen populating its components: issue what the lane accepts this frame
+    size_t before = issued;
+    while (issued < CALLS && rig.rpc.canSend(ESP32RPC::Priority::Background)) {
+      JsonDocument params;
+      params["n"] = issued;
+      size_t n = issued;
+      ESP32RPC::CallHandle h = rig.rpc.callAsync("echo", params, [&completed, &wrong, n](bool ok, JsonVariantConst r) {
+        completed++;
+        if (!ok || r.as<size_t>() != n) wrong++;
+      });
+      TEST_ASSERT_NOT_EQUAL(0, h);
+      issued++;
+    }
+    if (rig.rpc.inFlight() > peak) peak = rig.rpc.inFlight();
+    render.frame(issued - before);
+    if (issued == CALLS) rig.server.hold(false);
+  }
+
+  TEST_ASSERT_EQUAL(CALLS, completed);
+  TEST_ASSERT_EQUAL(0, wrong);
+  TEST_ASSERT_EQUAL(CALLS, peak); // all of them were outstanding together
+  TEST_ASSERT_EQUAL(0, rig.rpc.inFlight());
+  // The lane's share of calls went out in the loop() after they were queued
+  TEST_ASSERT_EQUAL(0, render.unsent);
+  TEST_ASSERT_EQUAL(0, render.extra);
+  TEST_ASSERT_EQUAL(0, render.blocked);
+  printf("%u calls in %u frames\n", (unsigned)CALLS, (unsigned)render.frames);
+}
+
+void test_unanswered_calls_time_out_without_stalling() {
+  LoopbackRig rig;
+  TEST_ASSERT_TRUE(rig.open());
+  rig.server.on("echo", [](JsonVariantConst, JsonVariant result) {
+    result.set(true);
+    return true;
+  });
+  rig.server.hold(true); // the server never answers
+
+  RenderLoop render(rig);
+  size_t issued = 0, failed = 0;
+  unsigned long start = millis();
+  while (failed < CALLS && render.frames < 1000) {
+    size_t before = issued;
+    while (issued < CALLS && rig.rpc.canSend(ESP32RPC::Priority::Background)) {
+      TEST_ASSERT_NOT_EQUAL(0, rig.rpc.callAsync("echo", JsonVariantConst(), [&failed](bool ok, JsonVariantConst) {
+        if (!ok) failed++;
+      }, 1000));
+      issued++;
+    }
+    render.frame(issued - before);
+  }
+
+  TEST_ASSERT_EQUAL(CALLS, failed);
+  TEST_ASSERT_LESS_THAN(1000 + 10 * FRAME_MS, millis() - start); // each went at its own deadline
+  TEST_ASSERT_EQUAL(0, render.unsent);
+  TEST_ASSERT_EQUAL(0, render.blocked); // waiting calls never held up a frame
+}
+
+static bool addOne(JsonVariantConst params, JsonVariant result, void*) {
+  result.set((params["n"] | 0) + 1);
+  return true;
+}
+
+void test_requests_and_responses_leave_in_separate_batches() {
+  LoopbackRig rig;
+  TEST_ASSERT_TRUE(rig.open());
+  rig.rpc.registerMethod("add_one", &addOne);
+  rig.server.on("echo", [](JsonVariantConst, JsonVariant result) {
+    result.set(true);
+    return true;
+  });
+
+  // The server's batch and the device's calls are handled in the same tick
+  JsonDocument batch;
+  for (int i = 1; i <= 3; i++) {
+    JsonObject req = batch.add<JsonObject>();
+    req["jsonrpc"] = "2.0";
+    req["method"] = "add_one";
+    req["params"]["n"] = i;
+    req["id"] = i;
+  }
+  rig.server.batch(batch.as<JsonArrayConst>());
+  size_t completed = 0;
+  for (int i = 0; i < 3; i++) {
+    TEST_ASSERT_NOT_EQUAL(0, rig.rpc.callAsync("echo", JsonVariantConst(), [&completed](bool ok, JsonVariantConst) {
+      if (ok) completed++;
+    }));
+  }
+  TEST_ASSERT_TRUE(rig.runUntil([&] { return completed == 3 && rig.server.responses.size() == 3; }, 1000));
+
+  TEST_ASSERT_EQUAL(0, rig.server.mixed_batches);
+  for (JsonDocument &r : rig.server.responses) TEST_ASSERT_EQUAL(r["id"].as<int>() + 1, r["result"].as<int>());
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_fifty_concurrent_calls_complete);
+  RUN_TEST(test_unanswered_calls_time_out_without_stalling);
+  RUN_TEST(test_requests_and_responses_leave_in_separate_batches);
+  return UNITY_END();
+}
@@ -0,0 +1,146 @@
+// Server-request dispatch with a full table of 64 methods: the hashed flat
+// table against the std::map<String, std::function> it replaced, and what
+// happens when two method names share an FNV-1a hash.
+#include <unity.h>
+#include <chrono>
+#include <map>
+#include "RpcTestRig.h"
+
+static const size_t METHODS = ESP32RPC::MAX_METHODS;
+static const size_t ROUNDS = 100;
+
+static char names[METHODS][8]; // registered names must outlive the RPC object
+static uint32_t hits[METHODS];
+
+static bool countCall(JsonVariantConst params, JsonVariant result, void* ctx) {
+  (*(uint32_t*)ctx)++;
+  result.set(true);
+  return true;
+}
+
+typedef std::chrono::steady_clock Clock;
+static double nsSince(Clock::time_point t0) {
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count();
+}
+
+// A Print that only counts, so serializing a reply costs the same on both sides
+class NullPrint : public Print {
+public:
+  size_t write(uint8_t) override { return 1; }
+  size_t write(const uint8_t*, size_t n) override { return n; }
+};
+
+// Dispatch as it was: the method name copied into a String and looked up in a map
+static double legacyNsPerRequest(const std::vector<std::string> &requests) {
+  std::map<String, std::function<JsonVariant(JsonVariantConst, JsonDocument &)>> methods;
+  for (size_t i = 0; i < METHODS; i++) {
+    uint32_t* ctx = &hits[i];
+    methods[names[i]] = [ctx](JsonVariantConst, JsonDocument &out) {
+      (*ctx)++;
+      out.set(true);
+      return out.as<JsonVariant>();
+    };
+  }
+  NullPrint sink;
+  Clock::time_point t0 = Clock::now();
+  for (size_t r = 0; r < ROUNDS; r++) {
+    for (const std::string &req : requests) {
+      JsonDocument doc;
+      deserializeJson(doc, req.data(), req.size());
+      String method = doc["method"] | "";
+      JsonDocument reply;
+      reply["jsonrpc"] = "2.0";
+      auto it = methods.find(method);
+      if (it == methods.end()) {
+        reply["error"]["code"] = -32601;
+      } else {
+        JsonDocument result;
+        reply["result"] = it->second(doc["params"], result);
+      }
+      reply["id"] = doc["id"];
+      serializeJson(reply, sink);
+    }
+  }
+  return nsSince(t0) / (ROUNDS * requests.size());
+}
+
+void setUp() {
+  host::reset();
+  for (size_t i = 0; i < METHODS; i++) {
+    snprintf(names[i], sizeof(names[i]), "m%02u", (unsigned)i);
+    hits[i] = 0;
+  }
+}
+
+void tearDown() {}
+
+void test_dispatch_with_64_methods() {
+  InjectTransport link;
+  ESP32RPC rpc(link);
+  openStored(rpc);
+  for (size_t i = 0; i < METHODS; i++) TEST_ASSERT_TRUE(rpc.registerMethod(names[i], &countCall, &hits[i]));
+  TEST_ASSERT_FALSE(rpc.registerMethod("one_too_many", &countCall, &hits[0]));
+
+  std::vector<std::string> requests;
+  for (size_t i = 0; i < METHODS; i++) {
+    requests.push_back("{\"jsonrpc\":\"2.0\",\"method\":\"" + std::string(names[i]) + "\",\"id\":" + std::to_string(i + 1) + "}");
+  }
+
+  // At most MAX_QUEUED_REQUESTS wait for loop() at a time
+  Clock::time_point t0 = Clock::now();
+  for (size_t r = 0; r < ROUNDS; r++) {
+    for (size_t i = 0; i < METHODS; i++) {
+      link.inject("espdisplay/7/server", requests[i].c_str());
+      if (rpc.queuedRequests() == ESP32RPC::MAX_QUEUED_REQUESTS) rpc.loop();
+    }
+    rpc.loop();
+  }
+  double table_ns = nsSince(t0) / (ROUNDS * METHODS);
+  TEST_ASSERT_EQUAL(0, rpc.busyRejects());
+  for (size_t i = 0; i < METHODS; i++) TEST_ASSERT_EQUAL(ROUNDS, hits[i]);
+
+  double map_ns = legacyNsPerRequest(requests);
+  for (size_t i = 0; i < METHODS; i++) TEST_ASSERT_EQUAL(2 * ROUNDS, hits[i]);
+  printf("%u methods: %.0f ns/request through the table, %.0f ns/request through std::map\n",
+         (unsigned)METHODS, table_ns, map_ns);
+}
+
+static int lastErrorCode(InjectTransport &link) {
+  JsonDocument reply;
+  if (deserializeJson(reply, link.last.data(), link.last.size())) return 0;
+  return reply["error"]["code"] | 0;
+}
+
+void test_hash_collisions_are_refused() {
+  InjectTransport link;
+  ESP32RPC rpc(link);
+  openStored(rpc);
+  uint32_t a = 0, b = 0;
+  static_assert(fnv1a("costarring") == fnv1a("liquid"), "a known FNV-1a collision");
+
+  TEST_ASSERT_TRUE(rpc.registerMethod("costarring", &countCall, &a));
+  TEST_ASSERT_FALSE(rpc.registerMethod("liquid", &countCall, &b)); // would have replaced costarring
+  TEST_ASSERT_TRUE(rpc.registerMethod("costarring", &countCall, &b)); // the same name may be re-registered
+
+  // The name is checked on dispatch: liquid is unknown, not costarring
+  link.inject("espdisplay/7/server", "{\"jsonrpc\":\"2.0\",\"method\":\"liquid\",\"id\":1}");
+  rpc.loop();
+  TEST_ASSERT_EQUAL(-32601, lastErrorCode(link));
+  link.inject("espdisplay/7/server", "{\"jsonrpc\":\"2.0\",\"method\":\"costarring\",\"id\":2}");
+  rpc.loop();
+  TEST_ASSERT_EQUAL(0, lastErrorCode(link));
+  TEST_ASSERT_EQUAL(0, a);
+  TEST_ASSERT_EQUAL(1, b);
+
+  // By hash alone the names are unknown, so only the same handler and ctx may take the entry
+  TEST_ASSERT_TRUE(rpc.registerMethod(fnv1a("altarage"), &countCall, &a));
+  TEST_ASSERT_FALSE(rpc.registerMethod(fnv1a("zinke"), &countCall, &b));
+  TEST_ASSERT_TRUE(rpc.registerMethod(fnv1a("altarage"), &countCall, &a));
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_dispatch_with_64_methods);
+  RUN_TEST(test_hash_collisions_are_refused);
+  return UNITY_END();
+}
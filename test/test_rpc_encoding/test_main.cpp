@@ -0,0 +1,115 @@
+// Wire encodings for a get_config reply with 50 components over 5 screens:
+// encoded size and parse/serialize time, JSON against MessagePack.
+#include <unity.h>
+#include <chrono>
+#include "RpcTestRig.h"
+
+static const size_t SCREENS = 5;
+static const size_t COMPONENTS = 50;
+static const size_t ITERATIONS = 500;
+
+typedef std::chrono::steady_clock Clock;
+static double usSince(Clock::time_point t0) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count() / 1000.0;
+}
+
+// The reply as the server sends it: the config is the result of a JSON-RPC response
+static void buildConfigReply(JsonDocument &doc) {
+  static const char* const types[] = { "light", "cover", "climate", "fan", "lock" };
+  doc["jsonrpc"] = "2.0";
+  doc["id"] = 12;
+  JsonObject cfg = doc["result"].to<JsonObject>();
+  cfg["hash"] = "9f2c41d07a5e";
+  JsonArray groups = cfg["groups"].to<JsonArray>();
+  groups.add("living_room");
+  groups.add("downstairs");
+  JsonArray screens = cfg["screens"].to<JsonArray>();
+  for (size_t s = 0; s < SCREENS; s++) {
+    JsonObject scr = screens.add<JsonObject>();
+    scr["scr_id"] = "scr" + String((unsigned)s);
+    scr["name"] = "Room " + String((unsigned)s);
+    scr["back_screen"] = s == 0 ? "" : "scr0";
+    JsonArray comps = scr["components"].to<JsonArray>();
+    for (size_t c = 0; c < COMPONENTS / SCREENS; c++) {
+      size_t n = s * (COMPONENTS / SCREENS) + c;
+      char comp_id[37];
+      snprintf(comp_id, sizeof(comp_id), "43b418ed-35b4-40e0-b5bd-%012x", (unsigned)n);
+      JsonObject comp = comps.add<JsonObject>();
+      comp["comp_id"] = comp_id;
+      comp["type"] = types[n % 5];
+      JsonObject params = comp["params"].to<JsonObject>();
+      params["label"] = "Component " + String((unsigned)n);
+      params["initial"] = n % 2 == 0;
+      params["min"] = 16;
+      params["max"] = 30;
+      params["step"] = 0.5;
+    }
+  }
+}
+
+struct Timing {
+  size_t bytes = 0;
+  double serialize_us = 0;
+  double parse_us = 0;
+};
+
+template <typename Measure, typename Serialize, typename Deserialize>
+static Timing run(JsonDocument &config, Measure measure, Serialize serialize, Deserialize deserialize) {
+  Timing t;
+  t.bytes = measure(config);
+  std::vector<uint8_t> wire(t.bytes + 1); // room for serializeJson's terminator
+
+  Clock::time_point t0 = Clock::now();
+  for (size_t i = 0; i < ITERATIONS; i++) serialize(config, wire.data(), wire.size());
+  t.serialize_us = usSince(t0) / ITERATIONS;
+
+  // Parsed into the arena, as on the device
+  JsonDocument parsed(&JsonArena::instance());
+  t0 = Clock::now();
+  for (size_t i = 0; i < ITERATIONS; i++) {
+    TEST_ASSERT_FALSE(deserialize(parsed, wire.data(), t.bytes));
+    parsed.clear();
+  }
+  t.parse_us = usSince(t0) / ITERATIONS;
+
+  // Both encodings carry the same document
+  TEST_ASSERT_FALSE(deserialize(parsed, wire.data(), t.bytes));
+  TEST_ASSERT_EQUAL(measureJson(config), measureJson(parsed));
+  TEST_ASSERT_EQUAL(COMPONENTS, parsed["result"]["screens"][SCREENS - 1]["components"].size() * SCREENS);
+  return t;
+}
+
+void setUp() {
+  host::reset();
+}
+
+void tearDown() {}
+
+void test_config_reply_json_vs_msgpack() {
+  JsonDocument config;
+  buildConfigReply(config);
+
+  Timing json = run(config,
+    [](JsonDocument &d) { return measureJson(d); },
+    [](JsonDocument &d, uint8_t* out, size_t n) { return serializeJson(d, (char*)out, n); },
+    [](JsonDocument &d, const uint8_t* in, size_t n) { return deserializeJson(d, in, n); });
+  Timing msgpack = run(config,
+    [](JsonDocument &d) { return measureMsgPack(d); },
+    [](JsonDocument &d, uint8_t* out, size_t n) { return serializeMsgPack(d, out, n); },
+    [](JsonDocument &d, const uint8_t* in, size_t n) { return deserializeMsgPack(d, in, n); });
+
+  printf("%u components  json: %5u bytes, serialize %6.1f us, parse %6.1f us\n",
+         (unsigned)COMPONENTS, (unsigned)json.bytes, json.serialize_us, json.parse_us);
+  printf("%u components  msgpack: %5u bytes, serialize %6.1f us, parse %6.1f us (%.0f%% of the JSON size)\n",
+         (unsigned)COMPONENTS, (unsigned)msgpack.bytes, msgpack.serialize_us, msgpack.parse_us,
+         100.0 * msgpack.bytes / json.bytes);
+
+  // Keys and punctuation shrink; the comp_id strings dominate either way
+  TEST_ASSERT_LESS_THAN(json.bytes, msgpack.bytes);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_config_reply_json_vs_msgpack);
+  return UNITY_END();
+}
@@ -0,0 +1,164 @@
+// Memory high-water of receiving a call's reply, for 1 KB and 8 KB results:
+// the device path (parsed in place from the transport's buffer, document
+// moved into the pending slot) against the path it replaced (payload copied
+// into a String, parsed, then copied member by member into the slot).
+// Peak = heap bytes above the starting point, plus JSON arena bytes.
+#include <unity.h>
+#include "RpcTestRig.h"
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+
+// Every heap block is tracked through glibc, operator new included
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+extern "C" void __libc_free(void*);
+
+// Signed: blocks from allocation functions not wrapped here are still freed here
+static long long heap_live = 0;
+static long long heap_peak = 0;
+
+static void grew(size_t n) {
+  heap_live += (long long)n;
+  if (heap_live > heap_peak) heap_peak = heap_live;
+}
+
+extern "C" void* malloc(size_t n) {
+  void* p = __libc_malloc(n);
+  if (p) grew(malloc_usable_size(p));
+  return p;
+}
+
+extern "C" void* calloc(size_t count, size_t n) {
+  void* p = __libc_calloc(count, n);
+  if (p) grew(malloc_usable_size(p));
+  return p;
+}
+
+extern "C" void* realloc(void* p, size_t n) {
+  size_t old = p ? malloc_usable_size(p) : 0;
+  void* q = __libc_realloc(p, n);
+  if (!q) return q;
+  // A block that moved existed twice for a moment
+  grew(malloc_usable_size(q));
+  heap_live -= (long long)old;
+  return q;
+}
+
+extern "C" void free(void* p) {
+  if (p) heap_live -= (long long)malloc_usable_size(p);
+  __libc_free(p);
+}
+
+#define HEAP_TRACKING 1
+#else
+#define HEAP_TRACKING 0
+#endif
+
+struct Peak {
+  long long heap_base = 0;
+  size_t arena_base = 0;
+
+  void start() {
+#if HEAP_TRACKING
+    heap_base = heap_live;
+    heap_peak = heap_live;
+#endif
+    arena_base = JsonArena::instance().used();
+    JsonArena::instance().resetHighWater();
+  }
+
+  size_t bytes() const {
+#if HEAP_TRACKING
+    return (size_t)(heap_peak - heap_base) + (JsonArena::instance().highWater() - arena_base);
+#else
+    return 0;
+#endif
+  }
+};
+
+// {"jsonrpc":"2.0","result":{"data":"xxx..."},"id":<id>} with a result of about result_len bytes
+static std::vector<uint8_t> replyOf(size_t result_len, uint32_t id) {
+  std::string s = "{\"jsonrpc\":\"2.0\",\"result\":{\"data\":\"";
+  s.append(result_len, 'x');
+  s += "\"},\"id\":" + std::to_string(id) + "}";
+  return std::vector<uint8_t>(s.begin(), s.end());
+}
+
+// The reply path of today's ESP32RPC, from the transport's buffer to the callback
+static size_t devicePeak(size_t result_len) {
+  InjectTransport link;
+  ESP32RPC rpc(link);
+  openStored(rpc);
+
+  size_t got = 0;
+  ESP32RPC::CallHandle h = rpc.callAsync("fetch", JsonVariantConst(), [&got](bool ok, JsonVariantConst result) {
+    if (ok) got = strlen(result["data"] | "");
+  });
+  TEST_ASSERT_NOT_EQUAL(0, h);
+  rpc.loop(); // publishes the call
+
+  std::vector<uint8_t> payload = replyOf(result_len, h); // stands in for the MQTT receive buffer
+  Peak peak;
+  peak.start();
+  link.inject("espdisplay/7/server", payload.data(), payload.size());
+  rpc.loop(); // completes the call
+  size_t bytes = peak.bytes();
+  TEST_ASSERT_EQUAL(result_len, got);
+  return bytes;
+}
+
+// The reply path before in-place parsing
+static size_t legacyPeak(size_t result_len) {
+  std::vector<uint8_t> payload = replyOf(result_len, 1);
+  size_t got = 0;
+  Peak peak;
+  peak.start();
+  {
+    String message;
+    for (size_t i = 0; i < payload.size(); i++) message += (char)payload[i];
+    JsonDocument doc;
+    TEST_ASSERT_FALSE(deserializeJson(doc, message));
+    JsonDocument slot;
+    for (JsonPairConst kv : doc.as<JsonObjectConst>()) slot[kv.key()] = kv.value();
+    got = strlen(slot["result"]["data"] | "");
+  }
+  size_t bytes = peak.bytes();
+  TEST_ASSERT_EQUAL(result_len, got);
+  return bytes;
+}
+
+static void compare(size_t result_len) {
+#if !HEAP_TRACKING
+  TEST_IGNORE_MESSAGE("heap tracking needs glibc");
+#endif
+  size_t device = devicePeak(result_len);
+  size_t legacy = legacyPeak(result_len);
+  printf("%5u byte result: high-water %6u bytes in place, %6u bytes copying\n",
+         (unsigned)result_len, (unsigned)device, (unsigned)legacy);
+  // The String copy and the member-by-member copy are gone; what is left is
+  // the document, including ArduinoJson growing its string buffer
+  TEST_ASSERT_LESS_THAN(legacy, device);
+}
+
+void setUp() {
+  host::reset();
+}
+
+void tearDown() {}
+
+void test_heap_high_water_1k() {
+  compare(1024);
+}
+
+void test_heap_high_water_8k() {
+  compare(8192);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_heap_high_water_1k);
+  RUN_TEST(test_heap_high_water_8k);
+  return UNITY_END();
+}
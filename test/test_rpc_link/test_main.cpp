@@ -0,0 +1,307 @@
+// RPCSystem link supervision against the in-memory broker: losing the broker
+// or the access point must fail waiting calls, back off between reconnect
+// attempts, and come back with the session resubscribed. Once it has a UUID
+// the display keeps a persistent session under it, which brings what the
+// server sent while it slept.
+#include <unity.h>
+#include <vector>
+#include "RpcTestRig.h"
+#include "rpc/MqttTransport.hpp"
+
+static const unsigned long TICK_MS = 10;
+static const char* MAC_CLIENT_ID = "espdisplay-246f28000042"; // the fake WiFi's MAC
+
+// The device's RPCSystem (connecting from loop(): the host has no link task)
+// and a TestServer on its own client of the same broker.
+struct LinkRig {
+  RPCSystem sys;
+  PubSubClient server_mqtt;
+  MqttTransport server_link;
+  TestServer server;
+
+  // Link state entries into Backoff, and when they happened
+  std::vector<unsigned long> backoffs;
+  RPCSystem::LinkState last = RPCSystem::LinkState::Idle;
+
+  LinkRig() : sys("ssid", "password", "broker"), server_link(server_mqtt), server(server_link) {
+    server_mqtt.setBufferSize(RPCSystem::MQTT_BUFFER_SIZE);
+  }
+
+  void tick() {
+    sys.loop();
+    RPCSystem::LinkState s = sys.getState();
+    if (s != last && s == RPCSystem::LinkState::Backoff) backoffs.push_back(millis());
+    last = s;
+    // The fake WiFi is process-wide, so the server drops along with the device
+    if (!server_link.connected() && server_link.connect("test-server")) server.begin();
+    server.loop();
+    host::advanceMs(TICK_MS);
+  }
+
+  template <typename Done>
+  bool runUntil(Done done, unsigned long timeout_ms) {
+    unsigned long start = millis();
+    while (!done()) {
+      if (millis() - start > timeout_ms) return false;
+      tick();
+    }
+    return true;
+  }
+
+  bool ready(unsigned long timeout_ms = 5000) {
+    return runUntil([this] { return sys.isReady(); }, timeout_ms);
+  }
+
+  // An echo call; ok is set from its callback, done once that ran
+  void echo(bool &done, bool &ok) {
+    done = ok = false;
+    ESP32RPC::CallHandle h = sys.getRPC().callAsync("echo", JsonVariantConst(), [&done, &ok](bool success, JsonVariantConst) {
+      done = true;
+      ok = success;
+    });
+    TEST_ASSERT_NOT_EQUAL(0, h);
+  }
+};
+
+static bool serverSubscribed(uint8_t* qos) {
+  return host::broker().subscribed("espdisplay-7", "espdisplay/7/server", qos);
+}
+
+static void broadcastReply(LinkRig &rig, uint32_t request_id, int uuid) {
+  JsonDocument doc;
+  doc["request_type"] = "subscribe_reply";
+  doc["request_id"] = request_id;
+  doc["uuid"] = uuid;
+  String out;
+  serializeJson(doc, out);
+  rig.server_link.publish("espdisplay/broadcast", (const uint8_t*)out.c_str(), out.length());
+}
+
+// The display's connects, in order; the TestServer's are left out
+static std::vector<host::Broker::Connect> deviceConnects() {
+  std::vector<host::Broker::Connect> out;
+  for (const host::Broker::Connect &c : host::broker().connect_log) {
+    if (c.client_id.rfind("espdisplay-", 0) == 0) out.push_back(c);
+  }
+  return out;
+}
+
+static size_t levels_set = 0;
+
+static bool setLevel(JsonVariantConst params, JsonVariant result, void* ctx) {
+  levels_set++;
+  return result.set(true);
+}
+
+void setUp() {
+  host::reset();
+}
+
+void tearDown() {}
+
+void test_first_connect_opens_a_persistent_session() {
+  LinkRig rig;
+  TEST_ASSERT_TRUE(rig.sys.begin(true)); // the task cannot start here; loop() connects
+  TEST_ASSERT_TRUE(rig.ready());
+
+  // Handshake under the MAC client id, then back as espdisplay-7
+  TEST_ASSERT_EQUAL(7, rig.sys.getRPC().getUUID());
+  uint8_t qos = 0;
+  TEST_ASSERT_TRUE(serverSubscribed(&qos));
+  TEST_ASSERT_EQUAL(1, qos);
+  TEST_ASSERT_EQUAL(0, rig.backoffs.size());
+}
+
+// Every display waiting for a UUID hears every reply on the broadcast topic;
+// only the one carrying its own request id may assign it
+void test_uuid_moves_the_display_off_its_clean_mac_session() {
+  LinkRig rig;
+  TEST_ASSERT_TRUE(rig.sys.begin(true));
+  TEST_ASSERT_TRUE(rig.ready());
+
+  // Unassigned, it connects under its MAC with a clean session nothing would
+  // resume; the UUID from the handshake brings the persistent one
+  std::vector<host::Broker::Connect> connects = deviceConnects();
+  TEST_ASSERT_EQUAL(2, connects.size());
+  TEST_ASSERT_EQUAL_STRING(MAC_CLIENT_ID, connects[0].client_id.c_str());
+  TEST_ASSERT_TRUE(connects[0].clean);
+  TEST_ASSERT_EQUAL_STRING("espdisplay-7", connects[1].client_id.c_str());
+  TEST_ASSERT_FALSE(connects[1].clean);
+  TEST_ASSERT_NULL(host::broker().find(MAC_CLIENT_ID)); // gone with the connection
+  TEST_ASSERT_NOT_NULL(host::broker().find("espdisplay-7"));
+}
+
+void test_woken_display_gets_what_was_sent_while_it_slept() {
+  {
+    LinkRig rig;
+    TEST_ASSERT_TRUE(rig.sys.begin(true));
+    TEST_ASSERT_TRUE(rig.ready());
+  } // deep sleep: the device is gone, the broker keeps its session
+
+  // The server sends while it sleeps: QoS 1 waits for it, QoS 0 does not
+  host::broker().publish("espdisplay/7/server",
+                         "{\"jsonrpc\":\"2.0\",\"method\":\"set_level\",\"params\":{\"level\":3},\"id\":41}", 1);
+  host::broker().publish("espdisplay/7/server", "{\"jsonrpc\":\"2.0\",\"method\":\"set_level\"}", 0);
+  TEST_ASSERT_EQUAL(1, host::broker().queued("espdisplay-7"));
+
+  levels_set = 0;
+  size_t before = deviceConnects().size();
+  uint32_t resumes = host::broker().persistent_resumes;
+  LinkRig rig; // wakes with the UUID it stored
+  TEST_ASSERT_TRUE(rig.sys.getRPC().registerMethod("set_level", &setLevel));
+  TEST_ASSERT_TRUE(rig.sys.begin(true));
+  TEST_ASSERT_TRUE(rig.ready());
+
+  // Straight back under its UUID, resuming the session, without a handshake
+  std::vector<host::Broker::Connect> connects = deviceConnects();
+  TEST_ASSERT_EQUAL(before + 1, connects.size());
+  TEST_ASSERT_EQUAL_STRING("espdisplay-7", connects.back().client_id.c_str());
+  TEST_ASSERT_FALSE(connects.back().clean);
+  TEST_ASSERT_EQUAL(resumes + 1, host::broker().persistent_resumes);
+  TEST_ASSERT_EQUAL(0, rig.server.subscribe_request_id);
+
+  // The missed request is replayed and answered
+  TEST_ASSERT_TRUE(rig.runUntil([&rig] { return rig.server.responses.size() == 1; }, 1000));
+  TEST_ASSERT_EQUAL(1, levels_set);
+  TEST_ASSERT_EQUAL(41, rig.server.responses[0]["id"].as<int>());
+  TEST_ASSERT_EQUAL(0, host::broker().queued("espdisplay-7"));
+}
+
+void test_broker_that_lost_the_session_is_subscribed_again() {
+  LinkRig rig;
+  TEST_ASSERT_TRUE(rig.sys.begin(true));
+  TEST_ASSERT_TRUE(rig.ready());
+
+  // The broker restarts without its session store
+  host::broker().setOnline(false);
+  TEST_ASSERT_TRUE(rig.runUntil([&rig] { return rig.sys.getState() == RPCSystem::LinkState::Backoff; }, 100));
+  host::broker().forgetSessions();
+  uint32_t resumes = host::broker().persistent_resumes;
+  host::broker().setOnline(true);
+  TEST_ASSERT_TRUE(rig.ready(RPCSystem::BACKOFF_MAX_MS + 1000));
+
+  // It asked for its session and got a clean one: still persistent from here
+  // on, and subscribed again rather than trusting a session that is gone
+  TEST_ASSERT_EQUAL(resumes, host::broker().persistent_resumes);
+  TEST_ASSERT_FALSE(rig.sys.getMQTT().sessionPresent());
+  TEST_ASSERT_FALSE(deviceConnects().back().clean);
+  uint8_t qos = 0;
+  TEST_ASSERT_TRUE(serverSubscribed(&qos));
+  TEST_ASSERT_EQUAL(1, qos);
+
+  rig.server.on("echo", [](JsonVariantConst, JsonVariant result) { return result.set(true); });
+  bool done, ok;
+  rig.echo(done, ok);
+  TEST_ASSERT_TRUE(rig.runUntil([&done] { return done; }, 2000));
+  TEST_ASSERT_TRUE(ok);
+}
+
+void test_handshake_takes_only_its_own_reply() {
+  LinkRig rig;
+  rig.server.answerSubscribes(false);
+  TEST_ASSERT_TRUE(rig.sys.begin(true));
+  TEST_ASSERT_TRUE(rig.runUntil([&rig] { return rig.server.subscribe_request_id != 0; }, 5000));
+  uint32_t id = rig.server.subscribe_request_id;
+
+  broadcastReply(rig, id + 1, 9);
+  for (int i = 0; i < 10; i++) rig.tick();
+  TEST_ASSERT_EQUAL(-1, rig.sys.getRPC().getUUID());
+  TEST_ASSERT_FALSE(rig.sys.isReady());
+
+  broadcastReply(rig, id, 7);
+  TEST_ASSERT_TRUE(rig.ready());
+  TEST_ASSERT_EQUAL(7, rig.sys.getRPC().getUUID());
+  TEST_ASSERT_EQUAL(0, rig.sys.getRPC().inFlight()); // the handshake gave its slot back
+}
+
+void test_broker_loss_fails_calls_and_backs_off() {
+  LinkRig rig;
+  TEST_ASSERT_TRUE(rig.sys.begin(true));
+  TEST_ASSERT_TRUE(rig.ready());
+  rig.server.on("echo", [](JsonVariantConst, JsonVariant result) {
+    result.set(true);
+    return true;
+  });
+
+  // A call in flight when the broker goes away
+  rig.server.hold(true);
+  bool done, ok;
+  rig.echo(done, ok);
+  rig.tick();
+  host::broker().setOnline(false);
+
+  // endSession fails it at once, not after its timeout
+  TEST_ASSERT_TRUE(rig.runUntil([&done] { return done; }, 100));
+  TEST_ASSERT_FALSE(ok);
+  TEST_ASSERT_EQUAL(0, rig.sys.getRPC().inFlight());
+  TEST_ASSERT_EQUAL(RPCSystem::LinkState::Backoff, rig.sys.getState());
+
+  // Attempts against a dead broker spread out: equal jitter keeps every step
+  // within [step/2, step], so a gap is always longer than the one two back
+  uint32_t connects = host::broker().connects;
+  TEST_ASSERT_TRUE(rig.runUntil([&rig] { return rig.backoffs.size() >= 6; }, 60000));
+  for (size_t i = 3; i < rig.backoffs.size(); i++) {
+    unsigned long gap = rig.backoffs[i] - rig.backoffs[i - 1];
+    unsigned long before = rig.backoffs[i - 2] - rig.backoffs[i - 3];
+    TEST_ASSERT_GREATER_THAN(before, gap);
+  }
+  TEST_ASSERT_EQUAL(connects, host::broker().connects); // none got through
+
+  // Back up: the persistent session resumes and is subscribed again
+  rig.server.hold(false);
+  uint32_t resumes = host::broker().persistent_resumes;
+  uint32_t subscribes = host::broker().subscribes;
+  host::broker().setOnline(true);
+  TEST_ASSERT_TRUE(rig.ready(RPCSystem::BACKOFF_MAX_MS + 1000));
+  TEST_ASSERT_GREATER_THAN(resumes, host::broker().persistent_resumes);
+  TEST_ASSERT_GREATER_THAN(subscribes, host::broker().subscribes);
+  uint8_t qos = 0;
+  TEST_ASSERT_TRUE(serverSubscribed(&qos));
+  TEST_ASSERT_EQUAL(1, qos);
+
+  // And calls work again, with replies arriving on the server topic
+  rig.echo(done, ok);
+  TEST_ASSERT_TRUE(rig.runUntil([&done] { return done; }, 2000));
+  TEST_ASSERT_TRUE(ok);
+}
+
+void test_wifi_loss_rejoins_and_resubscribes() {
+  LinkRig rig;
+  TEST_ASSERT_TRUE(rig.sys.begin(true));
+  TEST_ASSERT_TRUE(rig.ready());
+  rig.server.on("echo", [](JsonVariantConst, JsonVariant result) {
+    result.set(true);
+    return true;
+  });
+
+  uint32_t joins = WiFi.beginCount();
+  host::setWiFiAvailable(false);
+  TEST_ASSERT_TRUE(rig.runUntil([&rig] { return rig.sys.getState() == RPCSystem::LinkState::Backoff; }, 100));
+
+  // Without an AP every retry is a fresh association attempt
+  TEST_ASSERT_TRUE(rig.runUntil([&rig] { return rig.backoffs.size() >= 3; }, 3 * RPCSystem::WIFI_TIMEOUT_MS + 10000));
+  TEST_ASSERT_GREATER_THAN(joins + 1, WiFi.beginCount());
+
+  host::setWiFiAvailable(true);
+  TEST_ASSERT_TRUE(rig.ready(RPCSystem::WIFI_TIMEOUT_MS + RPCSystem::BACKOFF_MAX_MS));
+  uint8_t qos = 0;
+  TEST_ASSERT_TRUE(serverSubscribed(&qos));
+  TEST_ASSERT_EQUAL(1, qos);
+
+  bool done, ok;
+  rig.echo(done, ok);
+  TEST_ASSERT_TRUE(rig.runUntil([&done] { return done; }, 2000));
+  TEST_ASSERT_TRUE(ok);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_first_connect_opens_a_persistent_session);
+  RUN_TEST(test_uuid_moves_the_display_off_its_clean_mac_session);
+  RUN_TEST(test_woken_display_gets_what_was_sent_while_it_slept);
+  RUN_TEST(test_broker_that_lost_the_session_is_subscribed_again);
+  RUN_TEST(test_handshake_takes_only_its_own_reply);
+  RUN_TEST(test_broker_loss_fails_calls_and_backs_off);
+  RUN_TEST(test_wifi_loss_rejoins_and_resubscribes);
+  return UNITY_END();
+}
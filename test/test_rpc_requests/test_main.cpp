@@ -0,0 +1,217 @@
+// Server requests on the device: queued on arrival, run from loop() within the
+// request budget, refused with BUSY_ERROR when the queue is full, and answered
+// in batches that are split when they outgrow the transport's message size.
+#include <unity.h>
+#include <set>
+#include <string>
+#include "RpcTestRig.h"
+
+static const unsigned long SLOW_US = 900; // a handler's run time, on the fake clock
+static const size_t LIMIT = 600;          // message size of the device's link in the split tests
+static const size_t BLOB = 200;           // bytes of one "blob" result
+
+static size_t runs = 0;
+
+static bool slowHandler(JsonVariantConst params, JsonVariant result, void* ctx) {
+  runs++;
+  host::advanceUs(params["us"] | SLOW_US);
+  return result.set(true);
+}
+
+static bool blobHandler(JsonVariantConst params, JsonVariant result, void* ctx) {
+  runs++;
+  std::string blob(params["bytes"] | BLOB, 'x');
+  return result.set(blob.c_str());
+}
+
+// count requests of method, with ids 1..count, as one batch
+static void sendBatch(LoopbackRig &rig, const char* method, size_t count, JsonVariantConst params = JsonVariantConst()) {
+  JsonDocument batch;
+  JsonArray arr = batch.to<JsonArray>();
+  for (size_t i = 0; i < count; i++) {
+    JsonObject req = arr.add<JsonObject>();
+    req["jsonrpc"] = "2.0";
+    req["method"] = method;
+    if (!params.isNull()) req["params"] = params;
+    req["id"] = i + 1;
+  }
+  rig.server.batch(batch.as<JsonArrayConst>());
+}
+
+// Every request 1..count answered exactly once
+static void assertAnswered(const LoopbackRig &rig, size_t count) {
+  TEST_ASSERT_EQUAL(count, rig.server.responses.size());
+  std::set<uint32_t> ids;
+  for (const JsonDocument &r : rig.server.responses) ids.insert(r["id"].as<uint32_t>());
+  TEST_ASSERT_EQUAL(count, ids.size());
+  TEST_ASSERT_EQUAL(1, *ids.begin());
+  TEST_ASSERT_EQUAL(count, *ids.rbegin());
+}
+
+void setUp() {
+  host::reset();
+  runs = 0;
+}
+
+void tearDown() {}
+
+void test_requests_run_within_the_budget() {
+  LoopbackRig rig;
+  TEST_ASSERT_TRUE(rig.open());
+  TEST_ASSERT_TRUE(rig.rpc.registerMethod("slow", &slowHandler));
+  sendBatch(rig, "slow", ESP32RPC::MAX_QUEUED_REQUESTS);
+
+  // A handler that finds the budget spent ends the tick; the rest carry over
+  const size_t per_tick = ESP32RPC::DEFAULT_REQUEST_BUDGET_US / SLOW_US + 1;
+  size_t ticks = 0;
+  while (rig.rpc.queuedRequests() > 0 || ticks == 0) {
+    size_t before = runs;
+    unsigned long start = micros();
+    rig.tick();
+    ticks++;
+    TEST_ASSERT_GREATER_THAN(before, runs);
+    TEST_ASSERT_LESS_OR_EQUAL(per_tick, runs - before);
+    TEST_ASSERT_LESS_OR_EQUAL(ESP32RPC::DEFAULT_REQUEST_BUDGET_US + SLOW_US + 1000, micros() - start);
+  }
+  TEST_ASSERT_EQUAL(ESP32RPC::MAX_QUEUED_REQUESTS, runs);
+  TEST_ASSERT_EQUAL((ESP32RPC::MAX_QUEUED_REQUESTS + per_tick - 1) / per_tick, ticks);
+  rig.tick();
+  assertAnswered(rig, ESP32RPC::MAX_QUEUED_REQUESTS);
+  TEST_ASSERT_EQUAL(0, rig.rpc.busyRejects());
+}
+
+void test_a_handler_over_budget_still_runs_one_per_tick() {
+  LoopbackRig rig;
+  TEST_ASSERT_TRUE(rig.open());
+  TEST_ASSERT_TRUE(rig.rpc.registerMethod("slow", &slowHandler));
+  JsonDocument params;
+  params["us"] = 3 * ESP32RPC::DEFAULT_REQUEST_BUDGET_US;
+  sendBatch(rig, "slow", 3, params.as<JsonVariantConst>());
+
+  for (size_t i = 1; i <= 3; i++) {
+    rig.tick();
+    TEST_ASSERT_EQUAL(i, runs);
+  }
+  rig.tick();
+  assertAnswered(rig, 3);
+}
+
+void test_a_full_queue_answers_busy() {
+  LoopbackRig rig;
+  TEST_ASSERT_TRUE(rig.open());
+  TEST_ASSERT_TRUE(rig.rpc.registerMethod("slow", &slowHandler));
+  const size_t EXTRA = 3;
+  sendBatch(rig, "slow", ESP32RPC::MAX_QUEUED_REQUESTS + EXTRA);
+
+  rig.tick(); // delivered: the queue takes what fits, the rest are refused at once
+  TEST_ASSERT_EQUAL(EXTRA, rig.rpc.busyRejects());
+  TEST_ASSERT_TRUE(rig.runUntil([&rig] { return rig.rpc.queuedRequests() == 0; }, 100));
+  rig.tick();
+  TEST_ASSERT_EQUAL(ESP32RPC::MAX_QUEUED_REQUESTS, runs);
+  TEST_ASSERT_EQUAL(EXTRA, rig.rpc.busyRejects());
+  assertAnswered(rig, ESP32RPC::MAX_QUEUED_REQUESTS + EXTRA);
+  size_t busy = 0;
+  for (const JsonDocument &r : rig.server.responses) {
+    if (r["error"]["code"].as<int>() == ESP32RPC::BUSY_ERROR) {
+      busy++;
+      TEST_ASSERT_GREATER_THAN(ESP32RPC::MAX_QUEUED_REQUESTS, r["id"].as<uint32_t>()); // the ones that did not fit
+    }
+  }
+  TEST_ASSERT_EQUAL(EXTRA, busy);
+}
+
+void test_replies_within_the_limit_leave_as_one_batch() {
+  LoopbackRig rig;
+  TEST_ASSERT_TRUE(rig.open());
+  rig.device_link.setMaxMessageSize(LIMIT);
+  TEST_ASSERT_TRUE(rig.rpc.registerMethod("blob", &blobHandler));
+  size_t before = rig.server.messages;
+  sendBatch(rig, "blob", 2);
+  rig.tick();
+  rig.tick();
+
+  TEST_ASSERT_EQUAL(before + 1, rig.server.messages);
+  TEST_ASSERT_EQUAL(2, rig.server.largest_batch);
+  assertAnswered(rig, 2);
+}
+
+void test_replies_over_the_limit_are_split() {
+  LoopbackRig rig;
+  TEST_ASSERT_TRUE(rig.open());
+  rig.device_link.setMaxMessageSize(LIMIT);
+  TEST_ASSERT_TRUE(rig.rpc.registerMethod("blob", &blobHandler));
+  const size_t COUNT = 6; // about 6 * BLOB bytes together, each well under LIMIT
+  size_t before = rig.server.messages;
+  size_t batches = rig.server.batches;
+  sendBatch(rig, "blob", COUNT);
+  rig.tick();
+  rig.tick();
+
+  TEST_ASSERT_EQUAL(COUNT, runs); // all within one tick's budget
+  TEST_ASSERT_EQUAL(before + COUNT, rig.server.messages);
+  TEST_ASSERT_EQUAL(batches, rig.server.batches); // one plain message each
+  assertAnswered(rig, COUNT);
+}
+
+void test_a_reply_over_the_limit_is_dropped_and_the_rest_go_out() {
+  LoopbackRig rig;
+  TEST_ASSERT_TRUE(rig.open());
+  rig.device_link.setMaxMessageSize(LIMIT);
+  TEST_ASSERT_TRUE(rig.rpc.registerMethod("blob", &blobHandler));
+
+  JsonDocument batch;
+  JsonArray arr = batch.to<JsonArray>();
+  for (uint32_t id = 1; id <= 3; id++) {
+    JsonObject req = arr.add<JsonObject>();
+    req["jsonrpc"] = "2.0";
+    req["method"] = "blob";
+    req["params"]["bytes"] = id == 2 ? 2 * LIMIT : BLOB;
+    req["id"] = id;
+  }
+  rig.server.batch(batch.as<JsonArrayConst>());
+  rig.tick();
+  rig.tick();
+
+  // The server times out on the one no message can carry
+  TEST_ASSERT_EQUAL(3, runs);
+  TEST_ASSERT_EQUAL(2, rig.server.responses.size());
+  TEST_ASSERT_EQUAL(1, rig.server.responses[0]["id"].as<uint32_t>());
+  TEST_ASSERT_EQUAL(3, rig.server.responses[1]["id"].as<uint32_t>());
+}
+
+void test_calls_over_the_limit_are_split() {
+  LoopbackRig rig;
+  TEST_ASSERT_TRUE(rig.open());
+  rig.device_link.setMaxMessageSize(LIMIT);
+  rig.server.on("echo", [](JsonVariantConst params, JsonVariant result) { return result.set(true); });
+  std::string blob(BLOB, 'x');
+  JsonDocument params;
+  params["blob"] = blob.c_str();
+
+  // Two fit one batch; four do not and go one message each
+  const size_t COUNTS[] = { 2, 4 };
+  for (size_t count : COUNTS) {
+    size_t before = rig.server.messages;
+    size_t done = 0;
+    for (size_t i = 0; i < count; i++) {
+      TEST_ASSERT_NOT_EQUAL(0, rig.rpc.callAsync("echo", params.as<JsonVariantConst>(),
+                                                 [&done](bool ok, JsonVariantConst) { done += ok; }));
+    }
+    rig.tick();
+    TEST_ASSERT_EQUAL(before + (count == 2 ? 1 : count), rig.server.messages);
+    TEST_ASSERT_TRUE(rig.runUntil([&done, count] { return done == count; }, 100));
+  }
+  TEST_ASSERT_EQUAL(2, rig.server.largest_batch);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_requests_run_within_the_budget);
+  RUN_TEST(test_a_handler_over_budget_still_runs_one_per_tick);
+  RUN_TEST(test_a_full_queue_answers_busy);
+  RUN_TEST(test_replies_within_the_limit_leave_as_one_batch);
+  RUN_TEST(test_replies_over_the_limit_are_split);
+  RUN_TEST(test_a_reply_over_the_limit_is_dropped_and_the_rest_go_out);
+  RUN_TEST(test_calls_over_the_limit_are_split);
+  return UNITY_END();
+}
@@ -0,0 +1,164 @@
+// How ESP32RPC schedules the device's calls: timeouts that follow each
+// method's measured round trips, and the lanes a tick's calls leave on, in
+// priority order and within each lane's caps.
+#include <unity.h>
+#include <vector>
+#include "RpcTestRig.h"
+
+static const unsigned long LATENCY_MS = 200; // each way, so round trips clear MIN_RTO_MS
+
+// A server answering "echo", recording the order calls reach it
+struct SchedRig {
+  LoopbackRig rig;
+  std::vector<String> arrivals; // params["tag"] of every call, in arrival order
+
+  SchedRig() {
+    rig.server.on("echo", [this](JsonVariantConst params, JsonVariant result) {
+      arrivals.push_back(params["tag"] | "");
+      result.set(true);
+      return true;
+    });
+  }
+
+  ESP32RPC::CallHandle call(const char* tag, ESP32RPC::Priority prio, const char* method = "echo") {
+    JsonDocument params;
+    params["tag"] = tag;
+    return rig.rpc.callAsync(method, params.as<JsonVariantConst>(), [](bool, JsonVariantConst) {}, 0, prio);
+  }
+
+  // One call at a time until n replies have come back
+  void roundTrips(size_t n, const char* method = "echo") {
+    for (size_t i = 0; i < n; i++) {
+      TEST_ASSERT_NOT_EQUAL(0, call("rt", ESP32RPC::Priority::Background, method));
+      TEST_ASSERT_TRUE(rig.runUntil([this] { return rig.rpc.inFlight() == 0; }, 5000));
+    }
+  }
+};
+
+void setUp() {
+  host::reset();
+}
+
+void tearDown() {}
+
+void test_rto_follows_measured_round_trips() {
+  SchedRig s;
+  TEST_ASSERT_TRUE(s.rig.open());
+  s.rig.device_link.setLatency(LATENCY_MS);
+  s.rig.server_link.setLatency(LATENCY_MS);
+  TEST_ASSERT_EQUAL(ESP32RPC::INITIAL_RTO_MS, s.rig.rpc.timeoutFor("echo"));
+
+  s.roundTrips(20);
+  // Steady round trips of 2 * LATENCY_MS: the variance term decays, leaving
+  // the RTO a little above the RTT and far below the unmeasured default
+  unsigned long rto = s.rig.rpc.timeoutFor("echo");
+  TEST_ASSERT_GREATER_OR_EQUAL(2 * LATENCY_MS, rto);
+  TEST_ASSERT_LESS_THAN(3 * LATENCY_MS, rto);
+  TEST_ASSERT_EQUAL(ESP32RPC::INITIAL_RTO_MS, s.rig.rpc.timeoutFor("never_called"));
+
+  // A fast method is clamped to the floor, not timed out after a millisecond
+  s.rig.device_link.setLatency(0);
+  s.rig.server_link.setLatency(0);
+  s.rig.server.on("ping", [](JsonVariantConst, JsonVariant result) { return result.set(true); });
+  s.roundTrips(10, "ping");
+  TEST_ASSERT_EQUAL(ESP32RPC::MIN_RTO_MS, s.rig.rpc.timeoutFor("ping"));
+}
+
+void test_timeouts_double_the_rto_until_a_reply() {
+  SchedRig s;
+  TEST_ASSERT_TRUE(s.rig.open());
+  s.rig.device_link.setLatency(LATENCY_MS);
+  s.rig.server_link.setLatency(LATENCY_MS);
+  s.roundTrips(20);
+  unsigned long rto = s.rig.rpc.timeoutFor("echo");
+
+  // The server stops answering: each timeout doubles the next call's timeout
+  s.rig.server.drop("echo", 3);
+  for (int i = 1; i <= 3; i++) {
+    unsigned long sent = millis();
+    bool failed = false;
+    JsonDocument params;
+    TEST_ASSERT_NOT_EQUAL(0, s.rig.rpc.callAsync("echo", params.as<JsonVariantConst>(),
+                                                 [&failed](bool ok, JsonVariantConst) { failed = !ok; }));
+    TEST_ASSERT_TRUE(s.rig.runUntil([&s] { return s.rig.rpc.inFlight() == 0; }, ESP32RPC::MAX_RTO_MS));
+    TEST_ASSERT_TRUE(failed);
+    TEST_ASSERT_GREATER_OR_EQUAL(rto << (i - 1), millis() - sent);
+    TEST_ASSERT_EQUAL(rto << i, s.rig.rpc.timeoutFor("echo"));
+  }
+
+  // Answered again: the RTO comes back down from its new samples
+  s.roundTrips(20);
+  TEST_ASSERT_LESS_THAN(rto << 3, s.rig.rpc.timeoutFor("echo"));
+}
+
+void test_a_tick_publishes_lanes_in_priority_order() {
+  SchedRig s;
+  TEST_ASSERT_TRUE(s.rig.open());
+  // Issued lowest priority first, within one tick
+  TEST_ASSERT_NOT_EQUAL(0, s.call("telemetry", ESP32RPC::Priority::Telemetry));
+  TEST_ASSERT_NOT_EQUAL(0, s.call("background", ESP32RPC::Priority::Background));
+  TEST_ASSERT_NOT_EQUAL(0, s.call("interactive", ESP32RPC::Priority::Interactive));
+  size_t before = s.rig.server.messages;
+  s.rig.tick();
+
+  // One publish per lane, the Interactive one first
+  TEST_ASSERT_EQUAL(before + 3, s.rig.server.messages);
+  TEST_ASSERT_EQUAL(3, s.arrivals.size());
+  TEST_ASSERT_EQUAL_STRING("interactive", s.arrivals[0].c_str());
+  TEST_ASSERT_EQUAL_STRING("background", s.arrivals[1].c_str());
+  TEST_ASSERT_EQUAL_STRING("telemetry", s.arrivals[2].c_str());
+}
+
+void test_a_full_lane_does_not_hold_up_the_others() {
+  SchedRig s;
+  TEST_ASSERT_TRUE(s.rig.open());
+  s.rig.server.hold(true); // nothing comes back
+
+  const ESP32RPC::Priority telemetry = ESP32RPC::Priority::Telemetry;
+  const size_t cap = ESP32RPC::LANE_MAX_IN_FLIGHT[(size_t)telemetry];
+  for (size_t i = 0; i < cap; i++) TEST_ASSERT_NOT_EQUAL(0, s.call("t", telemetry));
+  TEST_ASSERT_FALSE(s.rig.rpc.canSend(telemetry));
+  TEST_ASSERT_EQUAL(0, s.call("t", telemetry));
+  TEST_ASSERT_EQUAL(cap, s.rig.rpc.inFlight(telemetry));
+
+  // The other lanes still take calls
+  TEST_ASSERT_TRUE(s.rig.rpc.canSend(ESP32RPC::Priority::Interactive));
+  TEST_ASSERT_TRUE(s.rig.rpc.canSend(ESP32RPC::Priority::Background));
+  TEST_ASSERT_NOT_EQUAL(0, s.call("i", ESP32RPC::Priority::Interactive));
+
+  // Replies free the lane again
+  s.rig.server.hold(false);
+  TEST_ASSERT_TRUE(s.rig.runUntil([&s] { return s.rig.rpc.inFlight() == 0; }, 1000));
+  TEST_ASSERT_TRUE(s.rig.rpc.canSend(telemetry));
+}
+
+void test_only_interactive_is_unlimited_within_a_tick() {
+  SchedRig s;
+  TEST_ASSERT_TRUE(s.rig.open());
+  JsonDocument params;
+  for (size_t i = 0; i < ESP32RPC::LANE_MAX_QUEUED; i++) {
+    TEST_ASSERT_TRUE(s.rig.rpc.notify("log", params.as<JsonVariantConst>(), ESP32RPC::Priority::Background));
+  }
+  // The Background lane has queued its share for this tick; Interactive has no share
+  TEST_ASSERT_FALSE(s.rig.rpc.notify("log", params.as<JsonVariantConst>(), ESP32RPC::Priority::Background));
+  TEST_ASSERT_FALSE(s.rig.rpc.canSend(ESP32RPC::Priority::Background));
+  for (size_t i = 0; i < 2 * ESP32RPC::LANE_MAX_QUEUED; i++) {
+    TEST_ASSERT_TRUE(s.rig.rpc.notify("tap", params.as<JsonVariantConst>(), ESP32RPC::Priority::Interactive));
+  }
+
+  // The next tick empties the boxes and the lane takes calls again
+  s.rig.tick();
+  TEST_ASSERT_EQUAL(ESP32RPC::LANE_MAX_QUEUED, s.rig.server.per_method["log"]);
+  TEST_ASSERT_EQUAL(2 * ESP32RPC::LANE_MAX_QUEUED, s.rig.server.per_method["tap"]);
+  TEST_ASSERT_TRUE(s.rig.rpc.canSend(ESP32RPC::Priority::Background));
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_rto_follows_measured_round_trips);
+  RUN_TEST(test_timeouts_double_the_rto_until_a_reply);
+  RUN_TEST(test_a_tick_publishes_lanes_in_priority_order);
+  RUN_TEST(test_a_full_lane_does_not_hold_up_the_others);
+  RUN_TEST(test_only_interactive_is_unlimited_within_a_tick);
+  return UNITY_END();
+}
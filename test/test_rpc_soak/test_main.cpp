@@ -0,0 +1,153 @@
+// A simulated day of mixed traffic through ESP32RPC: the device's calls and
+// telemetry, the server's requests, batches and pushed updates, and once an
+// hour a reply too large for the JSON arena. The arena must be empty after
+// every loop(), keep resetting hour after hour, and send nothing to the heap
+// except the oversize replies.
+#include <unity.h>
+#include <string>
+#include "RpcTestRig.h"
+
+static const unsigned long HOURS = 24;
+static const unsigned long TICK_MS = 1000;
+static const unsigned long TICKS_PER_HOUR = 3600000 / TICK_MS;
+static const size_t OVERSIZE = 3 * JsonArena::SIZE / 2;
+
+static size_t pushed = 0;
+
+static bool ping(JsonVariantConst params, JsonVariant result, void* ctx) {
+  return result.set(params["n"] | 0);
+}
+
+static bool componentUpdate(JsonVariantConst params, JsonVariant result, void* ctx) {
+  pushed++;
+  return true;
+}
+
+// Deterministic sizes, so a failing hour can be replayed
+struct Lcg {
+  uint32_t state = 12345;
+  uint32_t next(uint32_t bound) {
+    state = state * 1664525u + 1013904223u;
+    return (state >> 8) % bound;
+  }
+};
+
+struct Soak {
+  LoopbackRig rig;
+  Lcg lcg;
+  uint32_t next_request_id = 1;
+  size_t calls = 0;
+  size_t calls_ok = 0;
+  size_t requests = 0;
+
+  Soak() {
+    rig.server.on("fetch", [](JsonVariantConst params, JsonVariant result) {
+      std::string blob(params["bytes"] | 0, 'x');
+      return result["data"].set(blob.c_str());
+    });
+    rig.server.on("telemetry", [](JsonVariantConst, JsonVariant) { return true; });
+  }
+
+  void fetch(size_t bytes) {
+    JsonDocument params;
+    params["bytes"] = bytes;
+    ESP32RPC::CallHandle h = rig.rpc.callAsync("fetch", params.as<JsonVariantConst>(), [this, bytes](bool ok, JsonVariantConst result) {
+      if (ok && strlen(result["data"] | "") == bytes) calls_ok++;
+    });
+    TEST_ASSERT_NOT_EQUAL(0, h);
+    calls++;
+  }
+
+  void serverRequest(size_t n) {
+    JsonDocument params;
+    params["n"] = n;
+    rig.server.request("ping", params.as<JsonVariantConst>(), next_request_id++);
+    requests++;
+  }
+
+  // One simulated second of traffic
+  void second(unsigned long t, bool oversize) {
+    JsonDocument params;
+    params["battery"] = 100 - t % 100;
+    rig.rpc.notify("telemetry", params.as<JsonVariantConst>(), ESP32RPC::Priority::Telemetry);
+    if (t % 2 == 0) fetch(16 + lcg.next(2048));
+    if (oversize) fetch(OVERSIZE);
+    if (t % 3 == 0) serverRequest(t);
+    if (t % 5 == 0) {
+      JsonDocument batch;
+      JsonArray arr = batch.to<JsonArray>();
+      for (int i = 0; i < 3; i++) {
+        JsonObject req = arr.add<JsonObject>();
+        req["jsonrpc"] = "2.0";
+        req["method"] = "ping";
+        req["params"]["n"] = i;
+        req["id"] = next_request_id++;
+        requests++;
+      }
+      rig.server.batch(batch.as<JsonArrayConst>());
+    }
+    if (t % 7 == 0) {
+      JsonDocument update;
+      update["comp_id"] = "lamp";
+      update["state"]["brightness"] = lcg.next(256);
+      rig.server.request("component_update", update.as<JsonVariantConst>(), 0);
+    }
+    rig.tick(TICK_MS);
+  }
+};
+
+void setUp() {
+  host::reset();
+  pushed = 0;
+}
+
+void tearDown() {}
+
+void test_arena_resets_through_a_day_of_traffic() {
+  Soak s;
+  TEST_ASSERT_TRUE(s.rig.open());
+  TEST_ASSERT_TRUE(s.rig.rpc.registerMethod("ping", &ping));
+  TEST_ASSERT_TRUE(s.rig.rpc.registerMethod("component_update", &componentUpdate));
+
+  JsonArena &arena = JsonArena::instance();
+  arena.resetHighWater();
+  uint32_t resets = arena.resetCount();
+  size_t oversize_ticks = 0;
+  unsigned long t = 0;
+  for (unsigned long hour = 0; hour < HOURS; hour++) {
+    for (unsigned long i = 0; i < TICKS_PER_HOUR; i++, t++) {
+      bool oversize = i == TICKS_PER_HOUR / 2;
+      uint32_t fallbacks = arena.fallbackCount();
+      s.second(t, oversize);
+      // Every document of the tick's messages is gone with it
+      TEST_ASSERT_EQUAL(0, arena.liveBlocks());
+      TEST_ASSERT_EQUAL(0, arena.used());
+      if (arena.fallbackCount() != fallbacks) {
+        oversize_ticks++;
+        // Only the oversize reply spills: it arrives the tick after its call goes out
+        TEST_ASSERT_EQUAL(TICKS_PER_HOUR / 2 + 1, i);
+      }
+    }
+    // Still resetting in every hour, not just the first: most ticks bring a message
+    TEST_ASSERT_GREATER_THAN(resets + TICKS_PER_HOUR / 2, arena.resetCount());
+    resets = arena.resetCount();
+  }
+  TEST_ASSERT_EQUAL(HOURS, oversize_ticks);
+  TEST_ASSERT_LESS_OR_EQUAL(JsonArena::SIZE, arena.highWater());
+
+  // Nothing lost along the way
+  for (int i = 0; i < 3; i++) s.rig.tick();
+  TEST_ASSERT_EQUAL(s.calls, s.calls_ok);
+  TEST_ASSERT_EQUAL(s.requests, s.rig.server.responses.size());
+  TEST_ASSERT_EQUAL(0, s.rig.rpc.busyRejects());
+  TEST_ASSERT_EQUAL(t / 7 + 1, pushed);
+  printf("%lu h: %u arena resets, high water %u/%u bytes, %u heap fallbacks from %u oversize replies\n",
+         HOURS, (unsigned)arena.resetCount(), (unsigned)arena.highWater(), (unsigned)JsonArena::SIZE,
+         (unsigned)arena.fallbackCount(), (unsigned)oversize_ticks);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_arena_resets_through_a_day_of_traffic);
+  return UNITY_END();
+}
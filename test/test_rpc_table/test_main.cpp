@@ -0,0 +1,231 @@
+// Pending-call bookkeeping: ESP32RPC's fixed slot table with integer ids
+// against the std::map<String, Pending*> with random string ids it replaced.
+// Both run 50 calls in flight per round and report heap allocations and time
+// per call, for issuing a call and for handling its reply.
+#include <unity.h>
+#include <chrono>
+#include <map>
+#include <new>
+#include <vector>
+#include "RpcTestRig.h"
+
+static const size_t CALLS = 50;
+static const size_t ROUNDS = 200;
+
+// ---------------- allocation counting ----------------
+
+static size_t news = 0;      // operator new: containers, Strings, Pending objects
+static size_t json_heap = 0; // JSON document memory taken from the heap
+
+void* operator new(size_t n) {
+  news++;
+  void* p = malloc(n ? n : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](size_t n) { return operator new(n); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+// What ArduinoJson's default allocator does, counted
+class CountingAllocator : public ArduinoJson::Allocator {
+public:
+  void* allocate(size_t n) override { json_heap++; return malloc(n); }
+  void deallocate(void* p) override { free(p); }
+  void* reallocate(void* p, size_t n) override { json_heap++; return realloc(p, n); }
+};
+static CountingAllocator counting;
+
+typedef std::chrono::steady_clock Clock;
+static double nsSince(Clock::time_point t0) {
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count();
+}
+
+struct Figures {
+  double issue_ns = 0;
+  double reply_ns = 0;
+  size_t news = 0;
+  size_t json_heap = 0;
+  size_t calls = 0;
+
+  void print(const char* label) const {
+    printf("%-10s issue %7.0f ns/call  reply %7.0f ns/call  %.2f new + %.2f JSON heap allocations/call\n",
+           label, issue_ns / calls, reply_ns / calls, (double)news / calls, (double)json_heap / calls);
+  }
+};
+
+// ---------------- the slot table, through ESP32RPC ----------------
+
+static Figures runTable(size_t rounds) {
+  InjectTransport link;
+  ESP32RPC rpc(link);
+  openStored(rpc);
+
+  size_t completed = 0;
+  ESP32RPC::CallHandle ids[CALLS];
+  char replies[CALLS][64];
+  Figures fig;
+  for (size_t r = 0; r < rounds; r++) {
+    size_t news_before = news;
+    uint32_t fallbacks_before = JsonArena::instance().fallbackCount();
+
+    // The Background lane takes LANE_MAX_QUEUED calls per tick
+    size_t issued = 0;
+    while (issued < CALLS) {
+      Clock::time_point t0 = Clock::now();
+      while (issued < CALLS && rpc.canSend(ESP32RPC::Priority::Background)) {
+        ids[issued++] = rpc.callAsync("echo", JsonVariantConst(), [&completed](bool, JsonVariantConst) { completed++; });
+      }
+      fig.issue_ns += nsSince(t0);
+      rpc.loop(); // publishes the batch
+    }
+    for (size_t i = 0; i < CALLS; i++) {
+      snprintf(replies[i], sizeof(replies[i]), "{\"jsonrpc\":\"2.0\",\"result\":1,\"id\":%u}", (unsigned)ids[i]);
+    }
+
+    Clock::time_point t0 = Clock::now();
+    for (size_t i = 0; i < CALLS; i++) link.inject("espdisplay/7/server", replies[i]);
+    rpc.loop(); // runs the callbacks
+    fig.reply_ns += nsSince(t0);
+
+    fig.news += news - news_before;
+    fig.json_heap += JsonArena::instance().fallbackCount() - fallbacks_before;
+    fig.calls += CALLS;
+  }
+  TEST_ASSERT_EQUAL(rounds * CALLS, completed);
+  return fig;
+}
+
+// ---------------- the map it replaced ----------------
+
+// The bookkeeping as it was: a heap Pending per call, keyed in a std::map by a
+// random 36-character id, replies matched by string and copied member by member.
+class LegacyCalls {
+public:
+  typedef std::function<void(bool ok, JsonVariantConst result)> ResponseCallback;
+
+  String issue(JsonDocument &outbox, const char* method, ResponseCallback cb) {
+    String id = newId();
+    JsonObject req = outbox.add<JsonObject>();
+    req["jsonrpc"] = "2.0";
+    req["method"] = method;
+    req["id"] = id;
+    Pending* p = new Pending();
+    p->deadline = millis() + 5000;
+    p->cb = cb;
+    pending[id] = p;
+    return id;
+  }
+
+  void reply(const char* payload) {
+    JsonDocument doc(&counting);
+    if (deserializeJson(doc, payload)) return;
+    String id = doc["id"] | "";
+    auto it = pending.find(id);
+    if (it == pending.end()) return;
+    Pending* p = it->second;
+    p->doc.clear();
+    for (JsonPairConst kv : doc.as<JsonObjectConst>()) p->doc[kv.key()] = kv.value();
+    p->done = true;
+  }
+
+  void process() {
+    std::vector<Pending*> finished;
+    unsigned long now = millis();
+    for (auto it = pending.begin(); it != pending.end();) {
+      if (it->second->done || (long)(now - it->second->deadline) >= 0) {
+        finished.push_back(it->second);
+        it = pending.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    for (Pending* p : finished) {
+      if (p->cb) p->cb(p->done, p->doc["result"]);
+      delete p;
+    }
+  }
+
+private:
+  struct Pending {
+    Pending() : doc(&counting) {}
+    JsonDocument doc;
+    unsigned long deadline = 0;
+    bool done = false;
+    ResponseCallback cb;
+  };
+  std::map<String, Pending*> pending;
+
+  static String newId() {
+    char buf[37];
+    for (int i = 0; i < 36; i++) buf[i] = "abcdef0123456789"[esp_random() % 16];
+    buf[36] = 0;
+    return String(buf);
+  }
+};
+
+static Figures runLegacy(size_t rounds) {
+  LegacyCalls legacy;
+  JsonDocument outbox(&counting);
+  size_t completed = 0;
+  String ids[CALLS];
+  char replies[CALLS][80];
+  Figures fig;
+  for (size_t r = 0; r < rounds; r++) {
+    size_t news_before = news;
+    size_t json_before = json_heap;
+
+    Clock::time_point t0 = Clock::now();
+    for (size_t i = 0; i < CALLS; i++) {
+      ids[i] = legacy.issue(outbox, "echo", [&completed](bool, JsonVariantConst) { completed++; });
+    }
+    fig.issue_ns += nsSince(t0);
+    outbox.clear();
+    for (size_t i = 0; i < CALLS; i++) {
+      snprintf(replies[i], sizeof(replies[i]), "{\"jsonrpc\":\"2.0\",\"result\":1,\"id\":\"%s\"}", ids[i].c_str());
+    }
+
+    t0 = Clock::now();
+    for (size_t i = 0; i < CALLS; i++) legacy.reply(replies[i]);
+    legacy.process();
+    fig.reply_ns += nsSince(t0);
+
+    fig.news += news - news_before;
+    fig.json_heap += json_heap - json_before;
+    fig.calls += CALLS;
+  }
+  TEST_ASSERT_EQUAL(rounds * CALLS, completed);
+  return fig;
+}
+
+// ---------------- tests ----------------
+
+void setUp() {
+  host::reset();
+}
+
+void tearDown() {}
+
+void test_table_against_map() {
+  runTable(2); // warm up: first use of the arena and the RTT table
+  runLegacy(2);
+
+  Figures table = runTable(ROUNDS);
+  Figures legacy = runLegacy(ROUNDS);
+  table.print("table");
+  legacy.print("std::map");
+
+  // The table, its ids and the callbacks never touch the heap. JSON memory
+  // only does once the arena is full, which the figures show.
+  TEST_ASSERT_EQUAL(0, table.news);
+  // id String, Pending and map node for every call, at the least
+  TEST_ASSERT_GREATER_OR_EQUAL(3 * legacy.calls, legacy.news);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_table_against_map);
+  return UNITY_END();
+}
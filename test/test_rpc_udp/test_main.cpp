@@ -0,0 +1,429 @@
+// ESP32RPC over UdpTransport against a gateway in the test: subscriptions
+// beyond the send window, batches held while the window is full, the slot kept
+// for Interactive calls, messages too large for a datagram, config chunks
+// sized to fit one, a gateway restart, and call latency next to the MQTT path.
+#include <unity.h>
+#include <deque>
+#include <functional>
+#include <set>
+#include "RpcTestRig.h"
+#include "rpc/UdpTransport.hpp"
+#include "rpc/ConfigTransfer.hpp"
+
+static const uint16_t GATEWAY_PORT = 1885;
+static const uint16_t DEVICE_PORT = 4000;
+
+// The datagram layout of UdpTransport.hpp
+enum DatagramType : uint8_t { HELLO = 1, ACK = 2, SUB = 3, UNSUB = 4, DATA = 5 };
+static const size_t HEADER = 5;
+
+// Answers from the fake network's send hook, since UdpTransport::connect()
+// blocks waiting for its HELLO to be acknowledged. While stalled it drops
+// everything, like a gateway that went away, noting only which messages the
+// device sent; the device's retransmits bring it all back once it returns.
+// With a latency set, datagrams each way wait that long in loop(). When
+// serving, it answers every call itself, as a gateway fronting the server.
+struct Gateway {
+  struct Delayed {
+    unsigned long due;
+    bool to_device;
+    std::vector<uint8_t> data;
+  };
+
+  WiFiUDP udp;
+  bool stalled = false;
+  bool serving = false;
+  unsigned long latency_ms = 0;
+  uint32_t next_seq = 0x10000; // of the DATA it sends the device
+  std::deque<Delayed> in_transit;
+  std::set<uint32_t> seen; // seqs handled, retransmits are acked again but counted once
+  std::vector<std::pair<uint8_t, std::string>> controls; // SUB and UNSUB in arrival order
+  std::set<std::string> subs;
+  std::vector<JsonDocument> messages; // DATA payloads, parsed
+  std::vector<JsonDocument> dropped;  // DATA payloads sent while stalled, retransmits included
+
+  Gateway() {
+    udp.begin(GATEWAY_PORT);
+    host::setUdpDropFilter([this](uint16_t from, uint16_t to, const uint8_t* data, size_t len) {
+      if (to != GATEWAY_PORT) return false;
+      if (stalled) {
+        if (len > HEADER && data[0] == DATA) parse(dropped, data, len);
+      } else if (latency_ms) {
+        in_transit.push_back({ millis() + latency_ms, false, std::vector<uint8_t>(data, data + len) });
+      } else {
+        handle(data, len);
+      }
+      return true; // handled here, nothing for the socket
+    });
+  }
+
+  void loop() {
+    while (!in_transit.empty() && (long)(millis() - in_transit.front().due) >= 0) {
+      Delayed d = std::move(in_transit.front());
+      in_transit.pop_front();
+      if (d.to_device) transmit(d.data.data(), d.data.size());
+      else handle(d.data.data(), d.data.size());
+    }
+  }
+
+  void send(const uint8_t* data, size_t len) {
+    if (latency_ms) in_transit.push_back({ millis() + latency_ms, true, std::vector<uint8_t>(data, data + len) });
+    else transmit(data, len);
+  }
+
+  void transmit(const uint8_t* data, size_t len) {
+    udp.beginPacket("device", DEVICE_PORT);
+    udp.write(data, len);
+    udp.endPacket();
+  }
+
+  // DATA with the gateway's own seq; the device's acks are not waited for
+  void sendData(const char* topic, const String &payload) {
+    std::vector<uint8_t> d(HEADER);
+    d[0] = DATA;
+    for (int i = 0; i < 4; i++) d[1 + i] = (next_seq >> (8 * i)) & 0xff;
+    next_seq++;
+    d.insert(d.end(), topic, topic + strlen(topic) + 1);
+    d.insert(d.end(), payload.c_str(), payload.c_str() + payload.length());
+    send(d.data(), d.size());
+  }
+
+  void handle(const uint8_t* data, size_t len) {
+    if (len < HEADER || data[0] == ACK) return;
+    uint32_t seq = (uint32_t)data[1] | ((uint32_t)data[2] << 8) | ((uint32_t)data[3] << 16) | ((uint32_t)data[4] << 24);
+    uint8_t ack[HEADER] = { ACK, data[1], data[2], data[3], data[4] };
+    send(ack, sizeof(ack));
+    if (!seen.insert(seq).second) return;
+
+    std::string topic((const char*)data + HEADER);
+    if (data[0] == SUB) {
+      controls.emplace_back(SUB, topic);
+      subs.insert(topic);
+    } else if (data[0] == UNSUB) {
+      controls.emplace_back(UNSUB, topic);
+      subs.erase(topic);
+    } else if (data[0] == DATA) {
+      parse(messages, data, len);
+      if (serving) answer(messages.back().as<JsonVariantConst>());
+    }
+  }
+
+  void answer(JsonVariantConst msg) {
+    if (msg.is<JsonArrayConst>()) {
+      for (JsonVariantConst v : msg.as<JsonArrayConst>()) answer(v);
+      return;
+    }
+    if (!msg["method"].is<const char*>() || msg["id"].isNull()) return; // notifications and replies
+    JsonDocument reply;
+    reply["jsonrpc"] = "2.0";
+    reply["id"] = msg["id"];
+    reply["result"] = true;
+    String out;
+    serializeJson(reply, out);
+    sendData("espdisplay/7/server", out);
+  }
+
+  static void parse(std::vector<JsonDocument> &into, const uint8_t* data, size_t len) {
+    size_t at = HEADER + strlen((const char*)data + HEADER) + 1;
+    into.emplace_back();
+    deserializeJson(into.back(), data + at, len - at);
+  }
+
+  // Every JSON-RPC message received, batches unpacked
+  std::vector<JsonVariantConst> rpcMessages() const { return unpack(messages); }
+
+  static std::vector<JsonVariantConst> unpack(const std::vector<JsonDocument> &datagrams) {
+    std::vector<JsonVariantConst> out;
+    for (const JsonDocument &m : datagrams) {
+      if (m.is<JsonArrayConst>()) {
+        for (JsonVariantConst v : m.as<JsonArrayConst>()) out.push_back(v);
+      } else {
+        out.push_back(m.as<JsonVariantConst>());
+      }
+    }
+    return out;
+  }
+
+  size_t count(const char* method) const { return count(messages, method); }
+  size_t countDropped(const char* method) const { return count(dropped, method); }
+
+  static size_t count(const std::vector<JsonDocument> &datagrams, const char* method) {
+    size_t n = 0;
+    for (JsonVariantConst v : unpack(datagrams)) {
+      if (strcmp(v["method"] | "", method) == 0) n++;
+    }
+    return n;
+  }
+
+  bool subscribed(const char* filter) const { return subs.count(filter) == 1; }
+};
+
+struct UdpRig {
+  Gateway gateway;
+  UdpTransport link;
+  ESP32RPC rpc;
+
+  UdpRig() : link("gateway", GATEWAY_PORT, DEVICE_PORT), rpc(link) {}
+
+  void open() {
+    TEST_ASSERT_TRUE(link.connect("espdisplay-7"));
+    openStored(rpc);
+    run(50);
+    TEST_ASSERT_TRUE(gateway.subscribed("espdisplay/7/server"));
+  }
+
+  void run(unsigned long ms) {
+    for (unsigned long i = 0; i < ms; i++) {
+      gateway.loop(); // what is due reaches the device in this pass
+      rpc.loop();
+      host::advanceMs(1);
+    }
+  }
+};
+
+struct NullSink : ConfigSink {
+  void beginConfig(JsonVariantConst) override {}
+  void addScreen(JsonVariantConst) override {}
+  void endConfig() override {}
+};
+
+void setUp() {
+  host::reset();
+}
+
+void tearDown() {}
+
+void test_subscriptions_beyond_the_window_are_queued() {
+  Gateway gateway;
+  UdpTransport link("gateway", GATEWAY_PORT, DEVICE_PORT);
+  TEST_ASSERT_TRUE(link.connect("espdisplay-7"));
+
+  // Acks come back from loop() only, so the window fills after WINDOW of these
+  char filter[32];
+  for (int i = 0; i < 12; i++) {
+    snprintf(filter, sizeof(filter), "espdisplay/state/c%02d", i);
+    TEST_ASSERT_TRUE(link.subscribe(filter, 1));
+  }
+  TEST_ASSERT_EQUAL(UdpTransport::WINDOW, gateway.controls.size());
+  // Changed its mind while the SUB was still queued: only the UNSUB goes out
+  TEST_ASSERT_TRUE(link.unsubscribe("espdisplay/state/c11"));
+
+  for (int i = 0; i < 10; i++) {
+    link.loop();
+    host::advanceMs(1);
+  }
+  TEST_ASSERT_EQUAL(12, gateway.controls.size());
+  for (int i = 0; i < 11; i++) {
+    snprintf(filter, sizeof(filter), "espdisplay/state/c%02d", i);
+    TEST_ASSERT_EQUAL(SUB, gateway.controls[i].first);
+    TEST_ASSERT_EQUAL_STRING(filter, gateway.controls[i].second.c_str()); // in order
+  }
+  TEST_ASSERT_EQUAL(UNSUB, gateway.controls[11].first);
+  TEST_ASSERT_FALSE(gateway.subscribed("espdisplay/state/c11"));
+  TEST_ASSERT_EQUAL(0, link.retransmitCount());
+}
+
+void test_batches_wait_while_the_window_is_full() {
+  UdpRig rig;
+  rig.open();
+
+  // The gateway goes quiet: the window fills, and later ticks' batches must
+  // wait in the outbox rather than be dropped
+  rig.gateway.stalled = true;
+  size_t accepted = 0;
+  for (int tick = 0; tick < 20; tick++) {
+    JsonDocument params;
+    params["n"] = tick;
+    if (rig.rpc.notify("tick", params)) accepted++;
+    rig.run(1);
+  }
+  TEST_ASSERT_GREATER_THAN(UdpTransport::WINDOW, accepted);
+  TEST_ASSERT_EQUAL(0, rig.gateway.count("tick"));
+
+  rig.gateway.stalled = false;
+  rig.run(1000); // through the retransmit backoff
+  TEST_ASSERT_TRUE(rig.link.connected());
+  TEST_ASSERT_EQUAL(accepted, rig.gateway.count("tick"));
+  std::set<int> ns;
+  for (JsonVariantConst v : rig.gateway.rpcMessages()) {
+    if (strcmp(v["method"] | "", "tick") == 0) ns.insert(v["params"]["n"].as<int>());
+  }
+  TEST_ASSERT_EQUAL(accepted, ns.size()); // each once
+}
+
+void test_interactive_call_goes_out_past_a_telemetry_burst() {
+  UdpRig rig;
+  rig.open();
+
+  // Telemetry bursts while the gateway is quiet, until the window holds all
+  // it will give bulk traffic and the lane's batches back up in the outbox
+  rig.gateway.stalled = true;
+  JsonDocument params;
+  for (int tick = 0; tick < 8; tick++) {
+    for (size_t i = 0; i < ESP32RPC::LANE_MAX_QUEUED; i++) {
+      rig.rpc.notify("telemetry", params.as<JsonVariantConst>(), ESP32RPC::Priority::Telemetry);
+    }
+    rig.rpc.loop();
+  }
+  TEST_ASSERT_EQUAL(UdpTransport::WINDOW - UdpTransport::URGENT_SLOTS, rig.gateway.dropped.size());
+
+  // A tap in the same state: published by the very next loop()
+  TEST_ASSERT_NOT_EQUAL(0, rig.rpc.callAsync("tap", params.as<JsonVariantConst>(), [](bool, JsonVariantConst) {}, 0,
+                                             ESP32RPC::Priority::Interactive));
+  rig.rpc.loop();
+  TEST_ASSERT_EQUAL(1, rig.gateway.countDropped("tap"));
+
+  // Once the gateway is back everything arrives, the tap and the burst alike
+  rig.gateway.stalled = false;
+  rig.run(1000);
+  TEST_ASSERT_EQUAL(1, rig.gateway.count("tap"));
+  TEST_ASSERT_GREATER_THAN(0, rig.gateway.count("telemetry"));
+}
+
+void test_oversize_call_fails_at_once_and_the_rest_go_out() {
+  UdpRig rig;
+  rig.open();
+  unsigned long rto = rig.rpc.timeoutFor("big");
+
+  // One batch: a call no datagram can carry, and one that fits
+  JsonDocument big;
+  big["blob"] = std::string(UdpTransport::MAX_DATAGRAM, 'x').c_str();
+  bool big_done = false, big_ok = true, small_done = false, small_ok = false;
+  TEST_ASSERT_NOT_EQUAL(0, rig.rpc.callAsync("big", big, [&](bool ok, JsonVariantConst) { big_done = true; big_ok = ok; }));
+  TEST_ASSERT_NOT_EQUAL(0, rig.rpc.callAsync("small", JsonVariantConst(), [&](bool ok, JsonVariantConst) {
+    small_done = true;
+    small_ok = ok;
+  }));
+  rig.run(2);
+
+  TEST_ASSERT_TRUE(big_done); // not after its timeout
+  TEST_ASSERT_FALSE(big_ok);
+  TEST_ASSERT_EQUAL(rto, rig.rpc.timeoutFor("big")); // and its RTO did not back off
+  TEST_ASSERT_EQUAL(0, rig.gateway.count("big"));
+  TEST_ASSERT_EQUAL(1, rig.gateway.count("small")); // split out of the batch and sent
+  TEST_ASSERT_FALSE(small_done); // still waiting for the server
+}
+
+void test_config_chunks_fit_a_datagram() {
+  UdpRig rig;
+  rig.open();
+  TEST_ASSERT_LESS_THAN(ConfigTransfer::CHUNK_BYTES, rig.rpc.maxMessageSize());
+
+  NullSink sink;
+  ConfigTransfer transfer(rig.rpc, sink);
+  transfer.start();
+  rig.run(2);
+
+  std::vector<JsonVariantConst> sent = rig.gateway.rpcMessages();
+  TEST_ASSERT_EQUAL(1, rig.gateway.count("get_config_chunk"));
+  for (JsonVariantConst v : sent) {
+    if (strcmp(v["method"] | "", "get_config_chunk") != 0) continue;
+    TEST_ASSERT_EQUAL(rig.rpc.maxMessageSize(), v["params"]["max_bytes"].as<size_t>());
+  }
+}
+
+static size_t pings = 0;
+
+static bool ping(JsonVariantConst params, JsonVariant result, void* ctx) {
+  pings++;
+  return true;
+}
+
+static void sendPings(Gateway &gateway, size_t n) {
+  for (size_t i = 0; i < n; i++) gateway.sendData("espdisplay/7/server", "{\"jsonrpc\":\"2.0\",\"method\":\"ping\"}");
+}
+
+void test_gateway_restart_starts_a_new_receive_window() {
+  UdpRig rig;
+  rig.open();
+  pings = 0;
+  TEST_ASSERT_TRUE(rig.rpc.registerMethod("ping", &ping));
+  sendPings(rig.gateway, 5);
+  rig.run(5);
+  TEST_ASSERT_EQUAL(5, pings);
+
+  // A retransmit of something already delivered is still a duplicate
+  rig.gateway.next_seq -= 2;
+  sendPings(rig.gateway, 2);
+  rig.run(5);
+  TEST_ASSERT_EQUAL(5, pings);
+  TEST_ASSERT_EQUAL(2, rig.link.duplicateCount());
+  TEST_ASSERT_EQUAL(0, rig.link.resyncCount());
+
+  // The gateway restarts and picks a new range, this time behind the old one:
+  // it is heard at once, without the device reconnecting
+  rig.gateway.next_seq -= 100000;
+  sendPings(rig.gateway, 3);
+  rig.run(5);
+  TEST_ASSERT_EQUAL(8, pings);
+  TEST_ASSERT_EQUAL(1, rig.link.resyncCount());
+  TEST_ASSERT_EQUAL(2, rig.link.duplicateCount());
+
+  // And the new range is deduplicated like the old one
+  rig.gateway.next_seq -= 1;
+  sendPings(rig.gateway, 1);
+  rig.run(5);
+  TEST_ASSERT_EQUAL(8, pings);
+  TEST_ASSERT_EQUAL(3, rig.link.duplicateCount());
+  TEST_ASSERT_TRUE(rig.link.connected());
+}
+
+// The latency harness: the same calls, made one at a time, over UDP to a
+// gateway on the LAN and over MQTT through a broker. A LoopbackTransport
+// stands in for MQTT, each direction taking two LAN hops (device to broker,
+// broker to server); UDP takes one each way. Both sides answer at once.
+static const unsigned long HOP_MS = 3;
+static const size_t LATENCY_CALLS = 50;
+
+static unsigned long meanRoundTripMs(ESP32RPC &rpc, const std::function<void()> &step) {
+  unsigned long total = 0;
+  for (size_t i = 0; i < LATENCY_CALLS; i++) {
+    bool done = false, ok = false;
+    unsigned long start = millis();
+    TEST_ASSERT_NOT_EQUAL(0, rpc.callAsync("echo", JsonVariantConst(), [&done, &ok](bool success, JsonVariantConst) {
+      done = true;
+      ok = success;
+    }));
+    while (!done && millis() - start < 5000) step();
+    TEST_ASSERT_TRUE(ok);
+    total += millis() - start;
+  }
+  return total / LATENCY_CALLS;
+}
+
+void test_udp_round_trips_beat_mqtt() {
+  UdpRig udp;
+  udp.open();
+  udp.gateway.serving = true;
+  udp.gateway.latency_ms = HOP_MS;
+  unsigned long udp_ms = meanRoundTripMs(udp.rpc, [&udp] { udp.run(1); });
+  TEST_ASSERT_EQUAL(0, udp.link.retransmitCount()); // acks beat the retransmit timer
+
+  host::reset();
+  LoopbackRig mqtt;
+  TEST_ASSERT_TRUE(mqtt.open());
+  mqtt.device_link.setLatency(2 * HOP_MS);
+  mqtt.server_link.setLatency(2 * HOP_MS);
+  mqtt.server.on("echo", [](JsonVariantConst, JsonVariant result) { return result.set(true); });
+  unsigned long mqtt_ms = meanRoundTripMs(mqtt.rpc, [&mqtt] { mqtt.tick(); });
+
+  printf("mean round trip over %u calls, %lu ms per hop: udp %lu ms, mqtt %lu ms\n", (unsigned)LATENCY_CALLS, HOP_MS,
+         udp_ms, mqtt_ms);
+  // One hop each way plus the loop() that takes the reply; the broker adds two more
+  TEST_ASSERT_GREATER_OR_EQUAL(2 * HOP_MS, udp_ms);
+  TEST_ASSERT_LESS_OR_EQUAL(2 * HOP_MS + 1, udp_ms);
+  TEST_ASSERT_GREATER_OR_EQUAL(4 * HOP_MS, mqtt_ms);
+  TEST_ASSERT_GREATER_OR_EQUAL(2 * HOP_MS, mqtt_ms - udp_ms);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_subscriptions_beyond_the_window_are_queued);
+  RUN_TEST(test_batches_wait_while_the_window_is_full);
+  RUN_TEST(test_interactive_call_goes_out_past_a_telemetry_burst);
+  RUN_TEST(test_oversize_call_fails_at_once_and_the_rest_go_out);
+  RUN_TEST(test_config_chunks_fit_a_datagram);
+  RUN_TEST(test_gateway_restart_starts_a_new_receive_window);
+  RUN_TEST(test_udp_round_trips_beat_mqtt);
+  return UNITY_END();
+}
@@ -0,0 +1,133 @@
+// StateUpdateQueue under a burst of taps: a scripted run of 20 toggles must
+// reach the server as far fewer update_state calls, ending on the last state.
+#include <unity.h>
+#include "RpcTestRig.h"
+#include "rpc/StateUpdateQueue.hpp"
+#include "rpc/OutboundQueue.hpp"
+#include "rpc/RPCHash.hpp"
+
+static const size_t TOGGLES = 20;
+static const unsigned long TAP_MS = 30;     // a quick finger on a light switch
+static const unsigned long LATENCY_MS = 40; // each way
+
+// The device queue against a TestServer that acknowledges every update_state
+struct Burst {
+  LoopbackRig rig;
+  StateUpdateQueue queue;
+  std::map<String, bool> server_power; // the last state the server was sent
+
+  Burst() : queue(rig.rpc) {}
+
+  size_t calls() { return rig.server.per_method["update_state"]; }
+
+  // Toggles comp_ids round robin, one tap every TAP_MS, then lets the queue drain
+  void run(const char* const* comp_ids, size_t n_comps) {
+    TEST_ASSERT_TRUE(rig.open());
+    rig.device_link.setLatency(LATENCY_MS);
+    rig.server_link.setLatency(LATENCY_MS);
+    rig.server.on("update_state", [this](JsonVariantConst params, JsonVariant result) {
+      server_power[params["comp_id"].as<const char*>()] = params["state"]["power"].as<bool>();
+      result.set(true);
+      return true;
+    });
+
+    bool power[8] = {};
+    unsigned long next_tap = millis();
+    for (size_t tap = 0; tap < TOGGLES;) {
+      if ((long)(millis() - next_tap) >= 0) {
+        size_t c = tap % n_comps;
+        power[c] = !power[c];
+        JsonDocument state;
+        state["power"] = power[c];
+        TEST_ASSERT_TRUE(queue.push(comp_ids[c], state));
+        next_tap += TAP_MS;
+        tap++;
+      }
+      queue.loop();
+      rig.tick();
+    }
+    TEST_ASSERT_TRUE(rig.runUntil([this] { queue.loop(); return queue.pendingCount() == 0; }, 2000));
+
+    // The server ends up with the state of the last tap on every component
+    for (size_t c = 0; c < n_comps; c++) {
+      TEST_ASSERT_EQUAL(1, server_power.count(comp_ids[c]));
+      TEST_ASSERT_EQUAL(power[c], server_power[comp_ids[c]]);
+    }
+    TEST_ASSERT_EQUAL(calls(), queue.sentCount());
+    TEST_ASSERT_EQUAL(TOGGLES, queue.pushedCount());
+    TEST_ASSERT_EQUAL(0, queue.resentCount());
+
+    printf("%u toggles on %u component(s): %u update_state calls (%u coalesced), %.0f%% fewer messages\n",
+           (unsigned)TOGGLES, (unsigned)n_comps, (unsigned)calls(), (unsigned)queue.coalescedCount(),
+           100.0 * (TOGGLES - calls()) / TOGGLES);
+  }
+};
+
+void setUp() {
+  host::reset();
+}
+
+void tearDown() {}
+
+void test_burst_of_toggles_on_one_component() {
+  static const char* const comps[] = { "43b418ed-35b4-40e0-b5bd-1290fcaa527e" };
+  Burst b;
+  b.run(comps, 1);
+  // A round trip (80 ms) spans more than two taps, so at most every other tap goes out
+  TEST_ASSERT_LESS_OR_EQUAL(TOGGLES / 2, b.calls());
+  TEST_ASSERT_GREATER_THAN(0, b.queue.coalescedCount());
+}
+
+void test_burst_of_toggles_across_components() {
+  static const char* const comps[] = {
+    "43b418ed-35b4-40e0-b5bd-000000000001",
+    "43b418ed-35b4-40e0-b5bd-000000000002",
+  };
+  Burst b;
+  b.run(comps, 2);
+  // Components are independent, but each still collapses its own taps
+  TEST_ASSERT_LESS_THAN(TOGGLES, b.calls());
+}
+
+// comp_id -> power, as replayed from the outbound queue
+static bool collectState(const char* method, JsonVariantConst params, void* ctx) {
+  (*(std::map<String, bool>*)ctx)[params["comp_id"].as<const char*>()] = params["state"]["power"].as<bool>();
+  return true;
+}
+
+void test_drain_keeps_components_whose_ids_collide() {
+  // Different ids, same fnv1a hash: neither may replace the other's state
+  static const char* const comps[] = { "costarring", "liquid" };
+  TEST_ASSERT_EQUAL(fnv1a(comps[0]), fnv1a(comps[1]));
+
+  for (int persisted = 0; persisted < 2; persisted++) {
+    host::reset();
+    LoopbackRig rig;
+    StateUpdateQueue queue(rig.rpc);
+    OutboundQueue outbound("/test_outbox.log");
+    for (int round = 0; round < 2; round++) {
+      for (size_t c = 0; c < 2; c++) {
+        JsonDocument state;
+        state["power"] = (c == 0) == (round == 1); // last round: on, off
+        TEST_ASSERT_TRUE(queue.push(comps[c], state));
+      }
+      TEST_ASSERT_EQUAL(2, queue.drainTo(outbound));
+      if (persisted) TEST_ASSERT_TRUE(outbound.persist());
+    }
+
+    std::map<String, bool> replayed;
+    outbound.replay(&collectState, &replayed);
+    TEST_ASSERT_EQUAL(2, replayed.size());
+    TEST_ASSERT_TRUE(replayed[comps[0]]);
+    TEST_ASSERT_FALSE(replayed[comps[1]]);
+    TEST_ASSERT_EQUAL(0, outbound.depth());
+  }
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_burst_of_toggles_on_one_component);
+  RUN_TEST(test_burst_of_toggles_across_components);
+  RUN_TEST(test_drain_keeps_components_whose_ids_collide);
+  return UNITY_END();
+}